@@ -0,0 +1,231 @@
+// Benchmarks a driver against its chip emulator: control requests and time
+// for init and configure, the cost of reconfiguring, and loopback throughput
+// through a pty compared with the line rate. The loopback data is checked
+// byte for byte.
+//
+//   g++ -std=c++17 -O2 -o emulator_bench emulator_bench.cpp -lusb-1.0
+//   ./emulator_bench -d ch34x -l 125 -r 115200
+//   ./emulator_bench -d cdcacm -l 125 -r 921600
+
+#include "argparse.hpp"
+#include "uss/driver.hpp"
+#include "uss/drivers/cdcacm/cdcacm.hpp"
+#include "uss/drivers/cdcacm/emulator.hpp"
+#include "uss/drivers/ch34x/ch34x.hpp"
+#include "uss/drivers/ch34x/emulator.hpp"
+#include "uss/timing.hpp"
+#include "uss/uss.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <memory>
+#include <string>
+#include <termios.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+using namespace uss;
+
+static uint64_t Requests(ctl::SerialEmulator& device) {
+    return device.GetEmulatorStats().control_requests;
+}
+
+/**
+ * Run Configure and print the requests and time it took
+ */
+static bool Measure(ctl::SerialEmulator& device, const char* what) {
+    uint64_t requests = Requests(device);
+    uint64_t start = timing::Now();
+    error::Result result = device.TryConfigure();
+    uint64_t end = timing::Now();
+    if (!result) {
+        printf("%s failed: %s (%d)\n", what, result.message, result.value);
+        return false;
+    }
+    printf("%s: %llu requests, %.3f ms\n", what,
+           (unsigned long long)(Requests(device) - requests),
+           (end - start) / 1e6);
+    return true;
+}
+
+static bool RunControl(ctl::SerialEmulator& device, BaseDriver& driver) {
+    device.baud_rate = 115200;
+    uint64_t start = timing::Now();
+    error::Result result = device.TrySetDriver(&driver);
+    if (result)
+        result = device.TryConfigure();
+    uint64_t end = timing::Now();
+    if (!result) {
+        printf("init failed: %s (%d)\n", result.message, result.value);
+        return false;
+    }
+    ctl::EmulatorStats stats = device.GetEmulatorStats();
+    ctl::LineState line = device.GetLine();
+    printf("init + configure: %llu requests, %.3f ms, %llu stalled, line "
+           "%u baud\n",
+           (unsigned long long)stats.control_requests, (end - start) / 1e6,
+           (unsigned long long)stats.stalled_requests, line.baud_rate);
+
+    if (!Measure(device, "unchanged configure"))
+        return false;
+
+    device.baud_rate = 57600;
+    device.parity = Parity::Parity_Even;
+    if (!Measure(device, "57600 8E1 configure"))
+        return false;
+
+    // A configure during a break must not end it, nor lose the framing
+    device.SetBreak(true);
+    device.parity = Parity::Parity_None;
+    device.Configure();
+    bool held = device.GetLine().break_on;
+    device.SetBreak(false);
+    line = device.GetLine();
+    printf("8N1 configure during break: break %s, parity %d after\n",
+           held ? "held" : "LOST", (int)line.parity);
+    return held && line.parity == Parity::Parity_None;
+}
+
+static bool RunLoopback(ctl::SerialEmulator& device, const std::string& pty,
+                        uint32_t baud_rate, double seconds) {
+    device.SetControlLatency(0);
+    device.baud_rate = baud_rate;
+    device.parity = Parity::Parity_None;
+    device.Configure();
+
+    output::pty::PtyOutput output(NULL, pty.c_str(), true);
+    output.SetDevice(&device);
+    std::atomic<bool> active(true);
+    std::thread device_thread([&device, &active]() {
+        while (active) {
+            device.Update();
+            usleep(100);
+        }
+    });
+    std::thread output_thread([&output, &active]() {
+        while (active)
+            output.HandleEvents();
+    });
+
+    bool ok = false;
+    int host_fd = open(pty.c_str(), O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if (host_fd < 0) {
+        printf("Failed to open pty %s\n", pty.c_str());
+    } else {
+        termios tty;
+        tcgetattr(host_fd, &tty);
+        cfmakeraw(&tty);
+        tcsetattr(host_fd, TCSANOW, &tty);
+
+        // The line rate as the chip has it programmed
+        ctl::LineState line = device.GetLine();
+        double line_rate = 1e9 / CharacterTime(line.baud_rate, line.data_bits,
+                                               line.parity, line.stop_bits);
+        size_t total = (size_t)(line_rate * seconds);
+        std::vector<uint8_t> sent(total), received;
+        for (size_t i = 0; i < total; i++)
+            sent[i] = (uint8_t)(i * 7);
+
+        size_t written = 0;
+        uint8_t buffer[4096];
+        uint64_t start = timing::Now();
+        uint64_t deadline = start + (uint64_t)(seconds * 4e9) + 2000000000;
+        while (received.size() < total && timing::Now() < deadline) {
+            if (written < total) {
+                ssize_t len = write(host_fd, sent.data() + written,
+                                    std::min<size_t>(4096, total - written));
+                if (len > 0)
+                    written += len;
+            }
+            ssize_t len = read(host_fd, buffer, sizeof(buffer));
+            if (len > 0)
+                received.insert(received.end(), buffer, buffer + len);
+            else
+                usleep(200);
+        }
+        double elapsed = (timing::Now() - start) / 1e9;
+
+        ok = received.size() == total &&
+             memcmp(received.data(), sent.data(), total) == 0;
+        double rate = received.size() / elapsed;
+        printf("loopback at %u baud: %zu/%zu bytes in %.3f s, %.0f B/s = "
+               "%.0f%% of line rate, %s\n",
+               line.baud_rate, received.size(), total, elapsed, rate,
+               rate / line_rate * 100, ok ? "byte-exact" : "MISMATCH");
+        close(host_fd);
+    }
+
+    output.EndTransfers();
+    usleep(20000);
+    active = false;
+    device_thread.join();
+    output_thread.join();
+    return ok;
+}
+
+int main(int argc, char** argv) {
+    argparse::ArgumentParser program("usbselfserial_emulator_bench");
+
+    program.add_argument("-d", "--driver")
+        .required()
+        .help("specify the driver (ch34x, cdcacm).");
+
+    program.add_argument("-l", "--latency")
+        .scan<'u', uint32_t>()
+        .default_value<uint32_t>(125)
+        .help("specify the control transfer round trip in us.");
+
+    program.add_argument("-r", "--baudrate")
+        .scan<'u', uint32_t>()
+        .default_value<uint32_t>(115200)
+        .help("specify the loopback baudrate.");
+
+    program.add_argument("-s", "--seconds")
+        .scan<'g', double>()
+        .default_value<double>(5.0)
+        .help("specify the loopback length in seconds of line time.");
+
+    program.add_argument("-o", "--output")
+        .default_value(std::string("/tmp/uss_emulator"))
+        .help("specify the location of the pty.");
+
+    try {
+        program.parse_args(argc, argv);
+    } catch (const std::runtime_error& err) {
+        std::cerr << err.what() << std::endl;
+        std::cerr << program;
+        std::exit(1);
+    }
+
+    std::string arg_driver = program.get<std::string>("-d");
+    uint32_t arg_latency = program.get<uint32_t>("-l");
+    uint32_t arg_baudrate = program.get<uint32_t>("-r");
+    double arg_seconds = program.get<double>("-s");
+    std::string arg_output = program.get<std::string>("-o");
+
+    // Create a driver and the chip it talks to
+    std::unique_ptr<BaseDriver> driver;
+    std::unique_ptr<ctl::SerialEmulator> device;
+    if (arg_driver == "ch34x") {
+        driver.reset(new driver::ch34x::Ch34xDriver);
+        device.reset(new driver::ch34x::Ch34xEmulator);
+    } else if (arg_driver == "cdcacm") {
+        driver.reset(new driver::cdcacm::CdcAcmDriver);
+        device.reset(new driver::cdcacm::CdcAcmEmulator);
+    } else {
+        printf("Unknown driver type. Please use cdcacm or ch34x.\n");
+        return 1;
+    }
+
+    printf("-> %s, %u us control latency, loopback at %u baud\n",
+           arg_driver.c_str(), arg_latency, arg_baudrate);
+    device->SetControlLatency(arg_latency);
+    if (!RunControl(*device, *driver))
+        return 1;
+    if (!RunLoopback(*device, arg_output, arg_baudrate, arg_seconds))
+        return 1;
+    return 0;
+}
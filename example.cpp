@@ -57,8 +57,8 @@ int main(int argc, char** argv) {
             // Update device
             ctl.Update();
 
-        } catch (const char* error) {
-            printf("Error caught during main loop: %s\n", error);
+        } catch (const std::exception& error) {
+            printf("Error caught during main loop: %s\n", error.what());
             goto clean;
         }
     }
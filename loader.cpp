@@ -2,6 +2,8 @@
 #include "uss/driver.hpp"
 #include "uss/drivers/cdcacm/cdcacm.hpp"
 #include "uss/drivers/ch34x/ch34x.hpp"
+#include "uss/framers/klipper/klipper.hpp"
+#include "uss/realtime.hpp"
 #include "uss/uss.hpp"
 #include <cstdio>
 #include <thread>
@@ -13,15 +15,21 @@ int main(int argc, char** argv) {
     argparse::ArgumentParser program("usbselfserial_creator");
 
     program.add_argument("-v", "--vid", "--vendor-id")
-        .required()
+        .default_value<uint16_t>(0)
         .scan<'x', uint16_t>()
         .help("specify the USB vendor ID.");
 
     program.add_argument("-p", "--pid", "--product-id")
-        .required()
+        .default_value<uint16_t>(0)
         .scan<'x', uint16_t>()
         .help("specify the USB product ID.");
 
+    program.add_argument("--fd")
+        .scan<'i', int>()
+        .default_value<int>(-1)
+        .help("use an already open usbfs fd instead of finding the device "
+              "by vid/pid (no root or hotplug needed).");
+
     program.add_argument("--bus")
         .default_value<uint8_t>(0)
         .scan<'u', uint8_t>()
@@ -32,6 +40,10 @@ int main(int argc, char** argv) {
         .scan<'u', uint8_t>()
         .help("specify the USB port.");
 
+    program.add_argument("--serial")
+        .default_value(std::string(""))
+        .help("specify the USB serial number.");
+
     program.add_argument("-d", "--driver")
         .required()
         .help("specify the driver (ch34x, cdcacm).");
@@ -46,6 +58,40 @@ int main(int argc, char** argv) {
         .default_value<uint32_t>(250000)
         .help("specify the baudrate.");
 
+    program.add_argument("-c", "--capture")
+        .default_value(std::string(""))
+        .help("specify a file to record received data to.");
+
+    program.add_argument("-k", "--klipper")
+        .default_value(false)
+        .implicit_value(true)
+        .help("only pass whole klipper message blocks.");
+
+    program.add_argument("-f", "--flush")
+        .default_value(std::string("latency"))
+        .help("specify the TX flush policy (latency, throughput).");
+
+    program.add_argument("--cpu")
+        .scan<'i', int>()
+        .default_value<int>(-1)
+        .help("specify a CPU to pin the event loop thread to.");
+
+    program.add_argument("--output-cpu")
+        .scan<'i', int>()
+        .default_value<int>(-1)
+        .help("specify a CPU to pin the output threads to.");
+
+    program.add_argument("--priority")
+        .scan<'i', int>()
+        .default_value<int>(0)
+        .help("specify a SCHED_FIFO priority (1-99) for the event loop, "
+              "outputs run one below it.");
+
+    program.add_argument("--mlock")
+        .default_value(false)
+        .implicit_value(true)
+        .help("prefault buffers and lock all memory at startup.");
+
     try {
         program.parse_args(argc, argv);
     } catch (const std::runtime_error& err) {
@@ -58,12 +104,48 @@ int main(int argc, char** argv) {
     uint16_t arg_pid = program.get<uint16_t>("-p");
     uint8_t arg_bus = program.get<uint8_t>("--bus");
     uint8_t arg_port = program.get<uint8_t>("--port");
+    std::string arg_serial = program.get<std::string>("--serial");
     uint32_t arg_baudrate = program.get<uint32_t>("-r");
     std::string arg_driver = program.get<std::string>("-d");
     std::string arg_output = program.get<std::string>("-o");
+    std::string arg_capture = program.get<std::string>("-c");
+    bool arg_klipper = program.get<bool>("-k");
+    std::string arg_flush = program.get<std::string>("-f");
+    int arg_cpu = program.get<int>("--cpu");
+    int arg_output_cpu = program.get<int>("--output-cpu");
+    int arg_priority = program.get<int>("--priority");
+    bool arg_mlock = program.get<bool>("--mlock");
+    int arg_fd = program.get<int>("--fd");
+    uint64_t start_time = timing::Now();
+
+    if (arg_fd < 0 && (arg_vid == 0 || arg_pid == 0)) {
+        printf("Please specify --vid and --pid, or --fd.\n");
+        return 1;
+    }
 
+#if defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x01000108
+    // Handed the device, don't scan the bus (which may need privileges)
+    if (arg_fd >= 0)
+        libusb_set_option(NULL, LIBUSB_OPTION_NO_DEVICE_DISCOVERY);
+#endif
     libusb_init(NULL);
 
+    // Pick when TX data is sent
+    uss::output::pty::FlushConfig flush;
+    if (arg_flush == "latency") {
+        flush.policy = uss::output::pty::FlushPolicy::LowLatency;
+    } else if (arg_flush == "throughput") {
+        flush.policy = uss::output::pty::FlushPolicy::Throughput;
+    } else {
+        printf("Unknown flush policy. Please use latency or throughput.\n");
+        return 1;
+    }
+
+    // Thread scheduling, outputs one priority below the event loop
+    realtime::ThreadOptions loop_thread = {arg_cpu, arg_priority};
+    realtime::ThreadOptions output_threads = {
+        arg_output_cpu, arg_priority > 1 ? arg_priority - 1 : arg_priority};
+
     // Create a driver
     BaseDriver* driver;
     if (arg_driver == "ch34x") {
@@ -83,33 +165,106 @@ int main(int argc, char** argv) {
     // This outputs to a virtual serial port / PTY at /tmp/uss0
     uss::output::pty::PtyOutput output(NULL, arg_output.c_str(), true);
 
+    // Optionally frame klipper message blocks
+    uss::framer::klipper::KlipperFramer framer;
+    if (arg_klipper)
+        output.SetFramer(&framer);
+    output.SetFlushConfig(flush);
+
     // Set output transfer completion callback
     output.SetTransferCompletionCallback(
         [&output](int result) { output.RemoveDevice(); });
 
+    // Optionally share received data between the pty and a capture file
+    bool capture = !arg_capture.empty();
+    uss::output::tee::TeeOutput tee(NULL);
+    uss::output::capture::CaptureSink* capture_sink = NULL;
+    if (capture) {
+        printf("-> recording to %s\n", arg_capture.c_str());
+        capture_sink =
+            new uss::output::capture::CaptureSink(arg_capture.c_str());
+        output.SetExternalReceive(true);
+        tee.AddConsumer(&output, uss::output::tee::SlowConsumerPolicy::Block);
+        tee.AddConsumer(capture_sink);
+        tee.SetTransferCompletionCallback(
+            [&tee](int result) { tee.RemoveDevice(); });
+    }
+
+    // Have transfers and buffers mapped before the first one is needed
+    if (arg_mlock) {
+        transfer::Pool::Instance().Reserve(16);
+        buffer::Allocator::Instance().Reserve(512, 16);
+        if (capture)
+            buffer::Allocator::Instance().Reserve(1024, 72);
+        buffer::Allocator::Instance().Prefault();
+        realtime::LockMemory();
+    }
+
+    // Pick the device, optionally by serial number
+    uss::ctl::ExpectedDeviceData expected = {arg_vid, arg_pid, arg_bus,
+                                             arg_port};
+    if (!arg_serial.empty())
+        expected.serial = arg_serial.c_str();
+
     // Create a device
-    // This uses the device 1a86:7523 and supports hotplug
-    uss::ctl::Hotpluggable ctl(
-        {arg_vid, arg_pid, arg_bus, arg_port},
-        [&output](uss::ctl::Hotpluggable* device) {
-            output.SetDevice(device);
-        }, // Device connected event
-        [&output](uss::ctl::Hotpluggable* device) {
-            output.EndTransfers();
-        }); // Device disconnected event
+    BaseDevice* device;
+    BaseController* ctl;
+    if (arg_fd >= 0) {
+        // Opened for us, no enumeration and no hotplug
+        printf("-> device from fd %i\n", arg_fd);
+        uss::ctl::Wrapped* wrapped = new uss::ctl::Wrapped(arg_fd);
+        device = wrapped;
+        ctl = wrapped;
+    } else {
+        // This uses the device 1a86:7523 and supports hotplug
+        uss::ctl::Hotpluggable* hotpluggable = new uss::ctl::Hotpluggable(
+            expected,
+            [&output, &tee, capture](uss::ctl::Hotpluggable* device) {
+                output.SetDevice(device);
+                if (capture)
+                    tee.SetDevice(device);
+            }, // Device connected event
+            [&output, &tee, capture](uss::ctl::Hotpluggable* device) {
+                output.EndTransfers();
+                if (capture)
+                    tee.EndTransfers();
+            }); // Device disconnected event
+        device = hotpluggable;
+        ctl = hotpluggable;
+    }
 
     // Set device baud rate (250000)
-    ctl.baud_rate = arg_baudrate;
+    device->baud_rate = arg_baudrate;
 
     // Set the device driver to the CH34x one from before
-    ctl.SetDriver(driver);
+    device->SetDriver(driver);
+
+    // A wrapped device is there from the start
+    if (arg_fd >= 0) {
+        output.SetDevice(device);
+        if (capture)
+            tee.SetDevice(device);
+    }
+    printf("-> device ready in %.1f ms\n",
+           (timing::Now() - start_time) / 1000000.0);
 
-    std::thread output_thread([&output, &active]() {
+    std::thread output_thread([&output, &active, output_threads]() {
+        realtime::ApplyToCurrent(output_threads, "output");
         while (active) {
             output.HandleEvents();
         }
     });
 
+    std::thread tee_thread([&tee, &active, capture, output_threads]() {
+        if (capture)
+            realtime::ApplyToCurrent(output_threads, "tee");
+        while (active && capture) {
+            tee.HandleEvents();
+        }
+    });
+
+    realtime::ApplyToCurrent(loop_thread, "event loop");
+
     struct timeval tv = {1L, 0L};
     while (active) {
         // For each loop iteration...
@@ -120,10 +275,10 @@ int main(int argc, char** argv) {
                 goto clean;
 
             // Update device
-            ctl.Update();
+            ctl->Update();
 
-        } catch (const char* error) {
-            printf("Error caught during main loop: %s\n", error);
+        } catch (const std::exception& error) {
+            printf("Error caught during main loop: %s\n", error.what());
             goto clean;
         }
     }
@@ -131,7 +286,10 @@ int main(int argc, char** argv) {
 clean:
     active = false;
     output_thread.join();
+    tee_thread.join();
+    delete device;
     libusb_exit(NULL);
+    delete capture_sink;
     delete driver;
     return 2;
 }
\ No newline at end of file
@@ -0,0 +1,203 @@
+// Measures how long urgent data waits behind bulk data with and without TX
+// pacing. A software device with a draining UART FIFO is driven through the
+// CH34x driver. The host fills it through the pty, then SendUrgent queues a
+// short command, and the time until that command's last byte leaves the line
+// is reported.
+//
+//   g++ -std=c++17 -O2 -o pacing_bench pacing_bench.cpp -lusb-1.0
+//   ./pacing_bench -r 115200 -f 2048 -d 5000
+
+#include "argparse.hpp"
+#include "uss/drivers/ch34x/ch34x.hpp"
+#include "uss/timing.hpp"
+#include "uss/uss.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <string>
+#include <termios.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+using namespace uss;
+
+static const uint8_t UrgentCommand[] = {'S', 'T', 'O', 'P'};
+
+// A device that notes when the urgent command's last byte is on the line
+class UartDevice : public ctl::Software {
+  public:
+    std::atomic<uint64_t> urgent_out{0};
+
+    int DeviceWrite(const uint8_t* data, int length) override {
+        if (length >= (int)sizeof(UrgentCommand) &&
+            memcmp(data, UrgentCommand, sizeof(UrgentCommand)) == 0)
+            urgent_out = timing::Now() + GetUartBacklog() +
+                         sizeof(UrgentCommand) * GetCharacterTime();
+        return length;
+    }
+};
+
+struct RunResult {
+    bool ok;
+    double urgent_ms;      // SendUrgent until its last byte left the line
+    double max_backlog_ms; // TxStats::max_backlog
+};
+
+static RunResult Run(const std::string& pty, uint32_t baud_rate, uint32_t fifo,
+                     size_t bulk, uint32_t drain_us) {
+    UartDevice device;
+    device.baud_rate = baud_rate;
+    device.SetUartFifo(fifo);
+    driver::ch34x::Ch34xDriver driver;
+    device.SetDriver(&driver);
+
+    output::pty::PtyOutput output(NULL, pty.c_str(), true);
+    output.SetTransferSize(0, 512);
+    output::pty::FlushConfig flush;
+    flush.drain_us = drain_us;
+    output.SetFlushConfig(flush);
+    output.SetDevice(&device);
+
+    std::atomic<bool> active(true);
+    std::thread device_thread([&device, &active]() {
+        while (active) {
+            device.Update();
+            usleep(100);
+        }
+    });
+    std::thread output_thread([&output, &active]() {
+        while (active)
+            output.HandleEvents();
+    });
+
+    RunResult result = {false, 0, 0};
+    int host_fd = open(pty.c_str(), O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if (host_fd < 0) {
+        printf("Failed to open pty %s\n", pty.c_str());
+    } else {
+        termios tty;
+        tcgetattr(host_fd, &tty);
+        cfmakeraw(&tty);
+        tcsetattr(host_fd, TCSANOW, &tty);
+
+        // Fill the device and the pty, then let the first transfers land
+        std::string data(bulk, 'm');
+        if (write(host_fd, data.data(), data.size()) == (ssize_t)bulk) {
+            usleep(50000);
+
+            uint64_t start = timing::Now();
+            output.SendUrgent(UrgentCommand, sizeof(UrgentCommand));
+            uint64_t deadline = start + 10000000000ull;
+            while (device.urgent_out == 0 && timing::Now() < deadline)
+                usleep(100);
+
+            if (device.urgent_out != 0) {
+                result.ok = true;
+                result.urgent_ms = (device.urgent_out - start) / 1e6;
+                result.max_backlog_ms = output.GetTxStats().max_backlog / 1e6;
+            }
+        } else {
+            printf("Short write of the bulk data to the pty\n");
+        }
+    }
+
+    output.EndTransfers();
+    usleep(20000);
+    active = false;
+    device_thread.join();
+    output_thread.join();
+    if (host_fd >= 0)
+        close(host_fd);
+    return result;
+}
+
+static bool Report(const std::string& pty, uint32_t baud_rate, uint32_t fifo,
+                   size_t bulk, uint32_t drain_us, int runs) {
+    std::vector<double> urgent;
+    double max_backlog = 0;
+    for (int i = 0; i < runs; i++) {
+        RunResult result = Run(pty, baud_rate, fifo, bulk, drain_us);
+        if (!result.ok) {
+            printf("drain_us=%-6u run %d: urgent data never left\n", drain_us,
+                   i);
+            return false;
+        }
+        urgent.push_back(result.urgent_ms);
+        max_backlog = std::max(max_backlog, result.max_backlog_ms);
+    }
+
+    double sum = 0;
+    for (double ms : urgent)
+        sum += ms;
+    printf("drain_us=%-6u urgent on the line after %.1f / %.1f / %.1f ms "
+           "(min / avg / max), max_backlog %.1f ms\n",
+           drain_us, *std::min_element(urgent.begin(), urgent.end()),
+           sum / urgent.size(), *std::max_element(urgent.begin(), urgent.end()),
+           max_backlog);
+    return true;
+}
+
+int main(int argc, char** argv) {
+    argparse::ArgumentParser program("usbselfserial_pacing_bench");
+
+    program.add_argument("-r", "--baudrate")
+        .scan<'u', uint32_t>()
+        .default_value<uint32_t>(115200)
+        .help("specify the baudrate.");
+
+    program.add_argument("-f", "--fifo")
+        .scan<'u', uint32_t>()
+        .default_value<uint32_t>(2048)
+        .help("specify the device's UART FIFO size in bytes.");
+
+    program.add_argument("-b", "--bulk")
+        .scan<'u', size_t>()
+        .default_value<size_t>(3500)
+        .help("specify the bulk bytes written ahead of the urgent data.");
+
+    program.add_argument("-d", "--drain-us")
+        .scan<'u', uint32_t>()
+        .default_value<uint32_t>(5000)
+        .help("specify the paced run's FlushConfig::drain_us.");
+
+    program.add_argument("-n", "--runs")
+        .scan<'i', int>()
+        .default_value<int>(5)
+        .help("specify the runs per setting.");
+
+    program.add_argument("-o", "--output")
+        .default_value(std::string("/tmp/uss_pacing"))
+        .help("specify the location of the pty.");
+
+    try {
+        program.parse_args(argc, argv);
+    } catch (const std::runtime_error& err) {
+        std::cerr << err.what() << std::endl;
+        std::cerr << program;
+        std::exit(1);
+    }
+
+    uint32_t arg_baudrate = program.get<uint32_t>("-r");
+    uint32_t arg_fifo = program.get<uint32_t>("-f");
+    size_t arg_bulk = program.get<size_t>("-b");
+    uint32_t arg_drain = program.get<uint32_t>("-d");
+    int arg_runs = program.get<int>("-n");
+    std::string arg_output = program.get<std::string>("-o");
+
+    if (arg_runs < 1 || arg_drain == 0) {
+        printf("Need at least one run and a drain_us above 0.\n");
+        return 1;
+    }
+
+    printf("-> %u baud, %u byte FIFO, %zu bulk bytes, %d runs each\n",
+           arg_baudrate, arg_fifo, arg_bulk, arg_runs);
+    if (!Report(arg_output, arg_baudrate, arg_fifo, arg_bulk, 0, arg_runs))
+        return 1;
+    if (!Report(arg_output, arg_baudrate, arg_fifo, arg_bulk, arg_drain,
+                arg_runs))
+        return 1;
+    return 0;
+}
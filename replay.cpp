@@ -0,0 +1,255 @@
+#include "argparse.hpp"
+#include "uss/driver.hpp"
+#include "uss/drivers/cdcacm/cdcacm.hpp"
+#include "uss/drivers/ch34x/ch34x.hpp"
+#include "uss/framers/klipper/klipper.hpp"
+#include "uss/realtime.hpp"
+#include "uss/timing.hpp"
+#include "uss/uss.hpp"
+#include <atomic>
+#include <cstdio>
+#include <fcntl.h>
+#include <sys/poll.h>
+#include <termios.h>
+#include <thread>
+#include <unistd.h>
+
+using namespace uss;
+
+int main(int argc, char** argv) {
+    bool active = true;
+    argparse::ArgumentParser program("usbselfserial_replay");
+
+    program.add_argument("-i", "--input")
+        .required()
+        .help("specify the capture file to play back.");
+
+    program.add_argument("-d", "--driver")
+        .required()
+        .help("specify the driver (ch34x, cdcacm).");
+
+    program.add_argument("-o", "--output")
+        .required()
+        .help("specify the output location of the pty.");
+
+    program.add_argument("-s", "--speed")
+        .default_value<double>(1.0)
+        .scan<'g', double>()
+        .help("specify the playback speed (1 = original timing, 0 = as fast "
+              "as possible).");
+
+    program.add_argument("-r", "--baudrate")
+        .scan<'u', uint32_t>()
+        .default_value<uint32_t>(250000)
+        .help("specify the baudrate.");
+
+    program.add_argument("-k", "--klipper")
+        .default_value(false)
+        .implicit_value(true)
+        .help("only pass whole klipper message blocks.");
+
+    program.add_argument("-f", "--flush")
+        .default_value(std::string("latency"))
+        .help("specify the TX flush policy (latency, throughput).");
+
+    program.add_argument("--cpu")
+        .scan<'i', int>()
+        .default_value<int>(-1)
+        .help("specify a CPU to pin the event loop thread to.");
+
+    program.add_argument("--output-cpu")
+        .scan<'i', int>()
+        .default_value<int>(-1)
+        .help("specify a CPU to pin the output threads to.");
+
+    program.add_argument("--priority")
+        .scan<'i', int>()
+        .default_value<int>(0)
+        .help("specify a SCHED_FIFO priority (1-99) for the event loop, "
+              "outputs run one below it.");
+
+    program.add_argument("--mlock")
+        .default_value(false)
+        .implicit_value(true)
+        .help("prefault buffers and lock all memory at startup.");
+
+    try {
+        program.parse_args(argc, argv);
+    } catch (const std::runtime_error& err) {
+        std::cerr << err.what() << std::endl;
+        std::cerr << program;
+        std::exit(1);
+    }
+
+    std::string arg_input = program.get<std::string>("-i");
+    std::string arg_driver = program.get<std::string>("-d");
+    std::string arg_output = program.get<std::string>("-o");
+    double arg_speed = program.get<double>("-s");
+    uint32_t arg_baudrate = program.get<uint32_t>("-r");
+    bool arg_klipper = program.get<bool>("-k");
+    std::string arg_flush = program.get<std::string>("-f");
+    int arg_cpu = program.get<int>("--cpu");
+    int arg_output_cpu = program.get<int>("--output-cpu");
+    int arg_priority = program.get<int>("--priority");
+    bool arg_mlock = program.get<bool>("--mlock");
+
+    // Pick when TX data is sent
+    uss::output::pty::FlushConfig flush;
+    if (arg_flush == "latency") {
+        flush.policy = uss::output::pty::FlushPolicy::LowLatency;
+    } else if (arg_flush == "throughput") {
+        flush.policy = uss::output::pty::FlushPolicy::Throughput;
+    } else {
+        printf("Unknown flush policy. Please use latency or throughput.\n");
+        return 1;
+    }
+
+    // Thread scheduling, outputs one priority below the event loop
+    realtime::ThreadOptions loop_thread = {arg_cpu, arg_priority};
+    realtime::ThreadOptions output_threads = {
+        arg_output_cpu, arg_priority > 1 ? arg_priority - 1 : arg_priority};
+
+    // Create a driver, and a matching software device layout
+    BaseDriver* driver;
+    ctl::SoftwareLayout layout;
+    if (arg_driver == "ch34x") {
+        driver = new driver::ch34x::Ch34xDriver;
+        layout = ctl::SoftwareLayout::Vendor;
+    } else if (arg_driver == "cdcacm") {
+        driver = new driver::cdcacm::CdcAcmDriver;
+        layout = ctl::SoftwareLayout::CdcAcm;
+    } else {
+        printf("Unknown driver type. Please use cdcacm or ch34x.\n");
+        return 1;
+    }
+
+    printf("-> replay %s via driver %s to pty %s\n", arg_input.c_str(),
+           arg_driver.c_str(), arg_output.c_str());
+
+    // Create an output
+    uss::output::pty::PtyOutput output(NULL, arg_output.c_str(), true);
+
+    // Optionally frame klipper message blocks
+    uss::framer::klipper::KlipperFramer framer;
+    if (arg_klipper)
+        output.SetFramer(&framer);
+    output.SetFlushConfig(flush);
+
+    // Create the replay device
+    ctl::Replay ctl(arg_input.c_str(), arg_speed, layout);
+    ctl.baud_rate = arg_baudrate;
+    ctl.SetDriver(driver);
+
+    // Act as the host on the other side of the pty
+    int host_fd = open(arg_output.c_str(), O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if (host_fd < 0) {
+        printf("Failed to open pty %s\n", arg_output.c_str());
+        return 1;
+    }
+
+    // Host writes the pty can't take right now are counted, not retried
+    uint64_t host_dropped = 0;
+    ctl.SetHostWriteCallback(
+        [host_fd, &host_dropped](const uint8_t* data, size_t length) {
+            ssize_t len = write(host_fd, data, length);
+            if (len < (ssize_t)length)
+                host_dropped += length - (len < 0 ? 0 : len);
+        });
+
+    // Have transfers and buffers mapped before the first one is needed
+    if (arg_mlock) {
+        transfer::Pool::Instance().Reserve(16);
+        buffer::Allocator::Instance().Reserve(512, 16);
+        buffer::Allocator::Instance().Prefault();
+        realtime::LockMemory();
+    }
+
+    output.SetDevice(&ctl);
+
+    std::thread output_thread([&output, &active, output_threads]() {
+        realtime::ApplyToCurrent(output_threads, "output");
+        while (active) {
+            output.HandleEvents();
+        }
+    });
+
+    std::atomic<uint64_t> host_received(0);
+    std::thread host_thread([host_fd, &host_received, &active]() {
+        uint8_t buffer[4096];
+        pollfd pfds[1] = {{host_fd, POLLIN, 0}};
+        while (active) {
+            if (poll(pfds, 1, 100) <= 0)
+                continue;
+            ssize_t len = read(host_fd, buffer, sizeof(buffer));
+            if (len > 0)
+                host_received += len;
+        }
+    });
+
+    realtime::ApplyToCurrent(loop_thread, "event loop");
+
+    uint64_t start = timing::Now();
+    while (!ctl.Finished()) {
+        ctl.Update();
+
+        uint64_t wait = ctl.TimeUntilNextRecord();
+        if (wait > 1000000)
+            wait = 1000000;
+        if (wait > 0)
+            usleep(wait / 1000);
+    }
+    uint64_t elapsed = timing::Now() - start;
+
+    // Let the last RX chunk drain
+    usleep(100000);
+
+    const ctl::ReplayStats& stats = ctl.GetStats();
+    printf("-> %llu records in %.3f s, max lag %.3f ms\n",
+           (unsigned long long)stats.records, elapsed / 1e9,
+           stats.max_lag / 1e6);
+    printf("-> device -> host: %llu bytes (%llu received, %.1f KiB/s)\n",
+           (unsigned long long)stats.device_bytes,
+           (unsigned long long)host_received.load(),
+           stats.device_bytes / 1024.0 / (elapsed / 1e9));
+    printf("-> host -> device: %llu bytes (%llu dropped at pty)\n",
+           (unsigned long long)stats.host_bytes,
+           (unsigned long long)host_dropped);
+    const stats::Histogram& rx_latency = output.GetRxLatency();
+    if (rx_latency.Count() != 0)
+        printf("-> RX arrival to pty: %.3f ms avg, p50 < %.3f ms, p99 < %.3f "
+               "ms, p99.9 < %.3f ms, max %.3f ms\n",
+               rx_latency.Mean() / 1e6, rx_latency.Percentile(0.5) / 1e6,
+               rx_latency.Percentile(0.99) / 1e6,
+               rx_latency.Percentile(0.999) / 1e6, rx_latency.Max() / 1e6);
+    uss::output::pty::TxStats tx = output.GetTxStats();
+    if (tx.transfers != 0)
+        printf("-> %llu TX transfers, %.1f bytes avg, queued %.3f ms avg "
+               "(%.3f max), in flight %.3f ms avg (%.3f max), %u deep\n",
+               (unsigned long long)tx.transfers,
+               (double)tx.bytes / tx.transfers,
+               tx.queue_time / 1e6 / tx.transfers, tx.max_queue_time / 1e6,
+               tx.wire_time / 1e6 / tx.transfers, tx.max_wire_time / 1e6,
+               tx.max_in_flight);
+    if (arg_klipper) {
+        FramingStats framing = framer.GetStats();
+        printf("-> %llu frames, %llu crc errors, %llu resyncs\n",
+               (unsigned long long)framing.frames,
+               (unsigned long long)framing.crc_errors,
+               (unsigned long long)framing.resyncs);
+    }
+
+    // Stop transfers and let the cancellations complete
+    output.EndTransfers();
+    ctl.Update();
+
+    // Wake the output thread so it can exit
+    active = false;
+    tcflush(host_fd, TCIOFLUSH);
+    if (write(host_fd, "", 1) < 0)
+        printf("Failed to wake output thread\n");
+    output_thread.join();
+    host_thread.join();
+    close(host_fd);
+    delete driver;
+    return 0;
+}
\ No newline at end of file
@@ -0,0 +1,361 @@
+// Compares the poll path with the io_uring path for pty outputs. Software echo
+// devices are driven through the CH34x driver, and a forked host process
+// writes to each pty and checks the echo. The library side counts its read,
+// write, poll and io_uring_enter calls by interposing them, so link
+// dynamically (Linux only):
+//
+//   g++ -std=c++17 -O2 -DUSS_IO_URING -o uring_bench uring_bench.cpp -lusb-1.0
+//   for n in 1 16 128; do
+//       ./uring_bench -p poll -n $n; ./uring_bench -p ring -n $n
+//   done
+
+#include "argparse.hpp"
+#include "uss/drivers/ch34x/ch34x.hpp"
+#include "uss/timing.hpp"
+#include "uss/uring.hpp"
+#include "uss/uss.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cstdarg>
+#include <cstdio>
+#include <deque>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <memory>
+#include <sys/poll.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#if !defined(USS_IO_URING)
+int main() {
+    printf("Build with -DUSS_IO_URING to compare the poll and ring paths.\n");
+    return 1;
+}
+#else
+using namespace uss;
+
+static std::atomic<uint64_t> count_read(0);
+static std::atomic<uint64_t> count_write(0);
+static std::atomic<uint64_t> count_poll(0);
+static std::atomic<uint64_t> count_enter(0);
+static std::atomic<uint64_t> count_sleep(0);
+
+template <typename T> static T Next(const char* name) {
+    return (T)dlsym(RTLD_NEXT, name);
+}
+
+// Counting wrappers, these take precedence over libc's
+extern "C" {
+ssize_t read(int fd, void* buf, size_t count) {
+    static auto next = Next<ssize_t (*)(int, void*, size_t)>("read");
+    count_read++;
+    return next(fd, buf, count);
+}
+
+ssize_t write(int fd, const void* buf, size_t count) {
+    static auto next = Next<ssize_t (*)(int, const void*, size_t)>("write");
+    count_write++;
+    return next(fd, buf, count);
+}
+
+int poll(struct pollfd* fds, nfds_t nfds, int timeout) {
+    static auto next = Next<int (*)(struct pollfd*, nfds_t, int)>("poll");
+    count_poll++;
+    return next(fds, nfds, timeout);
+}
+
+int ppoll(struct pollfd* fds, nfds_t nfds, const struct timespec* timeout,
+          const sigset_t* sigmask) {
+    static auto next =
+        Next<int (*)(struct pollfd*, nfds_t, const struct timespec*,
+                     const sigset_t*)>("ppoll");
+    count_poll++;
+    return next(fds, nfds, timeout, sigmask);
+}
+
+// uring::Ring calls io_uring_enter through syscall(), which takes at most
+// six arguments
+long syscall(long number, ...) {
+    static auto next = Next<long (*)(long, ...)>("syscall");
+    long args[6];
+    va_list ap;
+    va_start(ap, number);
+    for (int i = 0; i < 6; i++)
+        args[i] = va_arg(ap, long);
+    va_end(ap);
+    if (number == __NR_io_uring_enter)
+        count_enter++;
+    return next(number, args[0], args[1], args[2], args[3], args[4],
+                args[5]);
+}
+
+int usleep(useconds_t usec) {
+    static auto next = Next<int (*)(useconds_t)>("usleep");
+    count_sleep++;
+    return next(usec);
+}
+}
+
+// A device that sends back whatever the host writes
+class EchoDevice : public ctl::Software {
+  public:
+    int DeviceWrite(const uint8_t* data, int length) override {
+        pending.insert(pending.end(), data, data + length);
+        return length;
+    }
+
+    int DeviceRead(uint8_t* buffer, int length) override {
+        int count = (int)std::min<size_t>(length, pending.size());
+        std::copy(pending.begin(), pending.begin() + count, buffer);
+        pending.erase(pending.begin(), pending.begin() + count);
+        return count;
+    }
+
+  private:
+    std::deque<uint8_t> pending;
+};
+
+static std::string PtyPath(const std::string& dir, int index) {
+    return dir + "/uss_bench" + std::to_string(index);
+}
+
+// Pattern byte for a device, so crossed streams show up as errors
+static uint8_t Pattern(size_t offset, int index) {
+    return (uint8_t)(offset + index);
+}
+
+// Host side: write `total` bytes to every pty in `chunk` sized writes, keeping
+// at most 4 KiB in flight, and check what comes back
+static int RunHost(const std::string& dir, int devices, size_t total,
+                   size_t chunk) {
+    std::vector<int> fds(devices);
+    std::vector<size_t> sent(devices), received(devices);
+    for (int i = 0; i < devices; i++) {
+        fds[i] = open(PtyPath(dir, i).c_str(), O_RDWR | O_NOCTTY | O_NONBLOCK);
+        if (fds[i] < 0) {
+            fprintf(stderr, "host: failed to open %s\n",
+                    PtyPath(dir, i).c_str());
+            return 1;
+        }
+        termios tty;
+        tcgetattr(fds[i], &tty);
+        cfmakeraw(&tty);
+        tcsetattr(fds[i], TCSANOW, &tty);
+    }
+
+    std::vector<pollfd> pfds(devices);
+    std::vector<uint8_t> out(chunk);
+    uint8_t in[65536];
+    size_t errors = 0;
+    int done = 0;
+    uint64_t start = timing::Now();
+    while (done < devices) {
+        for (int i = 0; i < devices; i++) {
+            bool room = sent[i] < total && sent[i] - received[i] < 4096;
+            pfds[i] = {fds[i], (short)(POLLIN | (room ? POLLOUT : 0)), 0};
+        }
+        if (::poll(pfds.data(), devices, 2000) <= 0) {
+            fprintf(stderr, "host: stalled\n");
+            break;
+        }
+        for (int i = 0; i < devices; i++) {
+            if (pfds[i].revents & POLLOUT) {
+                size_t length = std::min(chunk, total - sent[i]);
+                for (size_t j = 0; j < length; j++)
+                    out[j] = Pattern(sent[i] + j, i);
+                ssize_t len = ::write(fds[i], out.data(), length);
+                if (len > 0)
+                    sent[i] += len;
+            }
+            if (pfds[i].revents & POLLIN) {
+                ssize_t len = ::read(fds[i], in, sizeof(in));
+                if (len <= 0)
+                    continue;
+                for (ssize_t j = 0; j < len; j++)
+                    if (in[j] != Pattern(received[i] + j, i))
+                        errors++;
+                received[i] += len;
+                if (received[i] == total)
+                    done++;
+            }
+        }
+    }
+    double seconds = (timing::Now() - start) / 1e9;
+
+    size_t echoed = 0;
+    for (size_t len : received)
+        echoed += len;
+    printf("host: %zu/%zu bytes echoed, %zu bad, %.3f s, %.1f MB/s\n", echoed,
+           total * devices, errors, seconds, echoed / seconds / 1e6);
+    fflush(stdout);
+    return echoed == total * devices && errors == 0 ? 0 : 1;
+}
+
+static double CpuSeconds(const rusage& usage) {
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+           (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+int main(int argc, char** argv) {
+    argparse::ArgumentParser program("usbselfserial_uring_bench");
+
+    program.add_argument("-p", "--path")
+        .default_value(std::string("ring"))
+        .help("specify the output path to measure (poll, ring).");
+
+    program.add_argument("-n", "--devices")
+        .scan<'i', int>()
+        .default_value<int>(1)
+        .help("specify the number of echo devices.");
+
+    program.add_argument("-b", "--bytes")
+        .scan<'u', size_t>()
+        .default_value<size_t>(256 * 1024)
+        .help("specify the bytes the host sends to each device.");
+
+    program.add_argument("-c", "--chunk")
+        .scan<'u', size_t>()
+        .default_value<size_t>(256)
+        .help("specify the size of each host write.");
+
+    program.add_argument("-o", "--output-dir")
+        .default_value(std::string("/tmp"))
+        .help("specify the directory for the pty links.");
+
+    try {
+        program.parse_args(argc, argv);
+    } catch (const std::runtime_error& err) {
+        std::cerr << err.what() << std::endl;
+        std::cerr << program;
+        std::exit(1);
+    }
+
+    std::string arg_path = program.get<std::string>("-p");
+    int arg_devices = program.get<int>("-n");
+    size_t arg_bytes = program.get<size_t>("-b");
+    size_t arg_chunk = program.get<size_t>("-c");
+    std::string arg_dir = program.get<std::string>("-o");
+
+    bool ring;
+    if (arg_path == "ring") {
+        ring = true;
+    } else if (arg_path == "poll") {
+        ring = false;
+    } else {
+        printf("Unknown path. Please use poll or ring.\n");
+        return 1;
+    }
+    if (arg_devices < 1 || arg_chunk < 1) {
+        printf("Need at least one device and a chunk of at least 1 byte.\n");
+        return 1;
+    }
+
+    buffer::Allocator::Instance().Reserve(512, 64 + 16 * arg_devices);
+
+    uring::Loop loop;
+    if (ring) {
+        error::Result result = loop.TrySetUp(1024);
+        if (result)
+            result = loop.GetRing().TryRegisterBuffers(
+                buffer::Allocator::Instance());
+        if (!result) {
+            printf("Failed to set up io_uring: %s (%d)\n", result.message,
+                   result.value);
+            return 1;
+        }
+    }
+
+    driver::ch34x::Ch34xDriver driver;
+    std::vector<std::unique_ptr<EchoDevice>> devices;
+    std::vector<std::unique_ptr<output::pty::PtyOutput>> outputs;
+    for (int i = 0; i < arg_devices; i++) {
+        devices.emplace_back(new EchoDevice);
+        devices[i]->SetDriver(&driver);
+        outputs.emplace_back(
+            new output::pty::PtyOutput(NULL, PtyPath(arg_dir, i).c_str()));
+        outputs[i]->SetTransferSize(512, 512);
+        outputs[i]->SetDevice(devices[i].get());
+        if (ring)
+            outputs[i]->Attach(&loop);
+    }
+
+    printf("-> %s path, %d device(s), %zu bytes each in %zu byte writes\n",
+           arg_path.c_str(), arg_devices, arg_bytes, arg_chunk);
+    fflush(stdout);
+
+    pid_t host = fork();
+    if (host == 0)
+        _exit(RunHost(arg_dir, arg_devices, arg_bytes, arg_chunk));
+
+    count_read = count_write = count_poll = count_enter = count_sleep = 0;
+    rusage usage_start;
+    getrusage(RUSAGE_SELF, &usage_start);
+
+    // The poll path runs one HandleEvents thread per output
+    std::atomic<bool> active(true);
+    std::vector<std::thread> threads;
+    if (!ring) {
+        for (auto& output : outputs) {
+            output::pty::PtyOutput* out = output.get();
+            threads.emplace_back([out, &active]() {
+                while (active)
+                    out->HandleEvents();
+            });
+        }
+    }
+
+    int status = 0;
+    while (waitpid(host, &status, WNOHANG) == 0) {
+        if (ring)
+            loop.Run(50000);
+        for (auto& device : devices)
+            device->Update();
+        if (!ring)
+            usleep(50);
+    }
+
+    rusage usage_end;
+    getrusage(RUSAGE_SELF, &usage_end);
+    uint64_t reads = count_read, writes = count_write, polls = count_poll,
+             enters = count_enter, sleeps = count_sleep;
+
+    // Wake the output threads so they see active is cleared
+    active = false;
+    for (auto& output : outputs)
+        output->SetFlushConfig(output->GetFlushConfig());
+    for (auto& thread : threads)
+        thread.join();
+
+    // Both directions pass through the library
+    double kib = 2.0 * arg_bytes * arg_devices / 1024;
+    printf("library: read %llu, write %llu, poll %llu, io_uring_enter %llu "
+           "(loop sleeps %llu)\n",
+           (unsigned long long)reads, (unsigned long long)writes,
+           (unsigned long long)polls, (unsigned long long)enters,
+           (unsigned long long)sleeps);
+    printf("library: %.2f syscalls/KiB, cpu %.3f s\n",
+           (reads + writes + polls + enters) / kib,
+           CpuSeconds(usage_end) - CpuSeconds(usage_start));
+    if (ring) {
+        uring::RingStats stats = loop.GetRing().GetStats();
+        printf("ring: %llu enters, %llu submitted, %llu completions\n",
+               (unsigned long long)stats.enters,
+               (unsigned long long)stats.submitted,
+               (unsigned long long)stats.completions);
+    }
+
+    for (auto& output : outputs) {
+        if (ring)
+            output->Detach();
+        output->EndTransfers();
+    }
+    for (auto& device : devices)
+        device->Update();
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+}
+#endif
@@ -0,0 +1,314 @@
+/**
+ * usbselfserial by lotuspar (https://github.com/lotuspar)
+ *
+ * Inspired / based on:
+ *     the usb-serial-for-android project made in Java,
+ *         * which is copyright 2011-2013 Google Inc., 2013 Mike Wakerly
+ *         * https://github.com/mik3y/usb-serial-for-android
+ *     the Linux serial port drivers,
+ *         * https://github.com/torvalds/linux/tree/master/drivers/usb/serial
+ *     and the FreeBSD serial port drivers
+ *         * https://github.com/freebsd/freebsd-src/tree/main/sys/dev/usb/serial
+ * Some parts rewritten in C++ for usbselfserial!
+ *     * (by the time you read this it could have a different name!)
+ * - 2022
+ */
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include <vector>
+
+namespace uss {
+namespace buffer {
+
+constexpr const uint32_t Alignment = 64;
+
+// Block sizes served by the Allocator
+constexpr const uint32_t SizeClasses[] = {512, 1024, 4096, 16384, 65536};
+constexpr const size_t SizeClassCount =
+    sizeof(SizeClasses) / sizeof(SizeClasses[0]);
+
+class Pool;
+
+/**
+ * Fixed size block handed out by a Pool
+ * Shared between consumers through Ref, goes back to its pool when the last
+ * reference is dropped.
+ */
+struct Block {
+    Pool* pool = NULL;
+    std::atomic<uint32_t> references{0};
+    uint32_t length = 0; // bytes used
+    uint32_t capacity = 0;
+    uint64_t timestamp = 0; // timing::Now() when the data arrived, 0 if unset
+    uint8_t* data = NULL;
+};
+
+inline void ReleaseBlock(Block* block);
+
+/**
+ * Counted reference to a Block
+ */
+class Ref {
+    Block* block = NULL;
+
+public:
+    Ref() {}
+    explicit Ref(Block* _block) : block(_block) {
+        if (block != NULL)
+            block->references.fetch_add(1, std::memory_order_relaxed);
+    }
+    Ref(const Ref& other) : Ref(other.block) {}
+    Ref(Ref&& other) : block(other.block) { other.block = NULL; }
+    ~Ref() { Reset(); }
+
+    Ref& operator=(Ref other) {
+        std::swap(block, other.block);
+        return *this;
+    }
+
+    void Reset() {
+        if (block != NULL)
+            ReleaseBlock(block);
+        block = NULL;
+    }
+
+    /**
+     * Give up the reference without dropping it, see Adopt
+     */
+    Block* Detach() {
+        Block* detached = block;
+        block = NULL;
+        return detached;
+    }
+
+    /**
+     * Take over a reference given up with Detach
+     */
+    static Ref Adopt(Block* block) {
+        Ref ref;
+        ref.block = block;
+        return ref;
+    }
+
+    explicit operator bool() const { return block != NULL; }
+    Block* Get() const { return block; }
+    uint8_t* Data() const { return block->data; }
+    uint32_t Length() const { return block->length; }
+    uint32_t Capacity() const { return block->capacity; }
+    void SetLength(uint32_t length) { block->length = length; }
+    uint64_t Timestamp() const { return block->timestamp; }
+    void SetTimestamp(uint64_t timestamp) { block->timestamp = timestamp; }
+};
+
+/**
+ * Blocks of one size, grown in slabs of aligned storage
+ * Blocks never move or get freed until the pool goes away.
+ */
+class Pool {
+    struct Slab {
+        std::unique_ptr<Block[]> blocks;
+        std::unique_ptr<uint8_t[]> storage;
+        uint8_t* data = NULL; // first block, aligned
+        size_t length = 0;
+    };
+
+    std::vector<Slab> slabs;
+    std::vector<Block*> free_blocks;
+    std::mutex free_mutex;
+    size_t block_count = 0;
+    uint32_t block_size;
+
+public:
+    Pool(size_t count, uint32_t capacity)
+        : block_size((capacity + Alignment - 1) / Alignment * Alignment) {
+        Grow(count);
+    }
+
+    Pool(const Pool&) = delete;
+    Pool& operator=(const Pool&) = delete;
+
+    /**
+     * Add count blocks to the pool
+     */
+    void Grow(size_t count) {
+        if (count == 0)
+            return;
+
+        Slab slab;
+        slab.blocks.reset(new Block[count]);
+        slab.storage.reset(new uint8_t[count * block_size + Alignment]);
+        uint8_t* data = (uint8_t*)(((uintptr_t)slab.storage.get() +
+                                    Alignment - 1) &
+                                   ~(uintptr_t)(Alignment - 1));
+
+        std::lock_guard<std::mutex> lock(free_mutex);
+        free_blocks.reserve(block_count + count);
+        for (size_t i = 0; i < count; i++) {
+            slab.blocks[i].pool = this;
+            slab.blocks[i].capacity = block_size;
+            slab.blocks[i].data = data + i * block_size;
+            free_blocks.push_back(&slab.blocks[i]);
+        }
+        slab.data = data;
+        slab.length = count * block_size;
+        slabs.push_back(std::move(slab));
+        block_count += count;
+    }
+
+    /**
+     * Take a block from the pool
+     * @return empty Ref if every block is in use
+     */
+    Ref Acquire() {
+        std::lock_guard<std::mutex> lock(free_mutex);
+        if (free_blocks.empty())
+            return Ref();
+        Block* block = free_blocks.back();
+        free_blocks.pop_back();
+        block->length = 0;
+        block->timestamp = 0;
+        return Ref(block);
+    }
+
+    void Return(Block* block) {
+        std::lock_guard<std::mutex> lock(free_mutex);
+        free_blocks.push_back(block);
+    }
+
+    size_t Available() {
+        std::lock_guard<std::mutex> lock(free_mutex);
+        return free_blocks.size();
+    }
+
+    size_t Size() {
+        std::lock_guard<std::mutex> lock(free_mutex);
+        return block_count;
+    }
+
+    uint32_t BlockSize() { return block_size; }
+
+    /**
+     * Call f(data, length) for the storage of every slab
+     * Slabs never move, so the ranges stay valid for the pool's lifetime.
+     */
+    template <typename F> void ForEachSlab(F f) {
+        std::lock_guard<std::mutex> lock(free_mutex);
+        for (Slab& slab : slabs)
+            f(slab.data, slab.length);
+    }
+
+    /**
+     * Touch every free block so its pages are mapped before they're needed
+     */
+    void Prefault() {
+        std::lock_guard<std::mutex> lock(free_mutex);
+        for (Block* block : free_blocks)
+            memset(block->data, 0, block->capacity);
+    }
+};
+
+inline void ReleaseBlock(Block* block) {
+    if (block->references.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        block->pool->Return(block);
+}
+
+/**
+ * Process wide size class allocator shared by every device and output
+ * Blocks go back to their class when released and get reused across
+ * reconnects, so nothing is allocated once the pools are warm. Reserve up
+ * front to skip the warm up.
+ */
+class Allocator {
+    constexpr static const size_t GrowCount = 8;
+    std::unique_ptr<Pool> pools[SizeClassCount];
+    std::mutex grow_mutex;
+
+    Allocator() {
+        for (size_t i = 0; i < SizeClassCount; i++)
+            pools[i].reset(new Pool(0, SizeClasses[i]));
+    }
+
+    static int SizeClassIndex(uint32_t size) {
+        for (size_t i = 0; i < SizeClassCount; i++)
+            if (size <= SizeClasses[i])
+                return (int)i;
+        return -1;
+    }
+
+public:
+    static Allocator& Instance() {
+        static Allocator allocator;
+        return allocator;
+    }
+
+    /**
+     * Size of the block Acquire(size) hands out, 0 if too big
+     */
+    static uint32_t BlockSize(uint32_t size) {
+        int index = SizeClassIndex(size);
+        return index < 0 ? 0 : SizeClasses[index];
+    }
+
+    static uint32_t MaxBlockSize() { return SizeClasses[SizeClassCount - 1]; }
+
+    /**
+     * Make sure at least count blocks of this size exist
+     */
+    void Reserve(uint32_t size, size_t count) {
+        int index = SizeClassIndex(size);
+        if (index < 0)
+            return;
+        std::lock_guard<std::mutex> lock(grow_mutex);
+        size_t existing = pools[index]->Size();
+        if (existing < count)
+            pools[index]->Grow(count - existing);
+    }
+
+    /**
+     * Touch every reserved block, see Pool::Prefault
+     */
+    void Prefault() {
+        std::lock_guard<std::mutex> lock(grow_mutex);
+        for (auto& pool : pools)
+            pool->Prefault();
+    }
+
+    /**
+     * Call f(data, length) for every slab of every size class
+     * e.g. to register the storage with the kernel, see uring::Ring
+     */
+    template <typename F> void ForEachSlab(F f) {
+        std::lock_guard<std::mutex> lock(grow_mutex);
+        for (auto& pool : pools)
+            pool->ForEachSlab(f);
+    }
+
+    /**
+     * Take a block of at least size bytes
+     * @return empty Ref if size is bigger than the largest class
+     */
+    Ref Acquire(uint32_t size) {
+        int index = SizeClassIndex(size);
+        if (index < 0)
+            return Ref();
+
+        Ref ref = pools[index]->Acquire();
+        while (!ref) {
+            {
+                std::lock_guard<std::mutex> lock(grow_mutex);
+                if (pools[index]->Available() == 0)
+                    pools[index]->Grow(GrowCount);
+            }
+            ref = pools[index]->Acquire();
+        }
+        return ref;
+    }
+};
+
+} // namespace buffer
+} // namespace uss
\ No newline at end of file
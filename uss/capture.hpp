@@ -0,0 +1,142 @@
+/**
+ * usbselfserial by lotuspar (https://github.com/lotuspar)
+ *
+ * Inspired / based on:
+ *     the usb-serial-for-android project made in Java,
+ *         * which is copyright 2011-2013 Google Inc., 2013 Mike Wakerly
+ *         * https://github.com/mik3y/usb-serial-for-android
+ *     the Linux serial port drivers,
+ *         * https://github.com/torvalds/linux/tree/master/drivers/usb/serial
+ *     and the FreeBSD serial port drivers
+ *         * https://github.com/freebsd/freebsd-src/tree/main/sys/dev/usb/serial
+ * Some parts rewritten in C++ for usbselfserial!
+ *     * (by the time you read this it could have a different name!)
+ * - 2022
+ */
+#pragma once
+#include "error.hpp"
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace uss {
+namespace capture {
+
+/**
+ * Capture file layout:
+ *     FileHeader, then RecordHeader + data for every chunk, in time order.
+ * Fields are stored in host byte order.
+ */
+constexpr const char FileMagic[8] = {'U', 'S', 'S', 'C', 'A', 'P', 0, 0};
+constexpr const uint32_t FileVersion = 1;
+
+enum class Direction : uint8_t {
+    DeviceToHost = 0, // usb -> output
+    HostToDevice = 1  // output -> usb
+};
+
+struct FileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+};
+
+struct RecordHeader {
+    uint64_t timestamp; // CLOCK_MONOTONIC nanoseconds
+    uint32_t length;
+    Direction direction;
+    uint8_t reserved[3];
+};
+
+class CaptureError : public std::exception {
+    std::string msg;
+
+public:
+    CaptureError(const std::string& reason)
+        : msg("Capture file failure: " + reason) {}
+    const char* what() const throw() override { return msg.c_str(); }
+};
+
+class Writer {
+    FILE* file = NULL;
+
+public:
+    Writer(const char* path) {
+        file = fopen(path, "wb");
+        if (file == NULL)
+            error::Throw(CaptureError("couldn't open " + std::string(path)));
+
+        FileHeader header = {};
+        memcpy(header.magic, FileMagic, sizeof(header.magic));
+        header.version = FileVersion;
+        if (fwrite(&header, sizeof(header), 1, file) != 1)
+            error::Throw(CaptureError("couldn't write file header"));
+    }
+
+    Writer(const Writer&) = delete;
+    Writer& operator=(const Writer&) = delete;
+
+    ~Writer() {
+        if (file != NULL)
+            fclose(file);
+    }
+
+    void Write(Direction direction, uint64_t timestamp, const uint8_t* data,
+               uint32_t length) {
+        RecordHeader record = {};
+        record.timestamp = timestamp;
+        record.length = length;
+        record.direction = direction;
+        fwrite(&record, sizeof(record), 1, file);
+        fwrite(data, 1, length, file);
+    }
+
+    void Flush() { fflush(file); }
+};
+
+class Reader {
+    FILE* file = NULL;
+
+public:
+    Reader(const char* path) {
+        file = fopen(path, "rb");
+        if (file == NULL)
+            error::Throw(CaptureError("couldn't open " + std::string(path)));
+
+        FileHeader header;
+        if (fread(&header, sizeof(header), 1, file) != 1 ||
+            memcmp(header.magic, FileMagic, sizeof(header.magic)) != 0)
+            error::Throw(CaptureError("not a capture file"));
+        if (header.version != FileVersion)
+            error::Throw(CaptureError("unsupported version " +
+                                      std::to_string(header.version)));
+    }
+
+    Reader(const Reader&) = delete;
+    Reader& operator=(const Reader&) = delete;
+
+    ~Reader() {
+        if (file != NULL)
+            fclose(file);
+    }
+
+    /**
+     * Read the next record into record / data
+     * @return false at end of file
+     */
+    bool Next(RecordHeader& record, std::vector<uint8_t>& data) {
+        if (fread(&record, sizeof(record), 1, file) != 1)
+            return false;
+        data.resize(record.length);
+        if (record.length != 0 &&
+            fread(data.data(), 1, record.length, file) != record.length)
+            error::Throw(CaptureError("truncated record"));
+        return true;
+    }
+};
+
+} // namespace capture
+} // namespace uss
\ No newline at end of file
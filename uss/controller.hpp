@@ -14,6 +14,7 @@
  * - 2022
  */
 #pragma once
+#include <stddef.h>
 #include <stdint.h>
 
 namespace uss {
@@ -25,9 +26,18 @@ public:
 
 namespace ctl {
 
+/**
+ * Which device a controller wants
+ * Zero / empty fields match anything, and fields left out of a brace
+ * initializer are zeroed, so {vid, pid} alone takes the first unclaimed
+ * device with those ids. Kept an aggregate for C++11.
+ */
 struct ExpectedDeviceData {
     uint16_t vid, pid;
     uint8_t bus, port;
+    uint8_t path[7];     // port numbers from the root hub
+    uint8_t path_length; // 0 matches any path
+    const char* serial;  // iSerialNumber, NULL matches any
 };
 
 } // namespace ctl
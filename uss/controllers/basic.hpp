@@ -17,6 +17,7 @@
 #include "../controller.hpp"
 #include "../device.hpp"
 #include "../error.hpp"
+#include "enumerator.hpp"
 #include <cstdio>
 #include <libusb-1.0/libusb.h>
 
@@ -29,23 +30,33 @@ private:
     libusb_device* usb_device = 0x0;
     ExpectedDeviceData expected;
 
+    error::Result Open() {
+        usb_handle = Enumerator::Open(expected);
+        if (usb_handle == NULL)
+            return error::Result::Fail(error::Code::NoDevice,
+                                       "Device not found");
+        return error::Result::Ok();
+    }
+
 public:
     Basic(ExpectedDeviceData _expected) : expected(_expected) {
-        usb_handle =
-            libusb_open_device_with_vid_pid(NULL, expected.vid, expected.pid);
-        if (usb_handle == NULL)
-            throw error::NoDeviceException();
-        if (expected.port != 0 || expected.bus != 0) {
-            usb_device = libusb_get_device(usb_handle);
-            if (expected.port != libusb_get_port_number(usb_device) ||
-                expected.bus != libusb_get_bus_number(usb_device)) {
-                printf("Device with required vid & pid connected with "
-                       "unexpected bus or port\n");
-                throw error::NoDeviceException();
-            }
-        }
+        error::Raise(Open());
+    }
+
+    /**
+     * Exception free constructor, check result before using the device
+     */
+    Basic(ExpectedDeviceData _expected, error::Result& result)
+        : expected(_expected) {
+        result = Open();
     }
 
+    /**
+     * Use a handle from an Enumerator, the controller takes ownership
+     */
+    Basic(ExpectedDeviceData _expected, libusb_device_handle* handle)
+        : usb_handle(handle), expected(_expected) {}
+
     ~Basic() { libusb_close(usb_handle); }
 
     libusb_device* GetUsbDevice() override {
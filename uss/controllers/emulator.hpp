@@ -0,0 +1,246 @@
+/**
+ * usbselfserial by lotuspar (https://github.com/lotuspar)
+ *
+ * Inspired / based on:
+ *     the usb-serial-for-android project made in Java,
+ *         * which is copyright 2011-2013 Google Inc., 2013 Mike Wakerly
+ *         * https://github.com/mik3y/usb-serial-for-android
+ *     the Linux serial port drivers,
+ *         * https://github.com/torvalds/linux/tree/master/drivers/usb/serial
+ *     and the FreeBSD serial port drivers
+ *         * https://github.com/freebsd/freebsd-src/tree/main/sys/dev/usb/serial
+ * Some parts rewritten in C++ for usbselfserial!
+ *     * (by the time you read this it could have a different name!)
+ * - 2022
+ */
+#pragma once
+#include "../serial.hpp"
+#include "../timing.hpp"
+#include "software.hpp"
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace uss {
+namespace ctl {
+
+/**
+ * Line settings and control lines as an emulated chip has them programmed
+ */
+struct LineState {
+    BaudRate baud_rate = 0; // 0 until programmed
+    DataBits data_bits = DataBits::DataBits_8;
+    Parity parity = Parity::Parity_None;
+    StopBits stop_bits = StopBits::StopBits_1;
+    bool tx_enabled = true;
+    bool rx_enabled = true;
+    bool break_on = false;
+    bool dtr = false;
+    bool rts = false;
+
+    bool SameFraming(const LineState& other) const {
+        return baud_rate == other.baud_rate &&
+               data_bits == other.data_bits && parity == other.parity &&
+               stop_bits == other.stop_bits;
+    }
+};
+
+struct EmulatorStats {
+    uint64_t control_requests = 0;
+    uint64_t stalled_requests = 0; // unknown or malformed, answered by STALL
+    uint64_t reconfigures = 0;     // requests that changed baud or framing
+    uint64_t line_changes = 0;     // requests that changed DTR / RTS / break
+    uint64_t tx_bytes = 0;         // accepted from OUT transfers
+    uint64_t looped_bytes = 0;     // returned through IN transfers
+    uint64_t dropped_bytes = 0;    // TX disabled, or RX disabled on loopback
+};
+
+/**
+ * Software device emulating a USB serial chip with TX wired to RX
+ * Subclasses decode the chip's control requests into line; OUT data then
+ * goes out at the programmed line rate and comes back through IN transfers
+ * once its last bit would have arrived. Drivers run their normal init and
+ * configure paths against it, so init latency, reconfigure cost and
+ * throughput can be measured without an adapter.
+ */
+class SerialEmulator : public Software {
+    struct Chunk {
+        std::vector<uint8_t> data;
+        size_t offset = 0;
+        uint64_t start = 0;          // ns, first bit of data[offset]
+        uint64_t character_time = 0; // ns, at the settings it was sent with
+    };
+
+    std::deque<Chunk> loopback;
+    uint64_t line_end = 0;         // ns, when the TX line goes idle
+    uint32_t control_latency = 0;  // us, see SetControlLatency
+    EmulatorStats stats;
+
+    uint64_t CharacterTime() const {
+        return uss::CharacterTime(line.baud_rate, line.data_bits, line.parity,
+                                  line.stop_bits);
+    }
+
+    void ExpireBreak(uint64_t now) {
+        if (break_end != 0 && now >= break_end) {
+            line.break_on = false;
+            break_end = 0;
+        }
+    }
+
+protected:
+    std::mutex line_mutex; // line, break_end and everything above
+    LineState line;
+    uint64_t break_end = 0; // ns, when a timed break ends, 0 for none
+
+    /**
+     * A control request for the chip, called with line_mutex held
+     * @return bytes transferred or a libusb error code
+     */
+    virtual int ChipControl(uint8_t request_type, uint8_t request,
+                            uint16_t value, uint16_t index, uint8_t* data,
+                            uint16_t length) = 0;
+
+    int HandleControl(uint8_t request_type, uint8_t request, uint16_t value,
+                      uint16_t index, uint8_t* data,
+                      uint16_t length) override {
+        std::lock_guard<std::mutex> lock(line_mutex);
+        LineState before = line;
+        int ret =
+            ChipControl(request_type, request, value, index, data, length);
+
+        stats.control_requests++;
+        if (ret == LIBUSB_ERROR_PIPE)
+            stats.stalled_requests++;
+        if (!line.SameFraming(before))
+            stats.reconfigures++;
+        if (line.dtr != before.dtr || line.rts != before.rts ||
+            line.break_on != before.break_on)
+            stats.line_changes++;
+        return ret;
+    }
+
+    uint64_t LineCharacterTime() override {
+        std::lock_guard<std::mutex> lock(line_mutex);
+        return CharacterTime();
+    }
+
+    int DeviceWrite(const uint8_t* data, int length) override {
+        std::lock_guard<std::mutex> lock(line_mutex);
+        uint64_t now = timing::Now();
+        ExpireBreak(now);
+
+        // The line is held low, data waits in the chip
+        if (line.break_on)
+            return 0;
+
+        stats.tx_bytes += length;
+        if (!line.tx_enabled || !line.rx_enabled) {
+            stats.dropped_bytes += length;
+            return length;
+        }
+
+        Chunk chunk;
+        chunk.data.assign(data, data + length);
+        chunk.start = line_end > now ? line_end : now;
+        chunk.character_time = CharacterTime();
+        line_end = chunk.start + (uint64_t)length * chunk.character_time;
+        loopback.push_back(std::move(chunk));
+        return length;
+    }
+
+    int DeviceRead(uint8_t* buffer, int length) override {
+        std::lock_guard<std::mutex> lock(line_mutex);
+        uint64_t now = timing::Now();
+        ExpireBreak(now);
+
+        int count = 0;
+        while (count < length && !loopback.empty()) {
+            Chunk& chunk = loopback.front();
+            if (now < chunk.start)
+                break;
+
+            // Whole characters received by now
+            size_t ready = chunk.data.size() - chunk.offset;
+            if (chunk.character_time != 0) {
+                uint64_t received = (now - chunk.start) / chunk.character_time;
+                if (received < ready)
+                    ready = received;
+            }
+            if (ready > (size_t)(length - count))
+                ready = length - count;
+            if (ready == 0)
+                break;
+
+            memcpy(buffer + count, chunk.data.data() + chunk.offset, ready);
+            count += ready;
+            chunk.offset += ready;
+            chunk.start += ready * chunk.character_time;
+            if (chunk.offset == chunk.data.size())
+                loopback.pop_front();
+        }
+        stats.looped_bytes += count;
+        return count;
+    }
+
+public:
+    /**
+     * @param fifo TX FIFO size in bytes, see SetUartFifo
+     */
+    SerialEmulator(SoftwareLayout layout, uint32_t fifo,
+                   uint16_t packet_size = 64)
+        : Software(layout, packet_size) {
+        SetUartFifo(fifo);
+    }
+
+    /**
+     * Delay synchronous control transfers by a USB round trip
+     * Without it init and configure cost only the driver's own time.
+     */
+    void SetControlLatency(uint32_t us) {
+        std::lock_guard<std::mutex> lock(line_mutex);
+        control_latency = us;
+    }
+
+    int ControlTransfer(uint8_t request_type, uint8_t request, uint16_t value,
+                        uint16_t index, uint8_t* data, uint16_t length,
+                        uint32_t timeout) override {
+        uint32_t latency;
+        {
+            std::lock_guard<std::mutex> lock(line_mutex);
+            latency = control_latency;
+        }
+        if (latency != 0)
+            std::this_thread::sleep_for(std::chrono::microseconds(latency));
+        return Software::ControlTransfer(request_type, request, value, index,
+                                         data, length, timeout);
+    }
+
+    LineState GetLine() {
+        std::lock_guard<std::mutex> lock(line_mutex);
+        ExpireBreak(timing::Now());
+        return line;
+    }
+
+    EmulatorStats GetEmulatorStats() {
+        std::lock_guard<std::mutex> lock(line_mutex);
+        return stats;
+    }
+
+    /**
+     * Data sent but not yet looped back to the host, in bytes
+     */
+    size_t GetLoopbackPending() {
+        std::lock_guard<std::mutex> lock(line_mutex);
+        size_t pending = 0;
+        for (const Chunk& chunk : loopback)
+            pending += chunk.data.size() - chunk.offset;
+        return pending;
+    }
+};
+
+} // namespace ctl
+} // namespace uss
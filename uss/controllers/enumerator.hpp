@@ -0,0 +1,248 @@
+/**
+ * usbselfserial by lotuspar (https://github.com/lotuspar)
+ *
+ * Inspired / based on:
+ *     the usb-serial-for-android project made in Java,
+ *         * which is copyright 2011-2013 Google Inc., 2013 Mike Wakerly
+ *         * https://github.com/mik3y/usb-serial-for-android
+ *     the Linux serial port drivers,
+ *         * https://github.com/torvalds/linux/tree/master/drivers/usb/serial
+ *     and the FreeBSD serial port drivers
+ *         * https://github.com/freebsd/freebsd-src/tree/main/sys/dev/usb/serial
+ * Some parts rewritten in C++ for usbselfserial!
+ *     * (by the time you read this it could have a different name!)
+ * - 2022
+ */
+#pragma once
+#include "../controller.hpp"
+#include "../error.hpp"
+#include "../log.hpp"
+#include <algorithm>
+#include <cstring>
+#include <libusb-1.0/libusb.h>
+#include <stddef.h>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+namespace uss {
+namespace ctl {
+
+/**
+ * Finds every expected device in one pass over the bus
+ * libusb_open_device_with_vid_pid walks the whole device list per call and
+ * only returns the first match. This walks it once, looks each device up
+ * by vid:pid and hands out distinct devices, so identical adapters can be
+ * told apart by bus, port path or serial number.
+ */
+class Enumerator {
+    struct Entry {
+        ExpectedDeviceData expected;
+        libusb_device_handle* handle = NULL;
+        bool taken = false;
+    };
+
+    std::vector<Entry> entries;
+
+    // vid:pid -> entries, most specific first
+    std::unordered_map<uint32_t, std::vector<size_t>> index;
+
+    // bus:address of devices already handed out, skipped by a rescan
+    std::unordered_set<uint16_t> claimed;
+
+    static uint32_t Key(uint16_t vid, uint16_t pid) {
+        return ((uint32_t)vid << 16) | pid;
+    }
+
+    static int Specificity(const ExpectedDeviceData& expected) {
+        return (expected.serial != NULL ? 4 : 0) +
+               (expected.path_length != 0 ? 2 : 0) +
+               (expected.bus != 0 || expected.port != 0 ? 1 : 0);
+    }
+
+public:
+    Enumerator() {}
+    Enumerator(const Enumerator&) = delete;
+    Enumerator& operator=(const Enumerator&) = delete;
+
+    ~Enumerator() {
+        for (Entry& entry : entries)
+            if (entry.handle != NULL)
+                libusb_close(entry.handle);
+    }
+
+    /**
+     * Check bus, port and port path of a device
+     */
+    static bool MatchesLocation(const ExpectedDeviceData& expected,
+                                libusb_device* device) {
+        if (expected.bus != 0 && expected.bus != libusb_get_bus_number(device))
+            return false;
+        if (expected.port != 0 &&
+            expected.port != libusb_get_port_number(device))
+            return false;
+        if (expected.path_length == 0)
+            return true;
+
+        uint8_t path[sizeof(expected.path)];
+        int path_length = libusb_get_port_numbers(device, path, sizeof(path));
+        return path_length == expected.path_length &&
+               memcmp(path, expected.path, expected.path_length) == 0;
+    }
+
+    /**
+     * Check the serial number of an opened device
+     */
+    static bool MatchesSerial(const ExpectedDeviceData& expected,
+                              libusb_device_handle* handle) {
+        if (expected.serial == NULL)
+            return true;
+
+        libusb_device_descriptor descriptor;
+        if (libusb_get_device_descriptor(libusb_get_device(handle),
+                                         &descriptor) < 0 ||
+            descriptor.iSerialNumber == 0)
+            return false;
+
+        unsigned char serial[128];
+        int ret = libusb_get_string_descriptor_ascii(
+            handle, descriptor.iSerialNumber, serial, sizeof(serial) - 1);
+        if (ret < 0)
+            return false;
+        serial[ret] = 0;
+        return strcmp((const char*)serial, expected.serial) == 0;
+    }
+
+    /**
+     * Add an expected device
+     * @return index to Take the handle with after Scan
+     */
+    size_t Expect(const ExpectedDeviceData& expected) {
+        size_t entry_index = entries.size();
+        entries.push_back(Entry());
+        entries.back().expected = expected;
+
+        std::vector<size_t>& candidates =
+            index[Key(expected.vid, expected.pid)];
+        int specificity = Specificity(expected);
+        candidates.insert(
+            std::find_if(candidates.begin(), candidates.end(),
+                         [this, specificity](size_t other) {
+                             return Specificity(entries[other].expected) <
+                                    specificity;
+                         }),
+            entry_index);
+        return entry_index;
+    }
+
+    /**
+     * Walk the device list once, opening a device for every expected one
+     * still without a handle. Can be repeated to pick up late devices.
+     */
+    error::Result Scan(libusb_context* context = NULL) {
+        size_t remaining = 0;
+        for (const Entry& entry : entries)
+            if (entry.handle == NULL && !entry.taken)
+                remaining++;
+        if (remaining == 0)
+            return error::Result::Ok();
+
+        libusb_device** list;
+        ssize_t count = libusb_get_device_list(context, &list);
+        if (count < 0)
+            return error::Result::Fail(error::Code::LibUsb,
+                                       "Failed to get device list",
+                                       (int)count);
+
+        for (ssize_t i = 0; i < count && remaining > 0; i++) {
+            uint16_t address = (libusb_get_bus_number(list[i]) << 8) |
+                               libusb_get_device_address(list[i]);
+            if (claimed.count(address) != 0)
+                continue;
+
+            libusb_device_descriptor descriptor;
+            if (libusb_get_device_descriptor(list[i], &descriptor) < 0)
+                continue;
+
+            auto found =
+                index.find(Key(descriptor.idVendor, descriptor.idProduct));
+            if (found == index.end())
+                continue;
+
+            libusb_device_handle* handle = NULL;
+            for (size_t entry_index : found->second) {
+                Entry& entry = entries[entry_index];
+                if (entry.handle != NULL || entry.taken ||
+                    !MatchesLocation(entry.expected, list[i]))
+                    continue;
+
+                if (handle == NULL) {
+                    int ret = libusb_open(list[i], &handle);
+                    if (ret < 0) {
+                        USS_LOG_WARN("Failed to open %04x:%04x: %s\n",
+                                     descriptor.idVendor,
+                                     descriptor.idProduct,
+                                     libusb_error_name(ret));
+                        handle = NULL;
+                        break;
+                    }
+                }
+
+                if (!MatchesSerial(entry.expected, handle))
+                    continue;
+
+                entry.handle = handle;
+                handle = NULL;
+                claimed.insert(address);
+                remaining--;
+                break;
+            }
+
+            // Opened only to read the serial number
+            if (handle != NULL)
+                libusb_close(handle);
+        }
+
+        libusb_free_device_list(list, 1);
+        return error::Result::Ok();
+    }
+
+    /**
+     * Number of expected devices found so far
+     */
+    size_t Found() const {
+        size_t found = 0;
+        for (const Entry& entry : entries)
+            if (entry.handle != NULL || entry.taken)
+                found++;
+        return found;
+    }
+
+    /**
+     * Take ownership of the handle found for an expected device
+     * @return handle, or NULL if it wasn't found
+     */
+    libusb_device_handle* Take(size_t entry_index) {
+        Entry& entry = entries[entry_index];
+        libusb_device_handle* handle = entry.handle;
+        entry.taken = handle != NULL;
+        entry.handle = NULL;
+        return handle;
+    }
+
+    /**
+     * Open a single expected device
+     * @return handle, or NULL if it wasn't found
+     */
+    static libusb_device_handle* Open(const ExpectedDeviceData& expected,
+                                      libusb_context* context = NULL) {
+        Enumerator enumerator;
+        size_t entry_index = enumerator.Expect(expected);
+        if (!enumerator.Scan(context))
+            return NULL;
+        return enumerator.Take(entry_index);
+    }
+};
+
+} // namespace ctl
+} // namespace uss
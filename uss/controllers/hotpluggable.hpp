@@ -15,28 +15,104 @@
  */
 #pragma once
 #include "../controller.hpp"
+#include "../coro.hpp"
 #include "../device.hpp"
 #include "../error.hpp"
+#include "../log.hpp"
+#include "../stats.hpp"
+#include "../timing.hpp"
+#include "enumerator.hpp"
+#include <atomic>
 #include <cstdio>
 #include <functional>
 #include <libusb-1.0/libusb.h>
+#include <mutex>
+#include <unordered_map>
 
 namespace uss {
 namespace ctl {
 
+/**
+ * Hotplug timing
+ * A port has to be quiet for debounce_ms before its device is opened, and
+ * devices are initialized at most once per settle_ms.
+ */
+struct HotplugConfig {
+    uint32_t debounce_ms = 250;
+    uint32_t settle_ms = 1000;
+};
+
+struct HotplugStats {
+    uint64_t arrivals = 0;
+    uint64_t departures = 0;
+    uint64_t flaps = 0;       // events within the debounce window
+    uint64_t connects = 0;    // successful initializations
+    uint64_t failures = 0;    // failed opens / initializations
+    uint64_t disconnects = 0; // initialized devices that went away
+};
+
+/**
+ * Last seen state of one port (bus and port path)
+ */
+struct HotplugPort {
+    libusb_device* device = 0x0; // referenced while present
+    uint64_t changed = 0;        // ns, last event
+    uint64_t left = 0;           // ns, when an initialized device left
+    bool present = false;
+    bool rejected = false; // wrong serial number, skipped until it changes
+};
+
 struct HotpluggableInstanceData {
     libusb_device_handle* provisional_usb_handle = 0x0;
     libusb_device_handle* usb_handle = 0x0;
     libusb_device* usb_device = 0x0;
     ExpectedDeviceData expected;
-    bool handle_disconnect = false;
+    error::Result last_error;
+
+    // Ports are written by the hotplug callback, which runs on whichever
+    // thread handles libusb events
+    std::mutex mutex;
+    std::unordered_map<uint64_t, HotplugPort> ports;
+    HotplugConfig config;
+    HotplugStats stats;
+    stats::Histogram reconnect_time;
+
+    uint64_t active_port = 0; // port usb_handle was opened on
+    uint64_t last_init = 0;
+
+    // Closed before the next device is opened, by then its transfers
+    // have been cancelled
+    libusb_device_handle* retired_usb_handle = 0x0;
 };
 
 class Hotpluggable : public BaseDevice, public BaseController {
     HotpluggableInstanceData instance;
     libusb_hotplug_callback_handle callback_handle;
+    bool registered = false;
     std::function<void(Hotpluggable*)> connect_callback = NULL;
     std::function<void(Hotpluggable*)> disconnect_callback = NULL;
+#if defined(USS_COROUTINES)
+    std::atomic<bool> connected{false};
+    coro::Signal connection;
+
+    static bool IsConnected(const void* context) {
+        return ((const Hotpluggable*)context)->connected;
+    }
+
+    static bool IsDisconnected(const void* context) {
+        return !((const Hotpluggable*)context)->connected;
+    }
+#endif
+
+    static uint64_t PortKey(libusb_device* device) {
+        uint8_t path[7] = {};
+        libusb_get_port_numbers(device, path, sizeof(path));
+
+        uint64_t key = libusb_get_bus_number(device);
+        for (uint8_t port : path)
+            key = (key << 8) | port;
+        return key;
+    }
 
     static int HotplugCallback(struct libusb_context* ctx,
                                struct libusb_device* dev,
@@ -44,40 +120,54 @@ class Hotpluggable : public BaseDevice, public BaseController {
         HotpluggableInstanceData* instance =
             (HotpluggableInstanceData*)user_data;
 
-        if (instance->expected.port != 0 || instance->expected.bus != 0) {
-            if (instance->expected.port != libusb_get_port_number(dev) ||
-                instance->expected.bus != libusb_get_bus_number(dev)) {
-                printf("Device with required vid & pid connected with "
-                       "different bus");
-                return 0;
-            }
+        if (!Enumerator::MatchesLocation(instance->expected, dev)) {
+            USS_LOG_WARN("Device with required vid & pid connected with "
+                         "different bus or port path");
+            return 0;
         }
 
-        if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED) {
-            instance->usb_handle = NULL;
-            instance->usb_device = NULL;
-            int ret = libusb_open(dev, &instance->provisional_usb_handle);
-            if (ret < 0)
-                throw error::LibUsbErrorException("Error on hotplug connect",
-                                                  ret);
+        // Only record the event, Update opens the device once the port
+        // has settled
+        uint64_t now = timing::Now();
+        std::lock_guard<std::mutex> lock(instance->mutex);
+        HotplugPort& port = instance->ports[PortKey(dev)];
+        if (port.changed != 0 &&
+            now - port.changed < instance->config.debounce_ms * 1000000ull)
+            instance->stats.flaps++;
+        port.changed = now;
+        port.rejected = false;
 
+        // Repeated arrivals replace the device instead of leaking it
+        if (port.device != NULL)
+            libusb_unref_device(port.device);
+        port.device = NULL;
+
+        if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED) {
+            instance->stats.arrivals++;
+            port.device = libusb_ref_device(dev);
+            port.present = true;
         } else if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT) {
-            instance->provisional_usb_handle = NULL;
-            instance->usb_handle = NULL;
-            instance->usb_device = NULL;
-            instance->handle_disconnect = true;
+            instance->stats.departures++;
+            port.present = false;
         }
 
         return 0;
     }
 
-public:
-    Hotpluggable(ExpectedDeviceData _expected,
-                 std::function<void(Hotpluggable*)> _connect_callback = NULL,
-                 std::function<void(Hotpluggable*)> _disconnect_callback = NULL)
-        : connect_callback(_connect_callback),
-          disconnect_callback(_disconnect_callback) {
-        instance.expected = _expected;
+    /**
+     * Track the port of an already open handle, it skips the debounce
+     */
+    void Adopt(libusb_device_handle* handle) {
+        libusb_device* device = libusb_get_device(handle);
+        std::lock_guard<std::mutex> lock(instance.mutex);
+        HotplugPort& port = instance.ports[PortKey(device)];
+        if (port.device == NULL)
+            port.device = libusb_ref_device(device);
+        port.present = true;
+        instance.provisional_usb_handle = handle;
+    }
+
+    error::Result Register(bool search) {
         int ret = libusb_hotplug_register_callback(
             NULL,
             static_cast<libusb_hotplug_event>(
@@ -88,33 +178,175 @@ public:
             &instance, &callback_handle);
 
         if (ret < 0)
-            throw error::LibUsbErrorException(
-                "Error on hotplug callback register", ret);
-
-        instance.provisional_usb_handle = libusb_open_device_with_vid_pid(
-            NULL, instance.expected.vid, instance.expected.pid);
-        if (instance.provisional_usb_handle == NULL)
-            return;
-
-        if (instance.expected.port != 0 || instance.expected.bus != 0) {
-            instance.usb_device =
-                libusb_get_device(instance.provisional_usb_handle);
-            if (instance.expected.port !=
-                    libusb_get_port_number(instance.usb_device) ||
-                instance.expected.bus !=
-                    libusb_get_bus_number(instance.usb_device)) {
-                printf("Device with required vid & pid connected with "
-                       "unexpected bus or port\n");
-                instance.provisional_usb_handle = NULL;
-                instance.usb_device = NULL;
-                return;
+            return error::Result::Fail(error::Code::LibUsb,
+                                       "Error on hotplug callback register",
+                                       ret);
+        registered = true;
+
+        // Pick up a device that is already connected
+        if (search) {
+            libusb_device_handle* handle = Enumerator::Open(instance.expected);
+            if (handle != NULL)
+                Adopt(handle);
+        }
+        return error::Result::Ok();
+    }
+
+    /**
+     * Find a port that has settled and isn't open yet, mutex held
+     * Ports that are gone and were never initialized are dropped.
+     */
+    HotplugPort* FindSettledPort(uint64_t now, uint64_t& key) {
+        uint64_t debounce = instance.config.debounce_ms * 1000000ull;
+        for (auto it = instance.ports.begin(); it != instance.ports.end();) {
+            HotplugPort& port = it->second;
+            if (!port.present) {
+                // Nothing left to track once it is gone and not initialized
+                if (port.left == 0 || it->first != instance.active_port) {
+                    it = instance.ports.erase(it);
+                    continue;
+                }
+                ++it;
+                continue;
+            }
+            if (port.rejected || now - port.changed < debounce) {
+                ++it;
+                continue;
+            }
+            key = it->first;
+            return &port;
+        }
+        return NULL;
+    }
+
+    /**
+     * Open the device of a settled port
+     * Called with the mutex held, it is released while the device is
+     * opened and its serial number read: those run libusb event handling,
+     * which may call HotplugCallback on this thread.
+     * @return handle, or NULL if no port is ready
+     */
+    libusb_device_handle* OpenSettledPort(std::unique_lock<std::mutex>& lock,
+                                          uint64_t now) {
+        // A handle from the constructor goes first
+        libusb_device_handle* handle = instance.provisional_usb_handle;
+        instance.provisional_usb_handle = NULL;
+        if (handle != NULL) {
+            uint64_t key = PortKey(libusb_get_device(handle));
+            if (instance.ports[key].present) {
+                instance.active_port = key;
+                return handle;
+            }
+            // Left before the first Update
+            lock.unlock();
+            libusb_close(handle);
+            lock.lock();
+        }
+
+        if (instance.last_init != 0 &&
+            now - instance.last_init < instance.config.settle_ms * 1000000ull)
+            return NULL;
+
+        uint64_t key;
+        HotplugPort* port;
+        while ((port = FindSettledPort(now, key)) != NULL) {
+            libusb_device* device = libusb_ref_device(port->device);
+            libusb_device_handle* retired = instance.retired_usb_handle;
+            instance.retired_usb_handle = NULL;
+            instance.last_init = now;
+            lock.unlock();
+
+            libusb_close(retired);
+            int ret = libusb_open(device, &handle);
+            bool serial_matches =
+                ret >= 0 &&
+                Enumerator::MatchesSerial(instance.expected, handle);
+
+            lock.lock();
+            // The port may have changed while it was unlocked
+            auto it = instance.ports.find(key);
+            port = it == instance.ports.end() ? NULL : &it->second;
+            bool current = port != NULL && port->present &&
+                           port->device == device;
+            libusb_unref_device(device);
+
+            if (ret < 0) {
+                USS_LOG_ERROR("Error on hotplug connect: %s\n",
+                              libusb_strerror((libusb_error)ret));
+                instance.stats.failures++;
+                instance.last_error = error::Result::Fail(
+                    error::Code::LibUsb, "Error on hotplug connect", ret);
+                return NULL;
+            }
+
+            if (current && serial_matches) {
+                instance.active_port = key;
+                return handle;
             }
+
+            if (current) {
+                USS_LOG_WARN("Device with required vid & pid connected with "
+                             "different serial number\n");
+                port->rejected = true;
+            }
+            instance.last_init = 0;
+            lock.unlock();
+            libusb_close(handle);
+            lock.lock();
+
+            // A port that changed meanwhile waits out its debounce again
+            if (!current)
+                return NULL;
         }
+        return NULL;
+    }
+
+public:
+    Hotpluggable(ExpectedDeviceData _expected,
+                 std::function<void(Hotpluggable*)> _connect_callback = NULL,
+                 std::function<void(Hotpluggable*)> _disconnect_callback = NULL)
+        : connect_callback(_connect_callback),
+          disconnect_callback(_disconnect_callback) {
+        instance.expected = _expected;
+        error::Raise(Register(true));
+    }
+
+    /**
+     * Exception free constructor, check result before using the device
+     */
+    Hotpluggable(ExpectedDeviceData _expected, error::Result& result,
+                 std::function<void(Hotpluggable*)> _connect_callback = NULL,
+                 std::function<void(Hotpluggable*)> _disconnect_callback = NULL)
+        : connect_callback(_connect_callback),
+          disconnect_callback(_disconnect_callback) {
+        instance.expected = _expected;
+        result = Register(true);
+    }
+
+    /**
+     * Start from a handle found by an Enumerator, the controller takes
+     * ownership. It is initialized by the next Update.
+     */
+    Hotpluggable(ExpectedDeviceData _expected, libusb_device_handle* handle,
+                 std::function<void(Hotpluggable*)> _connect_callback = NULL,
+                 std::function<void(Hotpluggable*)> _disconnect_callback = NULL)
+        : connect_callback(_connect_callback),
+          disconnect_callback(_disconnect_callback) {
+        instance.expected = _expected;
+        if (handle != NULL)
+            Adopt(handle);
+        error::Raise(Register(false));
     }
 
     ~Hotpluggable() {
-        libusb_hotplug_deregister_callback(NULL, callback_handle);
+        if (registered)
+            libusb_hotplug_deregister_callback(NULL, callback_handle);
+        libusb_close(instance.provisional_usb_handle);
         libusb_close(instance.usb_handle);
+        libusb_close(instance.retired_usb_handle);
+        for (auto& port : instance.ports)
+            if (port.second.device != NULL)
+                libusb_unref_device(port.second.device);
     }
 
     libusb_device* GetUsbDevice() override {
@@ -129,28 +361,123 @@ public:
         return instance.usb_handle;
     }
 
-    void Update() override {
-        if (instance.handle_disconnect) {
-            instance.handle_disconnect = false;
+    /**
+     * Last failure seen while (re)connecting, kept until the next one
+     */
+    error::Result GetLastError() const { return instance.last_error; }
+
+    void SetHotplugConfig(const HotplugConfig& config) {
+        std::lock_guard<std::mutex> lock(instance.mutex);
+        instance.config = config;
+    }
+
+    HotplugConfig GetHotplugConfig() {
+        std::lock_guard<std::mutex> lock(instance.mutex);
+        return instance.config;
+    }
+
+    HotplugStats GetHotplugStats() {
+        std::lock_guard<std::mutex> lock(instance.mutex);
+        return instance.stats;
+    }
+
+    /**
+     * Time from an initialized device leaving until it was ready again
+     */
+    const stats::Histogram& GetReconnectTime() {
+        return instance.reconnect_time;
+    }
+
+    /**
+     * Exception free Update; a device that fails to initialise is closed
+     * and the failure returned, it is retried after the settle period
+     */
+    error::Result TryUpdate() {
+        uint64_t now = timing::Now();
+        std::unique_lock<std::mutex> lock(instance.mutex);
+
+        if (instance.usb_handle != NULL) {
+            HotplugPort& port = instance.ports[instance.active_port];
+            if (port.present && port.device == GetUsbDevice())
+                return error::Result::Ok();
+
+            // Gone, or replaced by a new arrival on the same port
+            instance.retired_usb_handle = instance.usb_handle;
+            instance.usb_handle = NULL;
+            instance.usb_device = NULL;
+            instance.stats.disconnects++;
+            port.left = now;
+            lock.unlock();
+
             if (disconnect_callback != NULL)
                 disconnect_callback(this);
-        }
+#if defined(USS_COROUTINES)
+            connected = false;
+            connection.Notify();
+#endif
 
-        if (instance.usb_handle != NULL)
-            return;
+            // Let transfers finish cancelling before anything is reopened
+            return error::Result::Ok();
+        }
 
-        if (instance.provisional_usb_handle == NULL)
-            return;
+        libusb_device_handle* handle = OpenSettledPort(lock, now);
+        if (handle == NULL)
+            return error::Result::Ok();
+        uint64_t left = instance.ports[instance.active_port].left;
+        instance.usb_handle = handle;
+        instance.usb_device = NULL;
+        lock.unlock();
 
-        instance.usb_handle = instance.provisional_usb_handle;
-        instance.provisional_usb_handle = NULL;
+        error::Result result = TryReinitialize();
+        if (!result) {
+            USS_LOG_ERROR("Failed to initialise hotplugged device: %s\n",
+                          result.message);
+            lock.lock();
+            handle = instance.usb_handle;
+            instance.usb_handle = NULL;
+            instance.usb_device = NULL;
+            instance.stats.failures++;
+            instance.last_error = result;
+            lock.unlock();
+            libusb_close(handle);
+            return result;
+        }
 
-        Reinitialize();
+        lock.lock();
+        instance.stats.connects++;
+        if (left != 0)
+            instance.reconnect_time.Record(timing::Now() - left);
+        instance.ports[instance.active_port].left = 0;
+        lock.unlock();
 
         if (connect_callback != NULL)
             connect_callback(this);
+#if defined(USS_COROUTINES)
+        connected = true;
+        connection.Notify();
+#endif
+        return error::Result::Ok();
+    }
+
+    void Update() override { error::Raise(TryUpdate()); }
+
+#if defined(USS_COROUTINES)
+    /**
+     * co_await until a device is initialized, resumed on scheduler
+     * Connected callbacks have run by then.
+     */
+    coro::Signal::Awaiter Connected(coro::Scheduler& scheduler) {
+        return connection.Wait(scheduler, IsConnected, this);
+    }
+
+    /**
+     * co_await until the initialized device goes away
+     */
+    coro::Signal::Awaiter Disconnected(coro::Scheduler& scheduler) {
+        return connection.Wait(scheduler, IsDisconnected, this);
     }
+#endif
 };
 
 } // namespace ctl
-} // namespace uss
\ No newline at end of file
+} // namespace uss
@@ -0,0 +1,101 @@
+/**
+ * usbselfserial by lotuspar (https://github.com/lotuspar)
+ *
+ * Inspired / based on:
+ *     the usb-serial-for-android project made in Java,
+ *         * which is copyright 2011-2013 Google Inc., 2013 Mike Wakerly
+ *         * https://github.com/mik3y/usb-serial-for-android
+ *     the Linux serial port drivers,
+ *         * https://github.com/torvalds/linux/tree/master/drivers/usb/serial
+ *     and the FreeBSD serial port drivers
+ *         * https://github.com/freebsd/freebsd-src/tree/main/sys/dev/usb/serial
+ * Some parts rewritten in C++ for usbselfserial!
+ *     * (by the time you read this it could have a different name!)
+ * - 2022
+ */
+#pragma once
+#include "../device.hpp"
+#include <libusb-1.0/libusb.h>
+
+namespace uss {
+namespace ctl {
+
+/**
+ * One serial port of a multi-port device
+ * Ports share the parent controller's handle, transfers and hotplug
+ * handling; each has its own driver, line settings, endpoints and output.
+ * The parent needs no driver of its own, it re-initializes its ports when
+ * it (re)connects. A reset from one port resets the whole device.
+ */
+class Port : public BaseDevice {
+    BaseDevice* parent;
+    uint8_t port_index;
+
+public:
+    /**
+     * @param index port on the device, see BaseDriver::CountDevicePorts
+     */
+    Port(BaseDevice& _parent, uint8_t _index)
+        : parent(&_parent), port_index(_index) {
+        parent->AddPort(this);
+    }
+
+    Port(const Port&) = delete;
+    Port& operator=(const Port&) = delete;
+
+    ~Port() { parent->RemovePort(this); }
+
+    uint8_t GetPortIndex() override { return port_index; }
+    BaseDevice& GetParent() { return *parent; }
+
+    libusb_device_handle* GetUsbHandle() override {
+        return parent->GetUsbHandle();
+    }
+    libusb_device* GetUsbDevice() override { return parent->GetUsbDevice(); }
+    bool Ready() override { return parent->Ready(); }
+
+    int SubmitTransfer(libusb_transfer* transfer) override {
+        return parent->SubmitTransfer(transfer);
+    }
+
+    int CancelTransfer(libusb_transfer* transfer) override {
+        return parent->CancelTransfer(transfer);
+    }
+
+    int ControlTransfer(uint8_t request_type, uint8_t request, uint16_t value,
+                        uint16_t index, uint8_t* data, uint16_t length,
+                        uint32_t timeout) override {
+        return parent->ControlTransfer(request_type, request, value, index,
+                                       data, length, timeout);
+    }
+
+    int GetDeviceDescriptor(libusb_device_descriptor* descriptor) override {
+        return parent->GetDeviceDescriptor(descriptor);
+    }
+
+    int GetConfigDescriptor(uint8_t index,
+                            libusb_config_descriptor** config) override {
+        return parent->GetConfigDescriptor(index, config);
+    }
+
+    void FreeConfigDescriptor(libusb_config_descriptor* config) override {
+        parent->FreeConfigDescriptor(config);
+    }
+
+    int DetachKernelDriver(int interface) override {
+        return parent->DetachKernelDriver(interface);
+    }
+
+    int ClaimInterface(int interface) override {
+        return parent->ClaimInterface(interface);
+    }
+
+    int ClearHalt(uint8_t endpoint) override {
+        return parent->ClearHalt(endpoint);
+    }
+
+    int ResetDevice() override { return parent->ResetDevice(); }
+};
+
+} // namespace ctl
+} // namespace uss
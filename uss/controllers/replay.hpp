@@ -0,0 +1,161 @@
+/**
+ * usbselfserial by lotuspar (https://github.com/lotuspar)
+ *
+ * Inspired / based on:
+ *     the usb-serial-for-android project made in Java,
+ *         * which is copyright 2011-2013 Google Inc., 2013 Mike Wakerly
+ *         * https://github.com/mik3y/usb-serial-for-android
+ *     the Linux serial port drivers,
+ *         * https://github.com/torvalds/linux/tree/master/drivers/usb/serial
+ *     and the FreeBSD serial port drivers
+ *         * https://github.com/freebsd/freebsd-src/tree/main/sys/dev/usb/serial
+ * Some parts rewritten in C++ for usbselfserial!
+ *     * (by the time you read this it could have a different name!)
+ * - 2022
+ */
+#pragma once
+#include "../capture.hpp"
+#include "../timing.hpp"
+#include "software.hpp"
+#include <cstring>
+#include <functional>
+#include <vector>
+
+namespace uss {
+namespace ctl {
+
+struct ReplayStats {
+    uint64_t records = 0;
+    uint64_t device_bytes = 0; // delivered through RX transfers
+    uint64_t host_bytes = 0;   // handed to the host write callback
+    uint64_t max_lag = 0;      // worst delay behind capture timing, ns
+};
+
+/**
+ * Software device that plays a capture file back
+ * Device -> host records are returned through RX transfers, host -> device
+ * records are handed to the host write callback (e.g. written into the pty)
+ * so the TX path runs too.
+ * speed scales capture timing: 1.0 is original timing, 2.0 twice as fast,
+ * 0 plays back as fast as transfers are resubmitted.
+ */
+class Replay : public Software {
+    capture::Reader reader;
+    double speed;
+    std::function<void(const uint8_t*, size_t)> host_write_callback = NULL;
+
+    capture::RecordHeader record;
+    std::vector<uint8_t> record_data;
+    size_t record_offset = 0;
+    bool record_valid = false;
+
+    uint64_t first_timestamp = 0;
+    uint64_t start_time = 0;
+    ReplayStats stats;
+
+    void NextRecord() {
+        record_offset = 0;
+        do {
+            record_valid = reader.Next(record, record_data);
+        } while (record_valid && record.length == 0);
+    }
+
+    /**
+     * Time after start at which the current record is due (ns)
+     */
+    uint64_t RecordDueTime() {
+        if (speed <= 0)
+            return 0;
+        return (uint64_t)((record.timestamp - first_timestamp) / speed);
+    }
+
+    bool RecordDue(uint64_t now) {
+        return record_valid && now - start_time >= RecordDueTime();
+    }
+
+    void RecordStarted(uint64_t now) {
+        uint64_t lag = now - start_time - RecordDueTime();
+        if (lag > stats.max_lag)
+            stats.max_lag = lag;
+    }
+
+public:
+    Replay(const char* path, double _speed = 1.0,
+           SoftwareLayout layout = SoftwareLayout::Vendor,
+           uint16_t packet_size = 64)
+        : Software(layout, packet_size), reader(path), speed(_speed) {
+        NextRecord();
+        if (record_valid)
+            first_timestamp = record.timestamp;
+    }
+
+    void SetHostWriteCallback(
+        std::function<void(const uint8_t*, size_t)> callback) {
+        host_write_callback = callback;
+    }
+
+    bool Finished() { return !record_valid; }
+
+    /**
+     * Time until the next record is due (ns), 0 if it's due already
+     */
+    uint64_t TimeUntilNextRecord() {
+        if (!record_valid || start_time == 0)
+            return 0;
+        uint64_t due = start_time + RecordDueTime();
+        uint64_t now = timing::Now();
+        return now >= due ? 0 : due - now;
+    }
+
+    const ReplayStats& GetStats() { return stats; }
+
+    void Update() override {
+        uint64_t now = timing::Now();
+        if (start_time == 0)
+            start_time = now;
+
+        // Host -> device records go straight to the host side
+        while (record_valid &&
+               record.direction == capture::Direction::HostToDevice &&
+               RecordDue(now)) {
+            RecordStarted(now);
+            if (host_write_callback != NULL)
+                host_write_callback(record_data.data(), record.length);
+            stats.host_bytes += record.length;
+            stats.records++;
+            NextRecord();
+        }
+
+        Software::Update();
+    }
+
+protected:
+    int DeviceRead(uint8_t* buffer, int length) override {
+        if (!record_valid ||
+            record.direction != capture::Direction::DeviceToHost)
+            return 0;
+
+        uint64_t now = timing::Now();
+        if (!RecordDue(now))
+            return 0;
+        if (record_offset == 0)
+            RecordStarted(now);
+
+        // Records bigger than the transfer span several transfers
+        size_t count = record.length - record_offset;
+        if (count > (size_t)length)
+            count = length;
+        memcpy(buffer, record_data.data() + record_offset, count);
+        record_offset += count;
+        stats.device_bytes += count;
+
+        if (record_offset == record.length) {
+            stats.records++;
+            NextRecord();
+        }
+        return (int)count;
+    }
+};
+
+} // namespace ctl
+} // namespace uss
\ No newline at end of file
@@ -0,0 +1,391 @@
+/**
+ * usbselfserial by lotuspar (https://github.com/lotuspar)
+ *
+ * Inspired / based on:
+ *     the usb-serial-for-android project made in Java,
+ *         * which is copyright 2011-2013 Google Inc., 2013 Mike Wakerly
+ *         * https://github.com/mik3y/usb-serial-for-android
+ *     the Linux serial port drivers,
+ *         * https://github.com/torvalds/linux/tree/master/drivers/usb/serial
+ *     and the FreeBSD serial port drivers
+ *         * https://github.com/freebsd/freebsd-src/tree/main/sys/dev/usb/serial
+ * Some parts rewritten in C++ for usbselfserial!
+ *     * (by the time you read this it could have a different name!)
+ * - 2022
+ */
+#pragma once
+#include "../controller.hpp"
+#include "../device.hpp"
+#include "../timing.hpp"
+#include "../usbvars.hpp"
+#include <cstring>
+#include <libusb-1.0/libusb.h>
+#include <mutex>
+#include <vector>
+
+namespace uss {
+namespace ctl {
+
+/**
+ * USB descriptor layout presented by a software device
+ */
+enum class SoftwareLayout {
+    Vendor, // one vendor class interface, like ch34x chips
+    CdcAcm  // CDC communication + data interface pair
+};
+
+/**
+ * A device with no hardware behind it.
+ * Drivers and outputs run their normal code paths against it; transfers
+ * complete from Update() on the calling thread, like they would inside
+ * libusb_handle_events. Subclasses decide what the "device" does with data.
+ */
+class Software : public BaseDevice, public BaseController {
+    constexpr static const uint8_t InEndpoint = 0x82;
+    constexpr static const uint8_t OutEndpoint = 0x02;
+    constexpr static const uint8_t InterruptEndpoint = 0x81;
+
+    libusb_device_descriptor device_descriptor = {};
+    libusb_config_descriptor config_descriptor = {};
+    libusb_interface interfaces[2] = {};
+    libusb_interface_descriptor interface_descriptors[2] = {};
+    libusb_endpoint_descriptor endpoint_descriptors[3] = {};
+
+    std::mutex transfers_mutex;
+    std::vector<libusb_transfer*> transfers; // submitted, not completed
+    std::vector<libusb_transfer*> cancelled; // cancelled, callback pending
+    std::vector<libusb_transfer*> completed;
+    std::vector<uint8_t> halted; // endpoints that stall until cleared
+    bool wedged = false;         // halts survive ClearHalt, not a reset
+    bool connected = true;
+    uint32_t uart_fifo = 0;      // see SetUartFifo
+    uint64_t uart_drain_end = 0; // ns, when the modelled FIFO is empty
+
+    /**
+     * Whether the modelled FIFO can take length more bytes
+     */
+    bool UartRoom(int length) {
+        uint32_t room = (uint32_t)length > uart_fifo ? length : uart_fifo;
+        uint64_t character_time = LineCharacterTime();
+        return GetUartBacklog() + (uint64_t)length * character_time <=
+               (uint64_t)room * character_time;
+    }
+
+    bool Halted(uint8_t endpoint) {
+        for (uint8_t halt : halted)
+            if (halt == endpoint)
+                return true;
+        return false;
+    }
+
+    void SetEndpoint(int index, uint8_t address, uint8_t attributes,
+                     uint16_t packet_size) {
+        libusb_endpoint_descriptor& endpoint = endpoint_descriptors[index];
+        endpoint.bLength = 7;
+        endpoint.bDescriptorType = LIBUSB_DT_ENDPOINT;
+        endpoint.bEndpointAddress = address;
+        endpoint.bmAttributes = attributes;
+        endpoint.wMaxPacketSize = packet_size;
+    }
+
+    void SetInterface(int index, uint8_t interface_class,
+                      const libusb_endpoint_descriptor* endpoints,
+                      uint8_t endpoint_count) {
+        libusb_interface_descriptor& interface = interface_descriptors[index];
+        interface.bLength = 9;
+        interface.bDescriptorType = LIBUSB_DT_INTERFACE;
+        interface.bInterfaceNumber = index;
+        interface.bInterfaceClass = interface_class;
+        interface.bNumEndpoints = endpoint_count;
+        interface.endpoint = endpoints;
+        interfaces[index].altsetting = &interface;
+        interfaces[index].num_altsetting = 1;
+    }
+
+public:
+    Software(SoftwareLayout layout = SoftwareLayout::Vendor,
+             uint16_t packet_size = 64) {
+        device_descriptor.bLength = 18;
+        device_descriptor.bDescriptorType = LIBUSB_DT_DEVICE;
+        device_descriptor.bcdUSB = 0x0200;
+        device_descriptor.bMaxPacketSize0 = 64;
+        device_descriptor.bNumConfigurations = 1;
+
+        SetEndpoint(0, InEndpoint, LIBUSB_TRANSFER_TYPE_BULK, packet_size);
+        SetEndpoint(1, OutEndpoint, LIBUSB_TRANSFER_TYPE_BULK, packet_size);
+        SetEndpoint(2, InterruptEndpoint, LIBUSB_TRANSFER_TYPE_INTERRUPT, 8);
+
+        if (layout == SoftwareLayout::CdcAcm) {
+            SetInterface(0, driver::usbvars::UsbClassComm,
+                         endpoint_descriptors + 2, 1);
+            interface_descriptors[0].bInterfaceSubClass =
+                driver::usbvars::UsbSubclassAcm;
+            SetInterface(1, driver::usbvars::UsbClassCdcData,
+                         endpoint_descriptors, 2);
+            config_descriptor.bNumInterfaces = 2;
+        } else {
+            SetInterface(0, 0xff, endpoint_descriptors, 3);
+            config_descriptor.bNumInterfaces = 1;
+        }
+
+        config_descriptor.bLength = 9;
+        config_descriptor.bDescriptorType = LIBUSB_DT_CONFIG;
+        config_descriptor.bConfigurationValue = 1;
+        config_descriptor.interface = interfaces;
+    }
+
+    Software(const Software&) = delete;
+    Software& operator=(const Software&) = delete;
+
+    libusb_device* GetUsbDevice() override { return NULL; }
+    libusb_device_handle* GetUsbHandle() override { return NULL; }
+    bool Ready() override { return connected; }
+
+    int SubmitTransfer(libusb_transfer* transfer) override {
+        std::lock_guard<std::mutex> lock(transfers_mutex);
+        if (!connected)
+            return LIBUSB_ERROR_NO_DEVICE;
+        transfers.push_back(transfer);
+        return 0;
+    }
+
+    int CancelTransfer(libusb_transfer* transfer) override {
+        std::lock_guard<std::mutex> lock(transfers_mutex);
+        for (size_t i = 0; i < transfers.size(); i++) {
+            if (transfers[i] != transfer)
+                continue;
+            transfers.erase(transfers.begin() + i);
+            cancelled.push_back(transfer);
+            return 0;
+        }
+        return LIBUSB_ERROR_NOT_FOUND;
+    }
+
+    int ControlTransfer(uint8_t request_type, uint8_t request, uint16_t value,
+                        uint16_t index, uint8_t* data, uint16_t length,
+                        uint32_t timeout) override {
+        if (!connected)
+            return LIBUSB_ERROR_NO_DEVICE;
+        return HandleControl(request_type, request, value, index, data,
+                             length);
+    }
+
+    int GetDeviceDescriptor(libusb_device_descriptor* descriptor) override {
+        *descriptor = device_descriptor;
+        return 0;
+    }
+
+    int GetConfigDescriptor(uint8_t index,
+                            libusb_config_descriptor** config) override {
+        if (index != 0)
+            return LIBUSB_ERROR_NOT_FOUND;
+        *config = &config_descriptor;
+        return 0;
+    }
+
+    void FreeConfigDescriptor(libusb_config_descriptor* config) override {}
+
+    int DetachKernelDriver(int interface) override { return 0; }
+
+    int ClaimInterface(int interface) override {
+        if (interface >= config_descriptor.bNumInterfaces)
+            return LIBUSB_ERROR_NOT_FOUND;
+        return 0;
+    }
+
+    int ClearHalt(uint8_t endpoint) override {
+        std::lock_guard<std::mutex> lock(transfers_mutex);
+        if (!connected)
+            return LIBUSB_ERROR_NO_DEVICE;
+        if (wedged)
+            return 0;
+        for (size_t i = 0; i < halted.size(); i++)
+            if (halted[i] == endpoint)
+                halted.erase(halted.begin() + i--);
+        return 0;
+    }
+
+    int ResetDevice() override {
+        std::lock_guard<std::mutex> lock(transfers_mutex);
+        if (!connected)
+            return LIBUSB_ERROR_NO_DEVICE;
+        halted.clear();
+        wedged = false;
+
+        // Like a port reset, whatever was submitted is killed
+        for (libusb_transfer* transfer : transfers)
+            cancelled.push_back(transfer);
+        transfers.clear();
+        return 0;
+    }
+
+    /**
+     * Halt an endpoint, its transfers complete with LIBUSB_TRANSFER_STALL
+     * on the next Update() until ClearHalt
+     * @param wedge only a ResetDevice recovers it
+     */
+    void Stall(uint8_t endpoint, bool wedge = false) {
+        std::lock_guard<std::mutex> lock(transfers_mutex);
+        if (!Halted(endpoint))
+            halted.push_back(endpoint);
+        wedged = wedged || wedge;
+    }
+
+    /**
+     * Unplug the device
+     * Outstanding transfers complete with LIBUSB_TRANSFER_NO_DEVICE on the
+     * next Update()
+     */
+    void Disconnect() {
+        std::lock_guard<std::mutex> lock(transfers_mutex);
+        connected = false;
+    }
+
+    void Connect() {
+        std::lock_guard<std::mutex> lock(transfers_mutex);
+        connected = true;
+    }
+
+    /**
+     * Model the adapter's TX FIFO draining at the configured line rate
+     * OUT transfers stay pending while the FIFO has no room for them, as a
+     * chip NAKs, so data queues in the device like on real hardware. A
+     * transfer bigger than the FIFO waits for it to empty. 0 (default)
+     * takes writes at once.
+     */
+    void SetUartFifo(uint32_t bytes) {
+        std::lock_guard<std::mutex> lock(transfers_mutex);
+        uart_fifo = bytes;
+        uart_drain_end = 0;
+    }
+
+    /**
+     * Time until the modelled FIFO is empty, ns
+     * From DeviceWrite, this is how long its data waits to go out.
+     */
+    uint64_t GetUartBacklog() {
+        uint64_t now = timing::Now();
+        return uart_drain_end > now ? uart_drain_end - now : 0;
+    }
+
+    void Update() override {
+        {
+            std::lock_guard<std::mutex> lock(transfers_mutex);
+
+            for (libusb_transfer* transfer : cancelled) {
+                transfer->status = LIBUSB_TRANSFER_CANCELLED;
+                transfer->actual_length = 0;
+                completed.push_back(transfer);
+            }
+            cancelled.clear();
+
+            // Transfers on an endpoint complete in submission order, one
+            // left pending holds back the ones behind it
+            uint32_t pending = 0;
+            for (size_t i = 0; i < transfers.size();) {
+                libusb_transfer* transfer = transfers[i];
+                uint32_t endpoint_bit = 1u << ((transfer->endpoint & 0x0f) |
+                                               ((transfer->endpoint >> 3) &
+                                                0x10));
+                int length;
+
+                if (pending & endpoint_bit) {
+                    i++;
+                    continue;
+                } else if (!connected) {
+                    transfer->status = LIBUSB_TRANSFER_NO_DEVICE;
+                    length = 0;
+                } else if (transfer->type == LIBUSB_TRANSFER_TYPE_CONTROL) {
+                    libusb_control_setup* setup =
+                        (libusb_control_setup*)transfer->buffer;
+                    length = HandleControl(
+                        setup->bmRequestType, setup->bRequest, setup->wValue,
+                        setup->wIndex,
+                        transfer->buffer + LIBUSB_CONTROL_SETUP_SIZE,
+                        setup->wLength);
+                    transfer->status = length < 0 ? LIBUSB_TRANSFER_STALL
+                                                  : LIBUSB_TRANSFER_COMPLETED;
+                    if (length < 0)
+                        length = 0;
+                } else if (Halted(transfer->endpoint)) {
+                    transfer->status = LIBUSB_TRANSFER_STALL;
+                    length = 0;
+                } else if (transfer->endpoint & driver::usbvars::UsbDirIn) {
+                    length = DeviceRead(transfer->buffer, transfer->length);
+                    if (length == 0) {
+                        pending |= endpoint_bit;
+                        i++;
+                        continue;
+                    }
+                    transfer->status = LIBUSB_TRANSFER_COMPLETED;
+                } else if (uart_fifo != 0 && !UartRoom(transfer->length)) {
+                    pending |= endpoint_bit;
+                    i++;
+                    continue;
+                } else {
+                    length = DeviceWrite(transfer->buffer, transfer->length);
+                    if (length == 0 && transfer->length != 0) {
+                        pending |= endpoint_bit;
+                        i++;
+                        continue;
+                    }
+                    transfer->status = LIBUSB_TRANSFER_COMPLETED;
+                    if (uart_fifo != 0) {
+                        uint64_t now = timing::Now();
+                        if (uart_drain_end < now)
+                            uart_drain_end = now;
+                        uart_drain_end +=
+                            (uint64_t)length * LineCharacterTime();
+                    }
+                }
+
+                transfer->actual_length = length;
+                transfers.erase(transfers.begin() + i);
+                completed.push_back(transfer);
+            }
+        }
+
+        // Run callbacks unlocked, they usually resubmit
+        for (libusb_transfer* transfer : completed)
+            transfer->callback(transfer);
+        completed.clear();
+    }
+
+protected:
+    /**
+     * Character time the modelled FIFO drains at, see SetUartFifo
+     * Defaults to the host side settings, emulators use what the driver
+     * actually programmed.
+     */
+    virtual uint64_t LineCharacterTime() { return GetCharacterTime(); }
+
+    /**
+     * Device -> host data for a submitted IN transfer
+     * @return bytes placed in buffer, 0 to leave the transfer pending
+     */
+    virtual int DeviceRead(uint8_t* buffer, int length) { return 0; }
+
+    /**
+     * Host -> device data from a submitted OUT transfer
+     * @return bytes accepted, 0 to leave the transfer pending
+     */
+    virtual int DeviceWrite(const uint8_t* data, int length) { return length; }
+
+    /**
+     * Control request on endpoint 0
+     * Default accepts everything and reads back zeroes.
+     * @return bytes transferred or a libusb error code
+     */
+    virtual int HandleControl(uint8_t request_type, uint8_t request,
+                              uint16_t value, uint16_t index, uint8_t* data,
+                              uint16_t length) {
+        if (!(request_type & driver::usbvars::UsbDirIn))
+            return 0;
+        if (data != NULL)
+            memset(data, 0, length);
+        return length;
+    }
+};
+
+} // namespace ctl
+} // namespace uss
\ No newline at end of file
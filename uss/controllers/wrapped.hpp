@@ -0,0 +1,96 @@
+/**
+ * usbselfserial by lotuspar (https://github.com/lotuspar)
+ *
+ * Inspired / based on:
+ *     the usb-serial-for-android project made in Java,
+ *         * which is copyright 2011-2013 Google Inc., 2013 Mike Wakerly
+ *         * https://github.com/mik3y/usb-serial-for-android
+ *     the Linux serial port drivers,
+ *         * https://github.com/torvalds/linux/tree/master/drivers/usb/serial
+ *     and the FreeBSD serial port drivers
+ *         * https://github.com/freebsd/freebsd-src/tree/main/sys/dev/usb/serial
+ * Some parts rewritten in C++ for usbselfserial!
+ *     * (by the time you read this it could have a different name!)
+ * - 2022
+ */
+#pragma once
+#include "../controller.hpp"
+#include "../device.hpp"
+#include "../error.hpp"
+#include <libusb-1.0/libusb.h>
+#include <unistd.h>
+
+namespace uss {
+namespace ctl {
+
+/**
+ * A device opened by someone else, handed over as a usbfs fd
+ * A privileged broker, udev helper or parent process opens
+ * /dev/bus/usb/BBB/DDD and passes the fd on (inherited or over a unix
+ * socket), so this process needs no root and skips enumeration. The fd is
+ * wrapped with libusb_wrap_sys_device (libusb 1.0.23+). There's no hotplug:
+ * once the device is gone transfers fail with LIBUSB_ERROR_NO_DEVICE and a
+ * new fd is needed. Set LIBUSB_OPTION_NO_DEVICE_DISCOVERY before
+ * libusb_init if the process can't scan the bus at all.
+ */
+class Wrapped : public BaseDevice, public BaseController {
+private:
+    libusb_device_handle* usb_handle = NULL;
+    libusb_device* usb_device = NULL;
+    int fd;
+    bool close_fd;
+
+    error::Result Open(libusb_context* context) {
+        int ret = libusb_wrap_sys_device(context, (intptr_t)fd, &usb_handle);
+        if (ret < 0) {
+            usb_handle = NULL;
+            return error::Result::Fail(error::Code::UsbAccess,
+                                       "Failed to wrap device fd", ret);
+        }
+        return error::Result::Ok();
+    }
+
+public:
+    /**
+     * @param close_fd close fd along with the controller, libusb doesn't
+     */
+    Wrapped(int _fd, bool _close_fd = true, libusb_context* context = NULL)
+        : fd(_fd), close_fd(_close_fd) {
+        error::Raise(Open(context));
+    }
+
+    /**
+     * Exception free constructor, check result before using the device
+     */
+    Wrapped(int _fd, error::Result& result, bool _close_fd = true,
+            libusb_context* context = NULL)
+        : fd(_fd), close_fd(_close_fd) {
+        result = Open(context);
+    }
+
+    Wrapped(const Wrapped&) = delete;
+    Wrapped& operator=(const Wrapped&) = delete;
+
+    ~Wrapped() {
+        libusb_close(usb_handle);
+        if (close_fd)
+            close(fd);
+    }
+
+    libusb_device* GetUsbDevice() override {
+        if (usb_handle == NULL)
+            return NULL;
+        if (usb_device == NULL)
+            usb_device = libusb_get_device(usb_handle);
+        return usb_device;
+    }
+
+    libusb_device_handle* GetUsbHandle() override { return usb_handle; }
+
+    int GetFd() { return fd; }
+
+    void Update() override { return; }
+};
+
+} // namespace ctl
+} // namespace uss
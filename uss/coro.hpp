@@ -0,0 +1,442 @@
+/**
+ * usbselfserial by lotuspar (https://github.com/lotuspar)
+ *
+ * Inspired / based on:
+ *     the usb-serial-for-android project made in Java,
+ *         * which is copyright 2011-2013 Google Inc., 2013 Mike Wakerly
+ *         * https://github.com/mik3y/usb-serial-for-android
+ *     the Linux serial port drivers,
+ *         * https://github.com/torvalds/linux/tree/master/drivers/usb/serial
+ *     and the FreeBSD serial port drivers
+ *         * https://github.com/freebsd/freebsd-src/tree/main/sys/dev/usb/serial
+ * Some parts rewritten in C++ for usbselfserial!
+ *     * (by the time you read this it could have a different name!)
+ * - 2022
+ */
+#pragma once
+#if __has_include(<version>)
+#include <version>
+#endif
+#if defined(__cpp_impl_coroutine) && defined(__cpp_lib_coroutine)
+#define USS_COROUTINES
+#endif
+
+#if defined(USS_COROUTINES)
+#include "buffer.hpp"
+#include "device.hpp"
+#include "error.hpp"
+#include <condition_variable>
+#include <coroutine>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace uss {
+namespace coro {
+
+/**
+ * Coroutine frames come from the buffer::Allocator size classes, so
+ * starting a coroutine doesn't touch the heap once the pools are warm
+ */
+struct Frame {
+    constexpr static const size_t Header = __STDCPP_DEFAULT_NEW_ALIGNMENT__;
+
+    static void* Allocate(size_t size) {
+        buffer::Ref ref =
+            buffer::Allocator::Instance().Acquire((uint32_t)(size + Header));
+        uint8_t* base;
+        buffer::Block* block = NULL;
+        if (ref) {
+            block = ref.Detach();
+            base = block->data;
+        } else {
+            // Bigger than the largest class
+            base = (uint8_t*)::operator new(size + Header);
+        }
+        memcpy(base, &block, sizeof(block));
+        return base + Header;
+    }
+
+    static void Free(void* frame) {
+        uint8_t* base = (uint8_t*)frame - Header;
+        buffer::Block* block;
+        memcpy(&block, base, sizeof(block));
+        if (block != NULL)
+            buffer::ReleaseBlock(block);
+        else
+            ::operator delete(base);
+    }
+};
+
+class Scheduler;
+
+/**
+ * Shared part of every Task promise
+ */
+struct PromiseBase {
+    std::coroutine_handle<> continuation = NULL;
+    bool detached = false; // started by Scheduler::Spawn, frees itself
+#if !defined(USS_NO_EXCEPTIONS)
+    std::exception_ptr exception = NULL;
+#endif
+
+    static void* operator new(size_t size) { return Frame::Allocate(size); }
+    static void operator delete(void* frame) { Frame::Free(frame); }
+
+    struct FinalAwaiter {
+        bool await_ready() noexcept { return false; }
+
+        template <typename P>
+        std::coroutine_handle<>
+        await_suspend(std::coroutine_handle<P> handle) noexcept {
+            PromiseBase& promise = handle.promise();
+            std::coroutine_handle<> next = promise.continuation;
+            if (promise.detached)
+                handle.destroy();
+            if (next)
+                return next;
+            return std::noop_coroutine();
+        }
+
+        void await_resume() noexcept {}
+    };
+
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    FinalAwaiter final_suspend() noexcept { return {}; }
+
+    void unhandled_exception() {
+#if defined(USS_NO_EXCEPTIONS)
+        abort();
+#else
+        exception = std::current_exception();
+#endif
+    }
+
+    void Rethrow() {
+#if !defined(USS_NO_EXCEPTIONS)
+        if (exception)
+            std::rethrow_exception(exception);
+#endif
+    }
+};
+
+template <typename T> class Task;
+
+template <typename T> struct TaskPromise : PromiseBase {
+    T value{};
+
+    Task<T> get_return_object();
+    void return_value(T _value) { value = std::move(_value); }
+    T Take() {
+        Rethrow();
+        return std::move(value);
+    }
+};
+
+template <> struct TaskPromise<void> : PromiseBase {
+    Task<void> get_return_object();
+    void return_void() {}
+    void Take() { Rethrow(); }
+};
+
+/**
+ * Lazily started coroutine returning T
+ * Runs when awaited, or when handed to Scheduler::Spawn. The frame is
+ * freed with the Task, or when a spawned one finishes.
+ */
+template <typename T = void> class Task {
+public:
+    using promise_type = TaskPromise<T>;
+    using Handle = std::coroutine_handle<promise_type>;
+
+private:
+    Handle handle;
+
+public:
+    explicit Task(Handle _handle) : handle(_handle) {}
+    Task(Task&& other) : handle(std::exchange(other.handle, nullptr)) {}
+    Task(const Task&) = delete;
+    Task& operator=(const Task&) = delete;
+    ~Task() {
+        if (handle)
+            handle.destroy();
+    }
+
+    bool await_ready() { return false; }
+
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> caller) {
+        handle.promise().continuation = caller;
+        return handle;
+    }
+
+    T await_resume() { return handle.promise().Take(); }
+
+    /**
+     * Give up the frame, see Scheduler::Spawn
+     */
+    Handle Release() { return std::exchange(handle, nullptr); }
+};
+
+template <typename T> Task<T> TaskPromise<T>::get_return_object() {
+    return Task<T>(Task<T>::Handle::from_promise(*this));
+}
+
+inline Task<void> TaskPromise<void>::get_return_object() {
+    return Task<void>(Task<void>::Handle::from_promise(*this));
+}
+
+/**
+ * Work for a blocking worker, linked in from an awaiter's frame
+ */
+struct Job {
+    Job* next = NULL;
+    void (*execute)(Job* job) = NULL;
+    std::coroutine_handle<> handle = NULL;
+};
+
+/**
+ * Resumes coroutines on the thread calling Run
+ * Call Run from the event loop, next to libusb_handle_events or a
+ * controller's Update. Transfer callbacks post to it instead of resuming
+ * inline, so a coroutine never runs with a library lock held. Blocking
+ * calls, like a driver's setup control transfers, go to a few worker
+ * threads rather than one per device.
+ */
+class Scheduler {
+    std::mutex mutex;
+    std::vector<std::coroutine_handle<>> ready, running;
+    std::function<void()> wake = NULL;
+
+    std::mutex jobs_mutex;
+    std::condition_variable jobs_signal;
+    Job* jobs_head = NULL;
+    Job** jobs_tail = &jobs_head;
+    bool stopping = false;
+    std::vector<std::thread> workers;
+
+    void Work() {
+        for (;;) {
+            Job* job;
+            {
+                std::unique_lock<std::mutex> lock(jobs_mutex);
+                jobs_signal.wait(lock,
+                                 [this] { return stopping || jobs_head; });
+                if (jobs_head == NULL)
+                    return;
+                job = jobs_head;
+                jobs_head = job->next;
+                if (jobs_head == NULL)
+                    jobs_tail = &jobs_head;
+            }
+
+            job->execute(job);
+            Post(job->handle);
+            if (wake != NULL)
+                wake();
+        }
+    }
+
+public:
+    /**
+     * @param blocking_workers threads for Blocking, started right away
+     */
+    explicit Scheduler(size_t blocking_workers = 2) {
+        ready.reserve(64);
+        running.reserve(64);
+        for (size_t i = 0; i < blocking_workers; i++)
+            workers.emplace_back([this] { Work(); });
+    }
+
+    Scheduler(const Scheduler&) = delete;
+    Scheduler& operator=(const Scheduler&) = delete;
+
+    ~Scheduler() {
+        {
+            std::lock_guard<std::mutex> lock(jobs_mutex);
+            stopping = true;
+        }
+        jobs_signal.notify_all();
+        for (std::thread& worker : workers)
+            worker.join();
+    }
+
+    /**
+     * Called when a worker finishes a job, to cut the event loop's wait
+     * short, e.g. [] { libusb_interrupt_event_handler(NULL); }
+     */
+    void SetWake(std::function<void()> _wake) { wake = _wake; }
+
+    /**
+     * Resume handle on the next Run, from any thread
+     */
+    void Post(std::coroutine_handle<> handle) {
+        std::lock_guard<std::mutex> lock(mutex);
+        ready.push_back(handle);
+    }
+
+    /**
+     * Resume everything posted so far
+     * @return coroutines resumed
+     */
+    size_t Run() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            running.swap(ready);
+        }
+        size_t count = running.size();
+        for (std::coroutine_handle<> handle : running)
+            handle.resume();
+        running.clear();
+        return count;
+    }
+
+    /**
+     * Start task on the next Run without waiting for it
+     */
+    template <typename T> void Spawn(Task<T>&& task) {
+        typename Task<T>::Handle handle = task.Release();
+        handle.promise().detached = true;
+        Post(handle);
+    }
+
+    void Queue(Job* job) {
+        {
+            std::lock_guard<std::mutex> lock(jobs_mutex);
+            job->next = NULL;
+            *jobs_tail = job;
+            jobs_tail = &job->next;
+        }
+        jobs_signal.notify_one();
+    }
+
+    template <typename F> class BlockingAwaiter : Job {
+        using R = std::invoke_result_t<F&>;
+        static_assert(!std::is_void<R>::value,
+                      "Blocking calls have to return something");
+
+        Scheduler* scheduler;
+        F function;
+        R result{};
+
+        static void Execute(Job* job) {
+            BlockingAwaiter* self = static_cast<BlockingAwaiter*>(job);
+            self->result = self->function();
+        }
+
+    public:
+        BlockingAwaiter(Scheduler* _scheduler, F&& _function)
+            : scheduler(_scheduler), function(std::move(_function)) {
+            execute = Execute;
+        }
+
+        bool await_ready() { return false; }
+        void await_suspend(std::coroutine_handle<> _handle) {
+            handle = _handle;
+            scheduler->Queue(this);
+        }
+        R await_resume() { return std::move(result); }
+    };
+
+    /**
+     * Run function on a worker, resume on Run with its result
+     */
+    template <typename F> BlockingAwaiter<F> Blocking(F function) {
+        return BlockingAwaiter<F>(this, std::move(function));
+    }
+};
+
+/**
+ * Coroutines waiting for a condition, resumed through their Scheduler
+ * Waiters link themselves in from their own frames, nothing is
+ * allocated. The condition is checked under the signal's lock, so a
+ * Notify after the state changed is never missed.
+ */
+class Signal {
+public:
+    class Awaiter {
+        friend class Signal;
+        Signal* signal;
+        Scheduler* scheduler;
+        bool (*condition)(const void* context);
+        const void* context;
+        Awaiter* next = NULL;
+        std::coroutine_handle<> handle = NULL;
+
+    public:
+        Awaiter(Signal* _signal, Scheduler* _scheduler,
+                bool (*_condition)(const void*), const void* _context)
+            : signal(_signal), scheduler(_scheduler), condition(_condition),
+              context(_context) {}
+
+        bool await_ready() { return false; }
+
+        bool await_suspend(std::coroutine_handle<> _handle) {
+            std::lock_guard<std::mutex> lock(signal->mutex);
+            if (condition(context))
+                return false;
+            handle = _handle;
+            next = signal->waiters;
+            signal->waiters = this;
+            return true;
+        }
+
+        void await_resume() {}
+    };
+
+private:
+    std::mutex mutex;
+    Awaiter* waiters = NULL;
+
+public:
+    /**
+     * Wait until condition(context) holds, checked now and on Notify
+     */
+    Awaiter Wait(Scheduler& scheduler, bool (*condition)(const void*),
+                 const void* context) {
+        return Awaiter(this, &scheduler, condition, context);
+    }
+
+    /**
+     * Post every waiter whose condition now holds
+     */
+    void Notify() {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (Awaiter** link = &waiters; *link != NULL;) {
+            Awaiter* waiter = *link;
+            if (!waiter->condition(waiter->context)) {
+                link = &waiter->next;
+                continue;
+            }
+            *link = waiter->next;
+            waiter->scheduler->Post(waiter->handle);
+        }
+    }
+};
+
+/**
+ * Device operations, run on a blocking worker
+ * Drivers set devices up with synchronous control transfers; this keeps
+ * them off the event loop without a thread per device.
+ */
+inline auto Configure(Scheduler& scheduler, BaseDevice& device) {
+    return scheduler.Blocking([&device] { return device.TryConfigure(); });
+}
+
+inline auto Reinitialize(Scheduler& scheduler, BaseDevice& device) {
+    return scheduler.Blocking([&device] { return device.TryReinitialize(); });
+}
+
+inline auto SetBreak(Scheduler& scheduler, BaseDevice& device, bool value) {
+    return scheduler.Blocking(
+        [&device, value] { return device.TrySetBreak(value); });
+}
+
+} // namespace coro
+} // namespace uss
+#endif
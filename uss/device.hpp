@@ -17,43 +17,88 @@
 #include "driver.hpp"
 #include "error.hpp"
 #include "serial.hpp"
-#include <cstring>
 #include <libusb-1.0/libusb.h>
+#include <algorithm>
+#include <memory>
+#include <type_traits>
+#include <vector>
 
 namespace uss {
 
 class BaseDevice {
 public:
+    virtual ~BaseDevice() {}
+
     BaudRate baud_rate = 9600;
     DataBits data_bits = DataBits::DataBits_8;
     Parity parity = Parity::Parity_None;
     StopBits stop_bits = StopBits::StopBits_1;
     bool rts = true, dtr = true;
 
-    void Configure() {
+    error::Result TryConfigure() {
         if (driver == NULL)
-            throw error::NoDriverException();
-        driver->HandleDeviceConfigure(*this);
+            return NoDriver();
+        return driver->TryHandleDeviceConfigure(*this);
+    }
+    void Configure() { error::Raise(TryConfigure()); }
+
+    /**
+     * Time one character takes on the line at the current settings, ns
+     */
+    uint64_t GetCharacterTime() const {
+        return CharacterTime(baud_rate, data_bits, parity, stop_bits);
     }
 
-    void Reinitialize() { SetDriver(driver); }
+    /**
+     * Bring the device back up with its driver, then each of its ports
+     * A device that only carries ports (see ctl::Port) needs no driver.
+     */
+    error::Result TryReinitialize() {
+        if (driver != NULL || ports.empty())
+            USS_TRY(TrySetDriver(driver));
+        for (BaseDevice* port : ports)
+            USS_TRY(port->TryReinitialize());
+        return error::Result::Ok();
+    }
+    void Reinitialize() { error::Raise(TryReinitialize()); }
 
-    void SetDriver(BaseDriver* new_driver) {
+    error::Result TrySetDriver(const BaseDriver* new_driver) {
         if (new_driver == NULL)
-            throw error::NoDriverException();
-        ResetDriverSpecificData();
+            return NoDriver();
+        driver_context.reset(new_driver->CreateContext());
         driver = new_driver;
         if (!Ready())
-            return;
-        driver->SetUpDevice(*this);
-        driver->HandleDeviceInit(*this);
+            return error::Result::Ok();
+        USS_TRY(driver->TrySetUpDevice(*this));
+        return driver->TryHandleDeviceInit(*this);
+    }
+    void SetDriver(const BaseDriver* new_driver) {
+        error::Raise(TrySetDriver(new_driver));
+    }
+    const BaseDriver* GetDriver() { return driver; }
+
+    /**
+     * Which serial port of the USB device this is, drivers for multi-port
+     * devices set up that port's interfaces and endpoints
+     */
+    virtual uint8_t GetPortIndex() { return 0; }
+
+    /**
+     * Ports sharing this device's handle, re-initialized along with it
+     */
+    void AddPort(BaseDevice* port) { ports.push_back(port); }
+    void RemovePort(BaseDevice* port) {
+        ports.erase(std::remove(ports.begin(), ports.end(), port),
+                    ports.end());
     }
-    BaseDriver* GetDriver() { return driver; }
 
-    template <typename T> T& GetDriverSpecificData() {
-        static_assert(sizeof(T) <= sizeof(_driver_specific_data),
-                      "Type too big for GetDriverSpecificData");
-        return *(T*)_driver_specific_data;
+    /**
+     * State of the current driver for this device
+     */
+    template <typename T> T& GetDriverContext() {
+        static_assert(std::is_base_of<DriverContext, T>::value,
+                      "Driver context types derive from DriverContext");
+        return *static_cast<T*>(driver_context.get());
     }
 
     virtual libusb_device_handle* GetUsbHandle() = 0;
@@ -61,42 +106,103 @@ public:
 
     uint8_t GetInEndpoint() {
         if (driver == NULL)
-            throw error::NoDriverException();
+            error::Raise(NoDriver());
         return driver->GetDeviceInEndpoint(*this);
     }
     uint8_t GetOutEndpoint() {
         if (driver == NULL)
-            throw error::NoDriverException();
+            error::Raise(NoDriver());
         return driver->GetDeviceOutEndpoint(*this);
     }
     uint16_t GetInEndpointPacketSize() {
         if (driver == NULL)
-            throw error::NoDriverException();
+            error::Raise(NoDriver());
         return driver->GetDeviceInEndpointPacketSize(*this);
     }
     uint16_t GetOutEndpointPacketSize() {
         if (driver == NULL)
-            throw error::NoDriverException();
+            error::Raise(NoDriver());
         return driver->GetDeviceOutEndpointPacketSize(*this);
     }
 
-    void SetBreak(bool value) {
+    error::Result TrySetBreak(bool value) {
         if (driver == NULL)
-            throw error::NoDriverException();
-        return driver->SetDeviceBreak(*this, value);
+            return NoDriver();
+        return driver->TrySetDeviceBreak(*this, value);
+    }
+    void SetBreak(bool value) {
+        error::Raise(TrySetBreak(value));
     }
 
-    bool Ready() { return (GetUsbHandle() != NULL); }
+    virtual bool Ready() { return (GetUsbHandle() != NULL); }
 
-protected:
-    BaseDriver* driver = NULL;
+    /**
+     * USB transport
+     * Drivers and outputs go through these instead of calling libusb on the
+     * handle directly, so a software device can stand in for real hardware.
+     */
+    virtual int SubmitTransfer(libusb_transfer* transfer) {
+        return libusb_submit_transfer(transfer);
+    }
+
+    virtual int CancelTransfer(libusb_transfer* transfer) {
+        return libusb_cancel_transfer(transfer);
+    }
 
-    void ResetDriverSpecificData() {
-        memset(_driver_specific_data, 0, sizeof(_driver_specific_data));
+    virtual int ControlTransfer(uint8_t request_type, uint8_t request,
+                                uint16_t value, uint16_t index, uint8_t* data,
+                                uint16_t length, uint32_t timeout) {
+        return libusb_control_transfer(GetUsbHandle(), request_type, request,
+                                       value, index, data, length, timeout);
     }
 
-private:
-    char _driver_specific_data[32];
+    virtual int GetDeviceDescriptor(libusb_device_descriptor* descriptor) {
+        return libusb_get_device_descriptor(GetUsbDevice(), descriptor);
+    }
+
+    virtual int GetConfigDescriptor(uint8_t index,
+                                    libusb_config_descriptor** config) {
+        return libusb_get_config_descriptor(GetUsbDevice(), index, config);
+    }
+
+    virtual void FreeConfigDescriptor(libusb_config_descriptor* config) {
+        libusb_free_config_descriptor(config);
+    }
+
+    /**
+     * Detach the kernel driver from an interface if one is active
+     */
+    virtual int DetachKernelDriver(int interface) {
+        if (!libusb_kernel_driver_active(GetUsbHandle(), interface))
+            return 0;
+        return libusb_detach_kernel_driver(GetUsbHandle(), interface);
+    }
+
+    virtual int ClaimInterface(int interface) {
+        return libusb_claim_interface(GetUsbHandle(), interface);
+    }
+
+    /**
+     * Clear a halted (stalled) endpoint, resetting its data toggle
+     */
+    virtual int ClearHalt(uint8_t endpoint) {
+        return libusb_clear_halt(GetUsbHandle(), endpoint);
+    }
+
+    /**
+     * Port reset, the device keeps its handle unless it re-enumerates
+     */
+    virtual int ResetDevice() { return libusb_reset_device(GetUsbHandle()); }
+
+protected:
+    const BaseDriver* driver = NULL;
+    std::unique_ptr<DriverContext> driver_context;
+    std::vector<BaseDevice*> ports;
+
+    static error::Result NoDriver() {
+        return error::Result::Fail(error::Code::NoDriver,
+                                   "Device has no driver");
+    }
 };
 
 } // namespace uss
\ No newline at end of file
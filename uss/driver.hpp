@@ -14,25 +14,89 @@
  * - 2022
  */
 #pragma once
+#include "error.hpp"
 #include <stdint.h>
 
 namespace uss {
 
 class BaseDevice;
+
+/**
+ * Per device driver state, created by the driver for every device it is
+ * set on. Drivers keep no device state themselves, so one instance of a
+ * driver can serve any number of devices.
+ */
+class DriverContext {
+public:
+    virtual ~DriverContext() {}
+};
+
+/**
+ * Control request with no data stage
+ */
+struct ControlRequest {
+    uint8_t request_type = 0;
+    uint8_t request = 0;
+    uint16_t value = 0;
+    uint16_t index = 0;
+};
+
 class BaseDriver {
 public:
     virtual ~BaseDriver() {}
 
-    virtual void HandleDeviceInit(BaseDevice& device) = 0;
-    virtual void HandleDeviceConfigure(BaseDevice& device) = 0;
-    virtual void HandleDeviceUpdateLines(BaseDevice& device) = 0;
-    virtual void SetDeviceBreak(BaseDevice& device, bool value) = 0;
-    virtual void SetUpDevice(BaseDevice& device) = 0;
+    virtual DriverContext* CreateContext() const = 0;
+
+    /**
+     * Drivers report failure through error::Result so they work with
+     * exceptions disabled, the wrappers below throw instead
+     */
+    virtual error::Result TryHandleDeviceInit(BaseDevice& device) const = 0;
+    virtual error::Result
+    TryHandleDeviceConfigure(BaseDevice& device) const = 0;
+    virtual error::Result
+    TryHandleDeviceUpdateLines(BaseDevice& device) const = 0;
+    virtual error::Result TrySetDeviceBreak(BaseDevice& device,
+                                            bool value) const = 0;
+    virtual error::Result TrySetUpDevice(BaseDevice& device) const = 0;
+
+    void HandleDeviceInit(BaseDevice& device) const {
+        error::Raise(TryHandleDeviceInit(device));
+    }
+    void HandleDeviceConfigure(BaseDevice& device) const {
+        error::Raise(TryHandleDeviceConfigure(device));
+    }
+    void HandleDeviceUpdateLines(BaseDevice& device) const {
+        error::Raise(TryHandleDeviceUpdateLines(device));
+    }
+    void SetDeviceBreak(BaseDevice& device, bool value) const {
+        error::Raise(TrySetDeviceBreak(device, value));
+    }
+    void SetUpDevice(BaseDevice& device) const {
+        error::Raise(TrySetUpDevice(device));
+    }
+
+    /**
+     * The request TryHandleDeviceUpdateLines sends for the device's current
+     * rts and dtr, for submitting without blocking (see rs485.hpp)
+     * @return false if the driver can't set the lines in one request
+     */
+    virtual bool GetDeviceLinesRequest(BaseDevice& device,
+                                       ControlRequest& request) const {
+        return false;
+    }
+
+    /**
+     * Serial ports the driver can drive on the device, see ctl::Port
+     */
+    virtual uint8_t CountDevicePorts(BaseDevice& device) const { return 1; }
 
-    virtual uint8_t GetDeviceInEndpoint(BaseDevice& device) = 0;
-    virtual uint8_t GetDeviceOutEndpoint(BaseDevice& device) = 0;
-    virtual uint16_t GetDeviceInEndpointPacketSize(BaseDevice& device) = 0;
-    virtual uint16_t GetDeviceOutEndpointPacketSize(BaseDevice& device) = 0;
+    virtual uint8_t GetDeviceInEndpoint(BaseDevice& device) const = 0;
+    virtual uint8_t GetDeviceOutEndpoint(BaseDevice& device) const = 0;
+    virtual uint16_t
+    GetDeviceInEndpointPacketSize(BaseDevice& device) const = 0;
+    virtual uint16_t
+    GetDeviceOutEndpointPacketSize(BaseDevice& device) const = 0;
 };
 
 } // namespace uss
\ No newline at end of file
@@ -17,6 +17,7 @@
 #include "../../device.hpp"
 #include "../../driver.hpp"
 #include "../../error.hpp"
+#include "../../log.hpp"
 #include "data.hpp"
 #include <cstdio>
 
@@ -32,24 +33,101 @@ class CdcAcmDriver : public BaseDriver {
 
     int SendDeviceControlMessage(BaseDevice& device, uint8_t request,
                                  uint16_t value, uint8_t* data = 0x0,
-                                 uint16_t length = 0) {
-        return libusb_control_transfer(
-            device.GetUsbHandle(), usbvars::UsbRtAcm, request, value,
-            device.GetDriverSpecificData<CdcAcmDeviceData>().comm_interface,
-            data, length, ControlTransferTimeout);
+                                 uint16_t length = 0) const {
+        return device.ControlTransfer(
+            usbvars::UsbRtAcm, request, value,
+            device.GetDriverContext<CdcAcmDeviceData>().comm_interface, data,
+            length, ControlTransferTimeout);
     };
 
+    /**
+     * Comm interface of the index'th ACM function, NULL if there's none
+     */
+    static const libusb_interface_descriptor*
+    FindCommInterface(const libusb_config_descriptor* config, uint8_t index) {
+        for (int ii = 0; ii < config->bNumInterfaces; ii++) {
+            const libusb_interface_descriptor* descriptor =
+                config->interface[ii].altsetting;
+            if (descriptor == NULL ||
+                descriptor->bInterfaceClass != usbvars::UsbClassComm ||
+                descriptor->bInterfaceSubClass != usbvars::UsbSubclassAcm)
+                continue;
+            if (index-- == 0)
+                return descriptor;
+        }
+        return NULL;
+    }
+
+    static const libusb_interface_descriptor*
+    FindInterface(const libusb_config_descriptor* config, uint8_t number) {
+        for (int ii = 0; ii < config->bNumInterfaces; ii++) {
+            const libusb_interface_descriptor* descriptor =
+                config->interface[ii].altsetting;
+            if (descriptor != NULL && descriptor->bInterfaceNumber == number)
+                return descriptor;
+        }
+        return NULL;
+    }
+
+    /**
+     * Data interface of an ACM function, from its CDC union descriptor or
+     * else the interface after it
+     */
+    static uint8_t DataInterfaceFor(const libusb_interface_descriptor* comm) {
+        const unsigned char* extra = comm->extra;
+        int left = comm->extra_length;
+        while (extra != NULL && left >= 2 && extra[0] >= 2 &&
+               extra[0] <= left) {
+            if (extra[0] >= 5 && extra[1] == usbvars::UsbDtCsInterface &&
+                extra[2] == usbvars::UsbCdcUnionType)
+                return extra[4]; // bSubordinateInterface0
+            left -= extra[0];
+            extra += extra[0];
+        }
+        return comm->bInterfaceNumber + 1;
+    }
+
 public:
-    void HandleDeviceConfigure(BaseDevice& device) override {
+    DriverContext* CreateContext() const override {
+        return new CdcAcmDeviceData();
+    }
+
+    /**
+     * One port per ACM function, composite gadgets can have several
+     * Searches every configuration like TrySetUpDevice, so the count is the
+     * most functions any one of them has.
+     */
+    uint8_t CountDevicePorts(BaseDevice& device) const override {
+        libusb_device_descriptor device_descriptor;
+        if (device.GetDeviceDescriptor(&device_descriptor) < 0)
+            return 0;
+
+        uint8_t count = 0;
+        for (uint8_t ic = 0; ic < device_descriptor.bNumConfigurations; ic++) {
+            libusb_config_descriptor* config_descriptor;
+            if (device.GetConfigDescriptor(ic, &config_descriptor) < 0)
+                continue;
+
+            uint8_t functions = 0;
+            while (FindCommInterface(config_descriptor, functions) != NULL)
+                functions++;
+            device.FreeConfigDescriptor(config_descriptor);
+            if (functions > count)
+                count = functions;
+        }
+        return count;
+    }
+
+    error::Result TryHandleDeviceConfigure(BaseDevice& device) const override {
         if ((uint32_t)device.data_bits >= sizeof(DataBitsConverter))
-            throw error::InvalidDeviceConfigException("data_bits",
-                                                      (int)device.data_bits);
+            return error::Result::Fail(error::Code::InvalidDeviceConfig,
+                                       "data_bits", (int)device.data_bits);
         if ((uint32_t)device.stop_bits >= sizeof(StopBitsConverter))
-            throw error::InvalidDeviceConfigException("stop_bits",
-                                                      (int)device.stop_bits);
+            return error::Result::Fail(error::Code::InvalidDeviceConfig,
+                                       "stop_bits", (int)device.stop_bits);
         if ((uint32_t)device.parity >= sizeof(ParityConverter))
-            throw error::InvalidDeviceConfigException("parity",
-                                                      (int)device.parity);
+            return error::Result::Fail(error::Code::InvalidDeviceConfig,
+                                       "parity", (int)device.parity);
 
         // Create control message
         uint8_t message[7];
@@ -59,180 +137,205 @@ public:
         message[6] = DataBitsConverter[(int)device.data_bits];
 
         // Send to device
-        SendDeviceControlMessage(device, ctl::SetLineCoding, 0, message, 7);
+        int ret =
+            SendDeviceControlMessage(device, ctl::SetLineCoding, 0, message, 7);
+        if (ret < 0)
+            return error::Result::Fail(error::Code::DevicePrep,
+                                       "Failed to set cdcacm line coding", ret);
+
+        return error::Result::Ok();
+    }
+
+    error::Result
+    TryHandleDeviceUpdateLines(BaseDevice& device) const override {
+        ControlRequest request;
+        GetDeviceLinesRequest(device, request);
+        int ret =
+            SendDeviceControlMessage(device, request.request, request.value);
+        if (ret < 0)
+            return error::Result::Fail(error::Code::DevicePrep,
+                                       "Failed to set cdcacm DTR / RTS", ret);
+
+        return error::Result::Ok();
     }
 
-    void HandleDeviceUpdateLines(BaseDevice& device) override {
+    bool GetDeviceLinesRequest(BaseDevice& device,
+                               ControlRequest& request) const override {
         // Create control message
         uint8_t message = (device.rts ? 0x02 : 0) | (device.dtr ? 0x01 : 0);
-        SendDeviceControlMessage(device, ctl::SetControlLineState, message);
+        request.request_type = usbvars::UsbRtAcm;
+        request.request = ctl::SetControlLineState;
+        request.value = message;
+        request.index =
+            device.GetDriverContext<CdcAcmDeviceData>().comm_interface;
+        return true;
     }
 
-    void HandleDeviceInit(BaseDevice& device) override {
+    error::Result TryHandleDeviceInit(BaseDevice& device) const override {
         // rts & dtr required for cdcacm
         device.rts = true;
         device.dtr = true;
-        HandleDeviceUpdateLines(device);
-        HandleDeviceConfigure(device);
+        USS_TRY(TryHandleDeviceUpdateLines(device));
+        return TryHandleDeviceConfigure(device);
     }
 
-    void SetUpDevice(BaseDevice& device) override {
+    error::Result TrySetUpDevice(BaseDevice& device) const override {
         int ret;
         libusb_device_descriptor device_descriptor;
         libusb_config_descriptor* config_descriptor;
         const libusb_endpoint_descriptor* endpoint_descriptor;
         const libusb_interface_descriptor* interface_descriptor;
-        const libusb_interface* interface;
         CdcAcmDeviceData& device_data =
-            device.GetDriverSpecificData<CdcAcmDeviceData>();
+            device.GetDriverContext<CdcAcmDeviceData>();
 
         // Get device descriptor
-        ret = libusb_get_device_descriptor(device.GetUsbDevice(),
-                                           &device_descriptor);
+        ret = device.GetDeviceDescriptor(&device_descriptor);
         if (ret < 0)
-            throw error::DevicePopulateException(
-                "Couldn't get device descriptor.");
+            return error::Result::Fail(error::Code::DevicePopulate,
+                                       "Couldn't get device descriptor.", ret);
 
-        // For each configuration.. (with the amount of them found in the device
-        // descriptor)
+        // Find the port's ACM function in the first configuration that has
+        // it
+        bool found = false;
         for (uint8_t ic = 0; ic < device_descriptor.bNumConfigurations; ic++) {
             // Get the configuration descriptor
-            libusb_get_config_descriptor(device.GetUsbDevice(), ic,
-                                         &config_descriptor);
-
-            // For each interface.. (with the amount of them found in the
-            // configuration descriptor)
-            for (int ii = 0; ii < config_descriptor->bNumInterfaces; ii++) {
-                interface = config_descriptor->interface + ii;
-
-                if (!interface->altsetting)
-                    continue;
-
-                interface_descriptor = interface->altsetting;
+            if (device.GetConfigDescriptor(ic, &config_descriptor) < 0)
+                continue;
+
+            const libusb_interface_descriptor* comm_descriptor =
+                FindCommInterface(config_descriptor, device.GetPortIndex());
+            if (comm_descriptor != NULL)
+                interface_descriptor = FindInterface(
+                    config_descriptor, DataInterfaceFor(comm_descriptor));
+            else
+                interface_descriptor = NULL;
+
+            if (interface_descriptor != NULL &&
+                interface_descriptor->bInterfaceClass ==
+                    usbvars::UsbClassCdcData) {
+                found = true;
 
                 // Set device interface numbers
-                switch (interface_descriptor->bInterfaceClass) {
-                case usbvars::UsbClassComm:
-                    device_data.comm_interface =
-                        interface_descriptor->bInterfaceNumber;
-
-                    break;
-                case usbvars::UsbClassCdcData:
-                    device_data.data_interface =
-                        interface_descriptor->bInterfaceNumber;
-
-                    // For each endpoint.. (with the amount of them found in the
-                    // interface descriptor)
-                    for (int ie = 0; ie < interface_descriptor->bNumEndpoints;
-                         ie++) {
-                        endpoint_descriptor =
-                            interface_descriptor->endpoint + ie;
-                        if (driver::usbvars::UsbDirIn ==
-                            (endpoint_descriptor->bEndpointAddress &
-                             driver::usbvars::UsbDirIn)) {
-                            // Set IN endpoint
-                            device_data.in_endpoint =
-                                endpoint_descriptor->bEndpointAddress;
-                            device_data.in_endpoint_packet_size =
-                                endpoint_descriptor->wMaxPacketSize;
-                        } else {
-                            // Set OUT endpoint
-                            device_data.out_endpoint =
-                                endpoint_descriptor->bEndpointAddress;
-                            device_data.out_endpoint_packet_size =
-                                endpoint_descriptor->wMaxPacketSize;
-                        }
+                device_data.comm_interface = comm_descriptor->bInterfaceNumber;
+                device_data.data_interface =
+                    interface_descriptor->bInterfaceNumber;
+
+                // For each endpoint.. (with the amount of them found in the
+                // interface descriptor)
+                for (int ie = 0; ie < interface_descriptor->bNumEndpoints;
+                     ie++) {
+                    endpoint_descriptor = interface_descriptor->endpoint + ie;
+                    if (driver::usbvars::UsbDirIn ==
+                        (endpoint_descriptor->bEndpointAddress &
+                         driver::usbvars::UsbDirIn)) {
+                        // Set IN endpoint
+                        device_data.in_endpoint =
+                            endpoint_descriptor->bEndpointAddress;
+                        device_data.in_endpoint_packet_size =
+                            endpoint_descriptor->wMaxPacketSize;
+                    } else {
+                        // Set OUT endpoint
+                        device_data.out_endpoint =
+                            endpoint_descriptor->bEndpointAddress;
+                        device_data.out_endpoint_packet_size =
+                            endpoint_descriptor->wMaxPacketSize;
                     }
-
-                    break;
                 }
             }
 
             // Free configuration descriptor
-            libusb_free_config_descriptor(config_descriptor);
+            device.FreeConfigDescriptor(config_descriptor);
+            if (found)
+                break;
         }
 
-        printf("comm:%i, data:%i, in:%i, out:%i\n", device_data.comm_interface,
-               device_data.data_interface, device_data.in_endpoint,
-               device_data.out_endpoint);
+        USS_LOG_DEBUG("comm:%i, data:%i, in:%i, out:%i\n",
+                      device_data.comm_interface, device_data.data_interface,
+                      device_data.in_endpoint, device_data.out_endpoint);
 
-        if (device_data.comm_interface == 0 && device_data.data_interface == 0)
-            throw error::DevicePopulateException(
-                "Couldn't populate interfaces.");
+        if (!found)
+            return error::Result::Fail(error::Code::DevicePopulate,
+                                       "Couldn't populate interfaces.",
+                                       device.GetPortIndex());
 
         if (device_data.in_endpoint == 0 && device_data.out_endpoint == 0)
-            throw error::DevicePopulateException(
-                "Couldn't populate endpoints.");
+            return error::Result::Fail(error::Code::DevicePopulate,
+                                       "Couldn't populate endpoints.");
 
         // Detach interfaces
-        if (libusb_kernel_driver_active(device.GetUsbHandle(),
-                                        device_data.comm_interface)) {
-            ret = libusb_detach_kernel_driver(device.GetUsbHandle(),
-                                              device_data.comm_interface);
-            if (ret < 0) {
-                printf("Failed to detach kernel driver from CDC Communication "
-                       "interface, code %i (%s)\n",
-                       ret, libusb_error_name(ret));
-                throw error::UsbAccessException(
-                    "Failed to detach kernel driver from CDC Communication "
-                    "interface");
-            }
+        ret = device.DetachKernelDriver(device_data.comm_interface);
+        if (ret < 0) {
+            USS_LOG_ERROR(
+                "Failed to detach kernel driver from CDC Communication "
+                "interface, code %i (%s)\n",
+                ret, libusb_error_name(ret));
+            return error::Result::Fail(
+                error::Code::UsbAccess,
+                "Failed to detach kernel driver from CDC Communication "
+                "interface",
+                ret);
         }
 
-        if (libusb_kernel_driver_active(device.GetUsbHandle(),
-                                        device_data.data_interface)) {
-            ret = libusb_detach_kernel_driver(device.GetUsbHandle(),
-                                              device_data.data_interface);
-            if (ret < 0) {
-                printf("Failed to detach kernel driver from CDC Data "
-                       "interface, code %i (%s)\n",
-                       ret, libusb_error_name(ret));
-                throw error::UsbAccessException(
-                    "Failed to detach kernel driver from CDC Data interface");
-            }
+        ret = device.DetachKernelDriver(device_data.data_interface);
+        if (ret < 0) {
+            USS_LOG_ERROR("Failed to detach kernel driver from CDC Data "
+                          "interface, code %i (%s)\n",
+                          ret, libusb_error_name(ret));
+            return error::Result::Fail(
+                error::Code::UsbAccess,
+                "Failed to detach kernel driver from CDC Data interface", ret);
         }
 
         // Claim interfaces
-        ret = libusb_claim_interface(device.GetUsbHandle(),
-                                     device_data.comm_interface);
+        ret = device.ClaimInterface(device_data.comm_interface);
         if (ret < 0) {
-            printf(
+            USS_LOG_ERROR(
                 "Failed to claim CDC Communication interface, code %i (%s)\n",
                 ret, libusb_error_name(ret));
-            throw error::UsbAccessException(
-                "Failed to claim CDC Communication interface");
+            return error::Result::Fail(
+                error::Code::UsbAccess,
+                "Failed to claim CDC Communication interface", ret);
         }
 
-        ret = libusb_claim_interface(device.GetUsbHandle(),
-                                     device_data.data_interface);
+        ret = device.ClaimInterface(device_data.data_interface);
         if (ret < 0) {
-            printf("Failed to claim CDC Data interface, code %i (%s)\n", ret,
-                   libusb_error_name(ret));
-            throw error::UsbAccessException(
-                "Failed to claim CDC Data interface");
+            USS_LOG_ERROR("Failed to claim CDC Data interface, code %i (%s)\n",
+                          ret, libusb_error_name(ret));
+            return error::Result::Fail(error::Code::UsbAccess,
+                                       "Failed to claim CDC Data interface",
+                                       ret);
         }
+
+        return error::Result::Ok();
     }
 
-    uint8_t GetDeviceInEndpoint(BaseDevice& device) override {
-        return device.GetDriverSpecificData<CdcAcmDeviceData>().in_endpoint;
+    uint8_t GetDeviceInEndpoint(BaseDevice& device) const override {
+        return device.GetDriverContext<CdcAcmDeviceData>().in_endpoint;
     }
 
-    uint8_t GetDeviceOutEndpoint(BaseDevice& device) override {
-        return device.GetDriverSpecificData<CdcAcmDeviceData>().out_endpoint;
+    uint8_t GetDeviceOutEndpoint(BaseDevice& device) const override {
+        return device.GetDriverContext<CdcAcmDeviceData>().out_endpoint;
     }
 
-    uint16_t GetDeviceInEndpointPacketSize(BaseDevice& device) override {
-        return device.GetDriverSpecificData<CdcAcmDeviceData>()
+    uint16_t GetDeviceInEndpointPacketSize(BaseDevice& device) const override {
+        return device.GetDriverContext<CdcAcmDeviceData>()
             .in_endpoint_packet_size;
     }
 
-    uint16_t GetDeviceOutEndpointPacketSize(BaseDevice& device) override {
-        return device.GetDriverSpecificData<CdcAcmDeviceData>()
+    uint16_t GetDeviceOutEndpointPacketSize(BaseDevice& device) const override {
+        return device.GetDriverContext<CdcAcmDeviceData>()
             .out_endpoint_packet_size;
     }
 
-    void SetDeviceBreak(BaseDevice& device, bool value) override {
-        SendDeviceControlMessage(device, ctl::SetBreak, value ? 0xffff : 0);
+    error::Result TrySetDeviceBreak(BaseDevice& device,
+                                    bool value) const override {
+        int ret = SendDeviceControlMessage(device, ctl::SetBreak,
+                                           value ? 0xffff : 0);
+        if (ret < 0)
+            return error::Result::Fail(error::Code::DevicePrep,
+                                       "Failed to set cdcacm break", ret);
+
+        return error::Result::Ok();
     }
 };
 
@@ -14,6 +14,7 @@
  * - 2022
  */
 #pragma once
+#include "../../driver.hpp"
 #include "../../usbvars.hpp"
 #include <stdint.h>
 
@@ -21,10 +22,10 @@ namespace uss {
 namespace driver {
 namespace cdcacm {
 
-struct CdcAcmDeviceData {
-    uint8_t comm_interface, data_interface;
-    uint8_t in_endpoint, out_endpoint;
-    uint16_t in_endpoint_packet_size, out_endpoint_packet_size;
+struct CdcAcmDeviceData : public DriverContext {
+    uint8_t comm_interface = 0, data_interface = 0;
+    uint8_t in_endpoint = 0, out_endpoint = 0;
+    uint16_t in_endpoint_packet_size = 0, out_endpoint_packet_size = 0;
 };
 
 namespace ctl {
@@ -0,0 +1,105 @@
+/**
+ * usbselfserial by lotuspar (https://github.com/lotuspar)
+ *
+ * Inspired / based on:
+ *     the usb-serial-for-android project made in Java,
+ *         * which is copyright 2011-2013 Google Inc., 2013 Mike Wakerly
+ *         * https://github.com/mik3y/usb-serial-for-android
+ *     the Linux serial port drivers,
+ *         * https://github.com/torvalds/linux/tree/master/drivers/usb/serial
+ *     and the FreeBSD serial port drivers
+ *         * https://github.com/freebsd/freebsd-src/tree/main/sys/dev/usb/serial
+ * Some parts rewritten in C++ for usbselfserial!
+ *     * (by the time you read this it could have a different name!)
+ * - 2022
+ */
+#pragma once
+#include "../../controllers/emulator.hpp"
+#include "data.hpp"
+#include <cstring>
+
+namespace uss {
+namespace driver {
+namespace cdcacm {
+
+/**
+ * CDC ACM function emulator
+ * Answers the PSTN class requests on its comm interface, stores the line
+ * coding the host sets and returns it for GetLineCoding. Line codings a
+ * UART can't run (0 baud, odd framing) are stalled, as most firmware does.
+ */
+class CdcAcmEmulator : public uss::ctl::SerialEmulator {
+    uint8_t line_coding[7];
+
+    /**
+     * Take a 7 byte line coding, false if the UART can't run it
+     */
+    bool ApplyLineCoding(const uint8_t* coding) {
+        uint32_t baud_rate;
+        memcpy(&baud_rate, coding, 4);
+        if (baud_rate == 0 || coding[4] > 2 || coding[5] > 4 ||
+            coding[6] < 5 || coding[6] > 8)
+            return false;
+
+        memcpy(line_coding, coding, sizeof(line_coding));
+        line.baud_rate = baud_rate;
+        line.stop_bits = (StopBits)coding[4];
+        line.parity = (Parity)coding[5];
+        line.data_bits = (DataBits)(coding[6] - 5);
+        return true;
+    }
+
+protected:
+    int ChipControl(uint8_t request_type, uint8_t request, uint16_t value,
+                    uint16_t index, uint8_t* data, uint16_t length) override {
+        // Class requests to the comm interface (0) only
+        if ((request_type & 0x7f) != usbvars::UsbRtAcm || index != 0)
+            return LIBUSB_ERROR_PIPE;
+        bool in = request_type & usbvars::UsbDirIn;
+
+        switch (request) {
+        case ctl::SetLineCoding:
+            if (in || length < sizeof(line_coding) ||
+                !ApplyLineCoding(data))
+                return LIBUSB_ERROR_PIPE;
+            return sizeof(line_coding);
+        case ctl::GetLineCoding:
+            if (!in || length < sizeof(line_coding))
+                return LIBUSB_ERROR_PIPE;
+            memcpy(data, line_coding, sizeof(line_coding));
+            return sizeof(line_coding);
+        case ctl::SetControlLineState:
+            if (in)
+                return LIBUSB_ERROR_PIPE;
+            line.dtr = value & 0x01;
+            line.rts = value & 0x02;
+            return 0;
+        case ctl::SetBreak:
+            // wValue is the break length in ms, 0xffff until cleared
+            if (in)
+                return LIBUSB_ERROR_PIPE;
+            line.break_on = value != 0;
+            break_end = value != 0 && value != 0xffff
+                            ? timing::Now() + (uint64_t)value * 1000000
+                            : 0;
+            return 0;
+        default:
+            return LIBUSB_ERROR_PIPE;
+        }
+    }
+
+public:
+    /**
+     * @param fifo TX FIFO size in bytes
+     */
+    CdcAcmEmulator(uint32_t fifo = 64)
+        : SerialEmulator(uss::ctl::SoftwareLayout::CdcAcm, fifo) {
+        // Until the host sets one, 9600 8N1
+        const uint8_t coding[7] = {0x80, 0x25, 0, 0, 0, 0, 8};
+        ApplyLineCoding(coding);
+    }
+};
+
+} // namespace cdcacm
+} // namespace driver
+} // namespace uss
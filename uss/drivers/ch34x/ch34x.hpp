@@ -17,8 +17,10 @@
 #include "../../device.hpp"
 #include "../../driver.hpp"
 #include "../../error.hpp"
+#include "../../log.hpp"
 #include "data.hpp"
 #include <cstdio>
+#include <cstring>
 
 namespace uss {
 namespace driver {
@@ -32,23 +34,49 @@ class Ch34xDriver : public BaseDriver {
         0, ctl::LcrPaOdd, ctl::LcrPaEven, ctl::LcrPaMark, ctl::LcrPaSpace};
     constexpr static const uint32_t ControlTransferTimeout = 2000;
 
-    uint8_t version = 0x0;
-
     int SendDeviceControlOut(BaseDevice& device, uint8_t request,
-                             uint16_t value, uint16_t index) {
-        return libusb_control_transfer(device.GetUsbHandle(), Ch34xCtlOut,
-                                       request, value, index, NULL, 0,
-                                       ControlTransferTimeout);
+                             uint16_t value, uint16_t index) const {
+        return device.ControlTransfer(Ch34xCtlOut, request, value, index,
+                                      NULL, 0, ControlTransferTimeout);
     };
 
+    /**
+     * The chip's modem outputs are active low, like ch341_set_handshake
+     */
+    static uint16_t ModemMessage(BaseDevice& device) {
+        uint8_t message = 0;
+        if (device.dtr)
+            message |= ctl::ModemDtr;
+        if (device.rts)
+            message |= ctl::ModemRts;
+        return (uint16_t)~message;
+    }
+
+    /**
+     * Write a register (or the modem lines) unless it already holds value
+     */
+    int WriteShadowed(BaseDevice& device, Ch34xShadow& shadow,
+                      uint8_t request, uint16_t reg, uint16_t value) const {
+        if (shadow.valid && shadow.value == value)
+            return 0;
+
+        int ret = request == ctl::ModemWrite
+                      ? SendDeviceControlOut(device, request, value, 0)
+                      : SendDeviceControlOut(device, request, reg, value);
+        shadow.valid = ret >= 0;
+        shadow.value = value;
+        return ret;
+    }
+
     int SendDeviceControlIn(BaseDevice& device, uint8_t request, uint16_t value,
-                            uint16_t index, uint8_t* data, uint16_t length) {
-        return libusb_control_transfer(device.GetUsbHandle(), Ch34xCtlIn,
-                                       request, value, index, data, length,
-                                       ControlTransferTimeout);
+                            uint16_t index, uint8_t* data,
+                            uint16_t length) const {
+        return device.ControlTransfer(Ch34xCtlIn, request, value, index, data,
+                                      length, ControlTransferTimeout);
     };
 
-    void UpdateBaudRate(BaseDevice& device, uint32_t new_baud_rate) {
+    error::Result UpdateBaudRate(BaseDevice& device,
+                                 uint32_t new_baud_rate) const {
         // This is a flawed way to do it
         uint32_t factor;
         uint16_t divisor;
@@ -63,143 +91,199 @@ class Ch34xDriver : public BaseDriver {
         }
 
         if (factor > 0xfff0)
-            throw error::InvalidDeviceConfigException("baud_rate",
-                                                      new_baud_rate);
+            return error::Result::Fail(error::Code::InvalidDeviceConfig,
+                                       "baud_rate", new_baud_rate);
 
         factor = 0x10000 - factor;
 
         divisor |= 0x0080; // or ch341a waits until buffer full
 
-        ret = SendDeviceControlOut(device, ctl::CmdRegWrite, 0x1312,
-                                   (factor & 0xff00) | divisor);
+        Ch34xDeviceData& device_data =
+            device.GetDriverContext<Ch34xDeviceData>();
+        ret = WriteShadowed(device, device_data.baud1, ctl::CmdRegWrite,
+                            0x1312, (factor & 0xff00) | divisor);
         if (ret < 0)
-            throw error::InvalidDeviceConfigException("(1)baud_rate",
-                                                      new_baud_rate);
+            return error::Result::Fail(error::Code::InvalidDeviceConfig,
+                                       "(1)baud_rate", new_baud_rate);
 
-        ret = SendDeviceControlOut(device, ctl::CmdRegWrite, 0x0f2c,
-                                   factor & 0xff);
+        ret = WriteShadowed(device, device_data.baud2, ctl::CmdRegWrite,
+                            0x0f2c, factor & 0xff);
         if (ret < 0)
-            throw error::InvalidDeviceConfigException("(2)baud_rate",
-                                                      new_baud_rate);
+            return error::Result::Fail(error::Code::InvalidDeviceConfig,
+                                       "(2)baud_rate", new_baud_rate);
+
+        return error::Result::Ok();
     }
 
 public:
-    void HandleDeviceConfigure(BaseDevice& device) override {
+    DriverContext* CreateContext() const override {
+        return new Ch34xDeviceData();
+    }
+
+    error::Result TryHandleDeviceConfigure(BaseDevice& device) const override {
         int ret;
         uint16_t lcr = ctl::LcrEnRx | ctl::LcrEnTx;
 
-        UpdateBaudRate(device, device.baud_rate);
+        USS_TRY(UpdateBaudRate(device, device.baud_rate));
 
         if (device.stop_bits == StopBits::StopBits_1_5)
-            throw error::InvalidDeviceConfigException("(1)stop_bits",
-                                                      (int)device.stop_bits);
+            return error::Result::Fail(error::Code::InvalidDeviceConfig,
+                                       "(1)stop_bits", (int)device.stop_bits);
 
         if ((uint32_t)device.data_bits >= sizeof(DataBitsConverter))
-            throw error::InvalidDeviceConfigException("data_bits",
-                                                      (int)device.data_bits);
+            return error::Result::Fail(error::Code::InvalidDeviceConfig,
+                                       "data_bits", (int)device.data_bits);
         if ((uint32_t)device.stop_bits >= sizeof(StopBitsConverter))
-            throw error::InvalidDeviceConfigException("(2)stop_bits",
-                                                      (int)device.stop_bits);
+            return error::Result::Fail(error::Code::InvalidDeviceConfig,
+                                       "(2)stop_bits", (int)device.stop_bits);
         if ((uint32_t)device.parity >= sizeof(ParityConverter))
-            throw error::InvalidDeviceConfigException("parity",
-                                                      (int)device.parity);
+            return error::Result::Fail(error::Code::InvalidDeviceConfig,
+                                       "parity", (int)device.parity);
 
         // Create control message
         lcr |= DataBitsConverter[(int)device.data_bits];
         lcr |= StopBitsConverter[(int)device.stop_bits];
         lcr |= ParityConverter[(int)device.parity];
 
-        ret = SendDeviceControlOut(device, ctl::CmdRegWrite, 0x2518, lcr);
-        if (ret < 0)
-            throw error::DevicePrepException("Failed to set ch34x chip LCR");
-    }
+        Ch34xDeviceData& device_data =
+            device.GetDriverContext<Ch34xDeviceData>();
+        ret = WriteShadowed(device, device_data.lcr, ctl::CmdRegWrite, 0x2518,
+                            lcr);
 
-    void HandleDeviceUpdateLines(BaseDevice& device) override {
-        // Create control message
-        uint8_t message = 0;
+        // Register 0x18 is also the high half of the break register, so
+        // carry what was just written into its shadow
+        if (ret < 0)
+            device_data.break_reg.valid = false;
+        else if (device_data.break_reg.valid)
+            device_data.break_reg.value =
+                (device_data.break_reg.value & 0x00ff) | ((lcr & 0xff) << 8);
+        if (ret < 0)
+            return error::Result::Fail(error::Code::DevicePrep,
+                                       "Failed to set ch34x chip LCR", ret);
 
-        if (device.dtr)
-            message |= ctl::ModemDtr;
-        if (device.rts)
-            message |= ctl::ModemRts;
+        return error::Result::Ok();
+    }
 
-        if (version < 20) {
+    error::Result
+    TryHandleDeviceUpdateLines(BaseDevice& device) const override {
+        Ch34xDeviceData& device_data =
+            device.GetDriverContext<Ch34xDeviceData>();
+        if (device_data.version < ctl::ModemVersion) {
             // uchcom_set_dtrrts_10
             // https://github.com/openbsd/src/blob/08933a0defbec6cd08faa2ea5d07912ace16b3ae/sys/dev/usb/uchcom.c#L510
             // ret = ControlIn(CH34X_CMD_REG_READ,
-            printf("DTR/RTS for this chip version not implemented\n");
+            USS_LOG_WARN("DTR/RTS for this chip version not implemented\n");
         } else {
-            int ret = SendDeviceControlOut(device, ctl::ModemWrite, message, 0);
+            int ret = WriteShadowed(device, device_data.modem, ctl::ModemWrite,
+                                    0, ModemMessage(device));
             if (ret < 0)
-                throw error::DevicePrepException(
-                    "Failed to set ch34x DTR / RTS");
+                return error::Result::Fail(error::Code::DevicePrep,
+                                           "Failed to set ch34x DTR / RTS",
+                                           ret);
         }
+
+        return error::Result::Ok();
+    }
+
+    /**
+     * The lines shadow is dropped, whoever submits the request owns the
+     * lines until TryHandleDeviceUpdateLines
+     */
+    bool GetDeviceLinesRequest(BaseDevice& device,
+                               ControlRequest& request) const override {
+        Ch34xDeviceData& device_data =
+            device.GetDriverContext<Ch34xDeviceData>();
+        if (device_data.version < ctl::ModemVersion)
+            return false;
+        device_data.modem.valid = false;
+
+        request.request_type = Ch34xCtlOut;
+        request.request = ctl::ModemWrite;
+        request.value = ModemMessage(device);
+        request.index = 0;
+        return true;
     }
 
-    void HandleDeviceInit(BaseDevice& device) override {
+    error::Result TryHandleDeviceInit(BaseDevice& device) const override {
         int ret;
         uint8_t buffer[8];
 
         // Get chip version
         ret = SendDeviceControlIn(device, ctl::CmdVersion, 0, 0, buffer, 8);
         if (ret < 0)
-            throw error::DevicePrepException("Failed to get ch34x version");
-        version = buffer[0];
+            return error::Result::Fail(error::Code::DevicePrep,
+                                       "Failed to get ch34x version", ret);
+        device.GetDriverContext<Ch34xDeviceData>().version = buffer[0];
 
-        // Clear / init chip
+        // Clear / init chip, forgetting what was programmed
+        Ch34xDeviceData& device_data =
+            device.GetDriverContext<Ch34xDeviceData>();
+        device_data.InvalidateShadows();
         ret = SendDeviceControlOut(device, ctl::CmdC1, 0, 0);
         if (ret < 0) {
-            printf("usb fail code %i (%s)\n", ret, libusb_error_name(ret));
-            throw error::DevicePrepException("Failed to clear ch34x chip");
+            USS_LOG_ERROR("usb fail code %i (%s)\n", ret,
+                          libusb_error_name(ret));
+            return error::Result::Fail(error::Code::DevicePrep,
+                                       "Failed to clear ch34x chip", ret);
         }
 
         // Set baudrate after chip clear
-        UpdateBaudRate(device, device.baud_rate);
+        USS_TRY(UpdateBaudRate(device, device.baud_rate));
 
         // Get LCR
         ret =
             SendDeviceControlIn(device, ctl::CmdRegRead, 0x2518, 0, buffer, 8);
         if (ret < 0)
-            throw error::DevicePrepException("Failed to get ch34x chip LCR");
+            return error::Result::Fail(error::Code::DevicePrep,
+                                       "Failed to get ch34x chip LCR", ret);
 
         // Set LCR
-        ret = SendDeviceControlOut(device, ctl::CmdRegWrite, 0x2518,
-                                   ctl::LcrEnRx | ctl::LcrEnTx | ctl::LcrCs8);
+        ret = WriteShadowed(device, device_data.lcr, ctl::CmdRegWrite, 0x2518,
+                            ctl::LcrEnRx | ctl::LcrEnTx | ctl::LcrCs8);
         if (ret < 0) {
-            printf("usb fail code %i (%s)\n", ret, libusb_error_name(ret));
-            throw "Failed to set ch34x chip LCR";
+            USS_LOG_ERROR("usb fail code %i (%s)\n", ret,
+                          libusb_error_name(ret));
+            return error::Result::Fail(error::Code::DevicePrep,
+                                       "Failed to set ch34x chip LCR", ret);
         }
 
         // Attempt to get status
         ret =
             SendDeviceControlIn(device, ctl::CmdRegRead, 0x0706, 0, buffer, 8);
-        printf("-> status buffer 0:%02x 1:%02x 2:%02x 3:%02x 4:%02x 5:%02x "
-               "6:%02x 7:%02x\n",
-               buffer[0], buffer[1], buffer[2], buffer[3], buffer[4], buffer[5],
-               buffer[6], buffer[7]);
+        USS_LOG_DEBUG(
+            "-> status buffer 0:%02x 1:%02x 2:%02x 3:%02x 4:%02x 5:%02x "
+            "6:%02x 7:%02x\n",
+            buffer[0], buffer[1], buffer[2], buffer[3], buffer[4], buffer[5],
+            buffer[6], buffer[7]);
         if (ret < 0) {
-            printf("usb fail code %i (%s)\n", ret, libusb_error_name(ret));
-            throw error::DevicePrepException("Failed to get ch34x chip status");
+            USS_LOG_ERROR("usb fail code %i (%s)\n", ret,
+                          libusb_error_name(ret));
+            return error::Result::Fail(error::Code::DevicePrep,
+                                       "Failed to get ch34x chip status", ret);
         }
 
         // Reset chip
+        device_data.InvalidateShadows();
         ret = SendDeviceControlOut(device, ctl::CmdC1, 0x501f, 0xd90a);
         if (ret < 0) {
-            printf("usb fail code %i (%s)\n", ret, libusb_error_name(ret));
-            throw error::DevicePrepException("Failed to clear ch34x chip");
+            USS_LOG_ERROR("usb fail code %i (%s)\n", ret,
+                          libusb_error_name(ret));
+            return error::Result::Fail(error::Code::DevicePrep,
+                                       "Failed to clear ch34x chip", ret);
         }
 
         // Set baudrate again
-        UpdateBaudRate(device, device.baud_rate);
+        USS_TRY(UpdateBaudRate(device, device.baud_rate));
 
         // Update control lines / do handshake
-        HandleDeviceUpdateLines(device);
+        USS_TRY(TryHandleDeviceUpdateLines(device));
 
         // Notify
-        printf("Init completed.\n");
+        USS_LOG_INFO("Init completed.\n");
+        return error::Result::Ok();
     }
 
-    void SetUpDevice(BaseDevice& device) override {
+    error::Result TrySetUpDevice(BaseDevice& device) const override {
         int ret;
         libusb_device_descriptor device_descriptor;
         libusb_config_descriptor* config_descriptor;
@@ -207,21 +291,25 @@ public:
         const libusb_interface_descriptor* interface_descriptor;
         const libusb_interface* interface;
         Ch34xDeviceData& device_data =
-            device.GetDriverSpecificData<Ch34xDeviceData>();
+            device.GetDriverContext<Ch34xDeviceData>();
+
+        // CH340/CH341 are single port
+        if (device.GetPortIndex() != 0)
+            return error::Result::Fail(error::Code::DevicePopulate,
+                                       "No such port.",
+                                       device.GetPortIndex());
 
         // Get device descriptor
-        ret = libusb_get_device_descriptor(device.GetUsbDevice(),
-                                           &device_descriptor);
+        ret = device.GetDeviceDescriptor(&device_descriptor);
         if (ret < 0)
-            throw error::DevicePopulateException(
-                "Couldn't get device descriptor.");
+            return error::Result::Fail(error::Code::DevicePopulate,
+                                       "Couldn't get device descriptor.", ret);
 
         // For each configuration.. (with the amount of them found in the device
         // descriptor)
         for (uint8_t ic = 0; ic < device_descriptor.bNumConfigurations; ic++) {
             // Get the configuration descriptor
-            libusb_get_config_descriptor(device.GetUsbDevice(), ic,
-                                         &config_descriptor);
+            device.GetConfigDescriptor(ic, &config_descriptor);
 
             // For each interface.. (with the amount of them found in the
             // configuration descriptor)
@@ -247,7 +335,7 @@ public:
                             interface_descriptor->endpoint + ie;
 
                         if (endpoint_descriptor->bmAttributes == 3) {
-                            printf(
+                            USS_LOG_DEBUG(
                                 "Skipping (hopefully) interrupt endpoint %i\n",
                                 ie);
                             continue;
@@ -275,83 +363,83 @@ public:
             }
 
             // Free configuration descriptor
-            libusb_free_config_descriptor(config_descriptor);
+            device.FreeConfigDescriptor(config_descriptor);
         }
 
-        printf("int:%i, in:%i, out:%i\n", device_data.interface,
-               device_data.in_endpoint, device_data.out_endpoint);
+        USS_LOG_DEBUG("int:%i, in:%i, out:%i\n", device_data.interface,
+                      device_data.in_endpoint, device_data.out_endpoint);
 
         if (device_data.in_endpoint == 0 && device_data.out_endpoint == 0)
-            throw error::DevicePopulateException(
-                "Couldn't populate endpoints.");
+            return error::Result::Fail(error::Code::DevicePopulate,
+                                       "Couldn't populate endpoints.");
 
         // Detach interfaces
-        if (libusb_kernel_driver_active(device.GetUsbHandle(),
-                                        device_data.interface)) {
-            ret = libusb_detach_kernel_driver(device.GetUsbHandle(),
-                                              device_data.interface);
-            if (ret < 0) {
-                printf("Failed to detach kernel driver from interface, code %i "
-                       "(%s)\n",
-                       ret, libusb_error_name(ret));
-                throw error::UsbAccessException(
-                    "Failed to detach kernel driver from interface");
-            }
-        }
-
-        if (libusb_kernel_driver_active(device.GetUsbHandle(),
-                                        device_data.interface)) {
-            ret = libusb_detach_kernel_driver(device.GetUsbHandle(),
-                                              device_data.interface);
-            if (ret < 0) {
-                printf("Failed to detach kernel driver from interface, code %i "
-                       "(%s)\n",
-                       ret, libusb_error_name(ret));
-                throw error::UsbAccessException(
-                    "Failed to detach kernel driver from interface");
-            }
+        ret = device.DetachKernelDriver(device_data.interface);
+        if (ret < 0) {
+            USS_LOG_ERROR(
+                "Failed to detach kernel driver from interface, code %i "
+                "(%s)\n",
+                ret, libusb_error_name(ret));
+            return error::Result::Fail(
+                error::Code::UsbAccess,
+                "Failed to detach kernel driver from interface", ret);
         }
 
         // Claim interfaces
-        ret = libusb_claim_interface(device.GetUsbHandle(),
-                                     device_data.interface);
+        ret = device.ClaimInterface(device_data.interface);
         if (ret < 0) {
-            printf("Failed to claim interface, code %i (%s)\n", ret,
-                   libusb_error_name(ret));
-            throw error::UsbAccessException("Failed to claim interface");
+            USS_LOG_ERROR("Failed to claim interface, code %i (%s)\n", ret,
+                          libusb_error_name(ret));
+            return error::Result::Fail(error::Code::UsbAccess,
+                                       "Failed to claim interface", ret);
         }
+
+        return error::Result::Ok();
     }
 
-    uint8_t GetDeviceInEndpoint(BaseDevice& device) override {
-        return device.GetDriverSpecificData<Ch34xDeviceData>().in_endpoint;
+    uint8_t GetDeviceInEndpoint(BaseDevice& device) const override {
+        return device.GetDriverContext<Ch34xDeviceData>().in_endpoint;
     }
 
-    uint8_t GetDeviceOutEndpoint(BaseDevice& device) override {
-        return device.GetDriverSpecificData<Ch34xDeviceData>().out_endpoint;
+    uint8_t GetDeviceOutEndpoint(BaseDevice& device) const override {
+        return device.GetDriverContext<Ch34xDeviceData>().out_endpoint;
     }
 
-    uint16_t GetDeviceInEndpointPacketSize(BaseDevice& device) override {
-        return device.GetDriverSpecificData<Ch34xDeviceData>()
+    uint16_t GetDeviceInEndpointPacketSize(BaseDevice& device) const override {
+        return device.GetDriverContext<Ch34xDeviceData>()
             .in_endpoint_packet_size;
     }
 
-    uint16_t GetDeviceOutEndpointPacketSize(BaseDevice& device) override {
-        return device.GetDriverSpecificData<Ch34xDeviceData>()
+    uint16_t GetDeviceOutEndpointPacketSize(BaseDevice& device) const override {
+        return device.GetDriverContext<Ch34xDeviceData>()
             .out_endpoint_packet_size;
     }
 
-    void SetDeviceBreak(BaseDevice& device, bool value) override {
+    error::Result TrySetDeviceBreak(BaseDevice& device,
+                                    bool value) const override {
         int ret;
         uint8_t buffer[2];
+        Ch34xDeviceData& device_data =
+            device.GetDriverContext<Ch34xDeviceData>();
 
-        // Read register
-        // CH341_REG_BREAK1, CH341_REG_BREAK2
-        ret =
-            SendDeviceControlIn(device, ctl::CmdRegRead, 0x1805, 0, buffer, 2);
-        if (ret != 0) {
-            printf("Failed to read ch34x register @ 0x1805! code %i (%s)\n",
-                   ret, libusb_error_name(ret));
-            return;
+        if (device_data.break_reg.valid) {
+            // Modify what we wrote last, no need to read it back
+            memcpy(buffer, &device_data.break_reg.value, 2);
+        } else {
+            // Read register
+            // CH341_REG_BREAK1, CH341_REG_BREAK2
+            ret = SendDeviceControlIn(device, ctl::CmdRegRead, 0x1805, 0,
+                                      buffer, 2);
+            if (ret < 2) {
+                USS_LOG_ERROR(
+                    "Failed to read ch34x register @ 0x1805! code %i (%s)\n",
+                    ret, libusb_error_name(ret));
+                return error::Result::Fail(
+                    error::Code::DevicePrep,
+                    "Failed to read ch34x break register", ret);
+            }
+            memcpy(&device_data.break_reg.value, buffer, 2);
+            device_data.break_reg.valid = true;
         }
 
         if (value) {
@@ -363,8 +451,23 @@ public:
         }
 
         // Write register
-        SendDeviceControlOut(device, ctl::CmdRegWrite, 0x1805,
-                             *(uint16_t*)buffer);
+        uint16_t reg_value;
+        memcpy(&reg_value, buffer, 2);
+        ret = WriteShadowed(device, device_data.break_reg, ctl::CmdRegWrite,
+                            0x1805, reg_value);
+
+        // Register 0x18 is the LCR too. Keep its shadow in step, so a
+        // Configure during the break rewrites it and ends the break.
+        if (ret < 0)
+            device_data.lcr.valid = false;
+        else if (device_data.lcr.valid)
+            device_data.lcr.value =
+                (device_data.lcr.value & 0xff00) | buffer[1];
+        if (ret < 0)
+            return error::Result::Fail(error::Code::DevicePrep,
+                                       "Failed to set ch34x break", ret);
+
+        return error::Result::Ok();
     }
 };
 
@@ -14,6 +14,7 @@
  * - 2022
  */
 #pragma once
+#include "../../driver.hpp"
 #include "../../usbvars.hpp"
 #include <stdint.h>
 
@@ -21,10 +22,30 @@ namespace uss {
 namespace driver {
 namespace ch34x {
 
-struct Ch34xDeviceData {
-    uint8_t interface;
-    uint8_t in_endpoint, out_endpoint;
-    uint16_t in_endpoint_packet_size, out_endpoint_packet_size;
+/**
+ * Last value written to a chip register, to skip writing it again
+ */
+struct Ch34xShadow {
+    uint16_t value = 0;
+    bool valid = false;
+};
+
+struct Ch34xDeviceData : public DriverContext {
+    uint8_t interface = 0;
+    uint8_t in_endpoint = 0, out_endpoint = 0;
+    uint16_t in_endpoint_packet_size = 0, out_endpoint_packet_size = 0;
+    uint8_t version = 0;
+
+    // Chip state as programmed, until a chip reset
+    Ch34xShadow baud1, baud2; // 0x1312, 0x0f2c
+    Ch34xShadow lcr;          // 0x2518
+    Ch34xShadow break_reg;    // 0x1805
+    Ch34xShadow modem;        // ModemWrite
+
+    void InvalidateShadows() {
+        baud1.valid = baud2.valid = lcr.valid = false;
+        break_reg.valid = modem.valid = false;
+    }
 };
 
 constexpr const uint32_t FlawedBaudrateFactor = 1532620800;
@@ -43,6 +64,8 @@ constexpr const uint8_t ModemWrite = 0xa4;  // "CMD_C2"
 constexpr const uint8_t ModemDtr = 0x20;    // "CH341_CTO_D"
 constexpr const uint8_t ModemRts = 0x40;    // "CH341_CTO_R"
 
+constexpr const uint8_t ModemVersion = 0x20; // "UCHCOM_VER_20", has ModemWrite
+
 constexpr const uint8_t LcrEnPa = 0x08;       // "CH341_L_PO", enable parity
 constexpr const uint8_t LcrEnRx = 0x80;       // "CH341_L_ER", enable rx
 constexpr const uint8_t LcrEnTx = 0x40;       // "CH341_L_ET", enable tx
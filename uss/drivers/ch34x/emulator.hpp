@@ -0,0 +1,147 @@
+/**
+ * usbselfserial by lotuspar (https://github.com/lotuspar)
+ *
+ * Inspired / based on:
+ *     the usb-serial-for-android project made in Java,
+ *         * which is copyright 2011-2013 Google Inc., 2013 Mike Wakerly
+ *         * https://github.com/mik3y/usb-serial-for-android
+ *     the Linux serial port drivers,
+ *         * https://github.com/torvalds/linux/tree/master/drivers/usb/serial
+ *     and the FreeBSD serial port drivers
+ *         * https://github.com/freebsd/freebsd-src/tree/main/sys/dev/usb/serial
+ * Some parts rewritten in C++ for usbselfserial!
+ *     * (by the time you read this it could have a different name!)
+ * - 2022
+ */
+#pragma once
+#include "../../controllers/emulator.hpp"
+#include "data.hpp"
+#include <cstring>
+
+namespace uss {
+namespace driver {
+namespace ch34x {
+
+/**
+ * Register level CH340/CH341 emulator
+ * Keeps the chip's register file and decodes the line settings from it the
+ * way the chip does, so a driver's baud rate rounding and LCR bits show up
+ * in GetLine() and in loopback timing. Register 0x2c (the low half of the
+ * old baud factor) is stored but, as on the chip, doesn't change the rate.
+ */
+class Ch34xEmulator : public uss::ctl::SerialEmulator {
+    constexpr static const uint32_t ClockRate = 48000000;
+    constexpr static const uint8_t RegBreak = 0x05;
+    constexpr static const uint8_t RegStatus = 0x06;
+    constexpr static const uint8_t RegPrescaler = 0x12;
+    constexpr static const uint8_t RegDivisor = 0x13;
+    constexpr static const uint8_t RegLcr = 0x18;
+    constexpr static const uint8_t NBreak = 0x01;
+
+    uint8_t version;
+    uint8_t registers[256];
+
+    /**
+     * Registers after power up or CmdC1 with no arguments: not in break,
+     * no modem inputs, baud rate and LCR unprogrammed
+     */
+    void ClearRegisters() {
+        memset(registers, 0, sizeof(registers));
+        registers[RegBreak] = NBreak;
+        registers[RegStatus] = 0xff;
+        Decode();
+    }
+
+    void Decode() {
+        uint8_t prescaler = registers[RegPrescaler];
+        uint8_t divisor = registers[RegDivisor];
+        uint32_t shift = 3 * (prescaler & 0x03) + ((prescaler >> 2) & 0x01);
+        if (divisor == 0 || shift > 12)
+            line.baud_rate = 0;
+        else
+            line.baud_rate =
+                ClockRate / ((1u << (12 - shift)) * (256u - divisor));
+
+        uint8_t lcr = registers[RegLcr];
+        line.data_bits = (DataBits)(lcr & 0x03);
+        line.stop_bits =
+            (lcr & ctl::LcrSb2) ? StopBits::StopBits_2 : StopBits::StopBits_1;
+        if (!(lcr & ctl::LcrEnPa))
+            line.parity = Parity::Parity_None;
+        else
+            line.parity = (Parity)(1 + ((lcr >> 4) & 0x03));
+        line.tx_enabled = lcr & ctl::LcrEnTx;
+        line.rx_enabled = lcr & ctl::LcrEnRx;
+        line.break_on = !(registers[RegBreak] & NBreak);
+    }
+
+protected:
+    int ChipControl(uint8_t request_type, uint8_t request, uint16_t value,
+                    uint16_t index, uint8_t* data, uint16_t length) override {
+        if ((request_type & 0x60) != 0x40)
+            return LIBUSB_ERROR_PIPE;
+        bool in = request_type & usbvars::UsbDirIn;
+
+        switch (request) {
+        case ctl::CmdVersion:
+            if (!in || length < 2)
+                return LIBUSB_ERROR_PIPE;
+            data[0] = version;
+            data[1] = 0;
+            return 2;
+        case ctl::CmdC1:
+            // With arguments this resets the serial engine, not the
+            // programmed settings
+            if (in)
+                return LIBUSB_ERROR_PIPE;
+            if (value == 0 && index == 0)
+                ClearRegisters();
+            return 0;
+        case ctl::CmdRegRead:
+            // wValue holds two register addresses, low byte first
+            if (!in || length < 2)
+                return LIBUSB_ERROR_PIPE;
+            data[0] = registers[value & 0xff];
+            data[1] = registers[value >> 8];
+            return 2;
+        case ctl::CmdRegWrite:
+            // wIndex holds the values, low byte to the low address
+            if (in)
+                return LIBUSB_ERROR_PIPE;
+            registers[value & 0xff] = index & 0xff;
+            registers[value >> 8] = index >> 8;
+            Decode();
+            return 0;
+        case ctl::ModemWrite:
+            // Outputs are active low
+            if (in)
+                return LIBUSB_ERROR_PIPE;
+            line.dtr = !(value & ctl::ModemDtr);
+            line.rts = !(value & ctl::ModemRts);
+            return 0;
+        default:
+            return LIBUSB_ERROR_PIPE;
+        }
+    }
+
+public:
+    /**
+     * @param _version what CmdVersion reports, 0x30 and up are CH340G /
+     * CH341A era chips
+     * @param fifo TX FIFO size in bytes
+     */
+    Ch34xEmulator(uint8_t _version = 0x31, uint32_t fifo = 32)
+        : SerialEmulator(uss::ctl::SoftwareLayout::Vendor, fifo),
+          version(_version) {
+        ClearRegisters();
+    }
+
+    uint8_t GetRegister(uint8_t address) {
+        std::lock_guard<std::mutex> lock(line_mutex);
+        return registers[address];
+    }
+};
+
+} // namespace ch34x
+} // namespace driver
+} // namespace uss
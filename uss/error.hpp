@@ -14,10 +14,19 @@
  * - 2022
  */
 #pragma once
+#include <cstdio>
+#include <cstdlib>
 #include <exception>
 #include <libusb-1.0/libusb.h>
+#include <stdint.h>
 #include <string>
 
+// Build without exceptions when the compiler has them off, or on request
+#if !defined(USS_NO_EXCEPTIONS) && !defined(__cpp_exceptions) &&              \
+    !defined(__EXCEPTIONS)
+#define USS_NO_EXCEPTIONS
+#endif
+
 namespace uss {
 namespace error {
 
@@ -82,5 +91,95 @@ public:
     int code() { return lusb_code; }
 };
 
+class OutputException : public std::exception {
+    std::string msg;
+
+public:
+    OutputException(const std::string& reason) : msg(reason) {}
+    const char* what() const throw() override { return msg.c_str(); }
+};
+
+enum class Code : uint8_t {
+    Ok = 0,
+    InvalidDeviceConfig,
+    NoDriver,
+    NoDevice,
+    DevicePopulate,
+    DevicePrep,
+    UsbAccess,
+    LibUsb,
+    Output
+};
+
+/**
+ * Outcome of a Try* call, the exception free counterpart of the classes
+ * above. Cheap to return; message is always a string literal.
+ */
+struct Result {
+    Code code = Code::Ok;
+    int value = 0; // libusb error code, or the offending config value
+    const char* message = "";
+
+    explicit operator bool() const { return code == Code::Ok; }
+
+    static Result Ok() { return Result(); }
+
+    static Result Fail(Code code, const char* message, int value = 0) {
+        Result result;
+        result.code = code;
+        result.message = message;
+        result.value = value;
+        return result;
+    }
+};
+
+/**
+ * Return a failed Result from the calling function
+ */
+#define USS_TRY(expression)                                                    \
+    do {                                                                       \
+        ::uss::error::Result uss_try_result = (expression);                    \
+        if (!uss_try_result)                                                   \
+            return uss_try_result;                                             \
+    } while (0)
+
+/**
+ * Throw an exception, or report it and abort with USS_NO_EXCEPTIONS
+ */
+template <typename E>[[noreturn]] void Throw(const E& exception) {
+#if defined(USS_NO_EXCEPTIONS)
+    fprintf(stderr, "usbselfserial: %s\n", exception.what());
+    abort();
+#else
+    throw exception;
+#endif
+}
+
+/**
+ * Throw the exception matching a failed Result, nothing if it succeeded
+ */
+inline void Raise(const Result& result) {
+    switch (result.code) {
+    case Code::Ok:
+        return;
+    case Code::InvalidDeviceConfig:
+        Throw(InvalidDeviceConfigException(result.message, result.value));
+    case Code::NoDriver:
+        Throw(NoDriverException());
+    case Code::NoDevice:
+        Throw(NoDeviceException());
+    case Code::DevicePopulate:
+        Throw(DevicePopulateException(result.message));
+    case Code::DevicePrep:
+        Throw(DevicePrepException(result.message));
+    case Code::UsbAccess:
+        Throw(UsbAccessException(result.message));
+    case Code::LibUsb:
+        Throw(LibUsbErrorException(result.message, result.value));
+    case Code::Output:
+        Throw(OutputException(result.message));
+    }
+}
+
 } // namespace error
 } // namespace uss
\ No newline at end of file
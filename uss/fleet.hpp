@@ -0,0 +1,128 @@
+/**
+ * usbselfserial by lotuspar (https://github.com/lotuspar)
+ *
+ * Inspired / based on:
+ *     the usb-serial-for-android project made in Java,
+ *         * which is copyright 2011-2013 Google Inc., 2013 Mike Wakerly
+ *         * https://github.com/mik3y/usb-serial-for-android
+ *     the Linux serial port drivers,
+ *         * https://github.com/torvalds/linux/tree/master/drivers/usb/serial
+ *     and the FreeBSD serial port drivers
+ *         * https://github.com/freebsd/freebsd-src/tree/main/sys/dev/usb/serial
+ * Some parts rewritten in C++ for usbselfserial!
+ *     * (by the time you read this it could have a different name!)
+ * - 2022
+ */
+#pragma once
+#include "device.hpp"
+#include "error.hpp"
+#include "log.hpp"
+#include "timing.hpp"
+#include <atomic>
+#include <functional>
+#include <stddef.h>
+#include <stdint.h>
+#include <thread>
+#include <vector>
+
+namespace uss {
+namespace fleet {
+
+/**
+ * Outcome of one device's initialization
+ */
+struct DeviceReport {
+    error::Result result;
+    uint64_t start = 0; // ns after Run started
+    uint64_t time = 0;  // ns spent initializing
+};
+
+struct Report {
+    std::vector<DeviceReport> devices;
+    size_t ready = 0;
+    uint64_t total_time = 0;      // wall time until every device was done
+    uint64_t sequential_time = 0; // sum of device times, a serial startup
+};
+
+/**
+ * Initializes many devices at once
+ * Driver setup is a chain of blocking control transfers, so devices are
+ * handed out to worker threads instead of being brought up one by one.
+ * Jobs must not share state; drivers keep per device state in a
+ * DriverContext owned by the device.
+ */
+class Initializer {
+    std::vector<std::function<error::Result()>> jobs;
+
+public:
+    /**
+     * Add a job, run on a worker thread by Run
+     */
+    void Add(std::function<error::Result()> job) { jobs.push_back(job); }
+
+    /**
+     * Add a device that gets the driver set (and so initialized) by Run
+     */
+    void Add(BaseDevice* device, const BaseDriver* driver) {
+        Add([device, driver]() { return device->TrySetDriver(driver); });
+    }
+
+    size_t Size() const { return jobs.size(); }
+
+    /**
+     * Run every job and wait for them
+     * @param workers thread count, 0 for one per job (up to MaxWorkers)
+     */
+    Report Run(size_t workers = 0) {
+        constexpr static const size_t MaxWorkers = 32;
+
+        Report report;
+        report.devices.resize(jobs.size());
+        if (workers == 0)
+            workers = jobs.size() < MaxWorkers ? jobs.size() : MaxWorkers;
+        if (workers > jobs.size())
+            workers = jobs.size();
+
+        std::atomic<size_t> next{0};
+        uint64_t start = timing::Now();
+        auto work = [this, &report, &next, start]() {
+            size_t index;
+            while ((index = next.fetch_add(1)) < jobs.size()) {
+                DeviceReport& device = report.devices[index];
+                uint64_t job_start = timing::Now();
+                device.result = jobs[index]();
+                device.start = job_start - start;
+                device.time = timing::Now() - job_start;
+            }
+        };
+
+        // The calling thread is one of the workers
+        std::vector<std::thread> threads;
+        for (size_t i = 1; i < workers; i++)
+            threads.emplace_back(work);
+        work();
+        for (std::thread& thread : threads)
+            thread.join();
+        report.total_time = timing::Now() - start;
+
+        for (size_t i = 0; i < report.devices.size(); i++) {
+            const DeviceReport& device = report.devices[i];
+            report.sequential_time += device.time;
+            if (device.result)
+                report.ready++;
+            else
+                USS_LOG_ERROR("Device %zu failed to initialize: %s\n", i,
+                              device.result.message);
+        }
+
+        USS_LOG_INFO("%zu/%zu devices ready in %.1f ms (%.1f ms sequential), "
+                     "%zu workers\n",
+                     report.ready, report.devices.size(),
+                     report.total_time / 1e6, report.sequential_time / 1e6,
+                     workers);
+        return report;
+    }
+};
+
+} // namespace fleet
+} // namespace uss
@@ -0,0 +1,60 @@
+/**
+ * usbselfserial by lotuspar (https://github.com/lotuspar)
+ *
+ * Inspired / based on:
+ *     the usb-serial-for-android project made in Java,
+ *         * which is copyright 2011-2013 Google Inc., 2013 Mike Wakerly
+ *         * https://github.com/mik3y/usb-serial-for-android
+ *     the Linux serial port drivers,
+ *         * https://github.com/torvalds/linux/tree/master/drivers/usb/serial
+ *     and the FreeBSD serial port drivers
+ *         * https://github.com/freebsd/freebsd-src/tree/main/sys/dev/usb/serial
+ * Some parts rewritten in C++ for usbselfserial!
+ *     * (by the time you read this it could have a different name!)
+ * - 2022
+ */
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+namespace uss {
+
+struct FramingStats {
+    uint64_t frames = 0;
+    uint64_t crc_errors = 0;
+    uint64_t resyncs = 0;
+    uint64_t discarded_bytes = 0;
+};
+
+/**
+ * Optional stage between the device and an output that knows the framing of
+ * the protocol on the wire, so outputs can hand over whole frames only.
+ */
+class BaseFramer {
+public:
+    virtual ~BaseFramer() {}
+
+    /**
+     * Feed received data
+     * @param frames set to the whole, valid frames ready to deliver. Valid
+     * until the next call.
+     * @return length of frames
+     */
+    virtual size_t Receive(const uint8_t* data, size_t length,
+                           const uint8_t** frames) = 0;
+
+    /**
+     * Length of the leading part of data that ends on a frame boundary, so
+     * a transfer doesn't split a frame. 0 if more data is needed.
+     */
+    virtual size_t TransmitBoundary(const uint8_t* data, size_t length) = 0;
+
+    /**
+     * Forget partial frames, e.g. on reconnect
+     */
+    virtual void Reset() = 0;
+
+    virtual FramingStats GetStats() = 0;
+};
+
+} // namespace uss
\ No newline at end of file
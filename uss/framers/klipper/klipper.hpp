@@ -0,0 +1,201 @@
+/**
+ * usbselfserial by lotuspar (https://github.com/lotuspar)
+ *
+ * Inspired / based on:
+ *     the usb-serial-for-android project made in Java,
+ *         * which is copyright 2011-2013 Google Inc., 2013 Mike Wakerly
+ *         * https://github.com/mik3y/usb-serial-for-android
+ *     the Linux serial port drivers,
+ *         * https://github.com/torvalds/linux/tree/master/drivers/usb/serial
+ *     and the FreeBSD serial port drivers
+ *         * https://github.com/freebsd/freebsd-src/tree/main/sys/dev/usb/serial
+ * Some parts rewritten in C++ for usbselfserial!
+ *     * (by the time you read this it could have a different name!)
+ * - 2022
+ */
+#pragma once
+#include "../../buffer.hpp"
+#include "../../framer.hpp"
+#include <cstring>
+#include <memory>
+
+namespace uss {
+namespace framer {
+namespace klipper {
+
+// Defines from klipper/src/command.h & klippy/chelper/msgblock.h
+constexpr const uint8_t MessageMin = 5;
+constexpr const uint8_t MessageMax = 64;
+constexpr const uint8_t MessagePosLen = 0;
+constexpr const uint8_t MessagePosSeq = 1;
+constexpr const uint8_t MessageTrailerSize = 3;
+constexpr const uint8_t MessageTrailerCrc = 3;
+constexpr const uint8_t MessageTrailerSync = 1;
+constexpr const uint8_t MessageSeqMask = 0x0f;
+constexpr const uint8_t MessageDest = 0x10;
+constexpr const uint8_t MessageSync = 0x7e;
+
+/**
+ * Lookup table for klipper's crc16_ccitt (reflected 0x8408, init 0xffff)
+ */
+struct Crc16Table {
+    uint16_t entries[256];
+
+    constexpr Crc16Table() : entries() {
+        for (int i = 0; i < 256; i++) {
+            uint16_t crc = i;
+            for (int bit = 0; bit < 8; bit++)
+                crc = (crc & 1) ? (crc >> 1) ^ 0x8408 : crc >> 1;
+            entries[i] = crc;
+        }
+    }
+};
+
+constexpr const Crc16Table Crc16 = Crc16Table();
+
+inline uint16_t Crc16Ccitt(const uint8_t* data, size_t length) {
+    uint16_t crc = 0xffff;
+    while (length--)
+        crc = (crc >> 8) ^ Crc16.entries[(crc ^ *data++) & 0xff];
+    return crc;
+}
+
+/**
+ * Framer for klipper message blocks
+ *     <len> <seq> <payload...> <crc16 hi> <crc16 lo> <0x7e>
+ * Invalid blocks are dropped up to the next sync byte, like klippy does.
+ */
+class KlipperFramer : public BaseFramer {
+    constexpr static const size_t Capacity =
+        buffer::SizeClasses[buffer::SizeClassCount - 1] + MessageMax;
+
+    std::unique_ptr<uint8_t[]> buffer;
+    size_t used = 0;    // bytes in buffer
+    size_t emitted = 0; // frames handed out by the last Receive
+    bool need_sync = false;
+    FramingStats stats;
+
+    /**
+     * msgblock_check from klippy/chelper/msgblock.c
+     * @return frame length, 0 for more data, -n to discard n bytes
+     */
+    int Check(const uint8_t* data, size_t length) {
+        if (length < MessageMin)
+            return 0;
+        if (need_sync)
+            return Discard(data, length);
+
+        uint8_t msglen = data[MessagePosLen];
+        if (msglen < MessageMin || msglen > MessageMax)
+            return Discard(data, length);
+        if ((data[MessagePosSeq] & ~MessageSeqMask) != MessageDest)
+            return Discard(data, length);
+        if (length < msglen)
+            return 0;
+        if (data[msglen - MessageTrailerSync] != MessageSync)
+            return Discard(data, length);
+
+        uint16_t msgcrc = (data[msglen - MessageTrailerCrc] << 8) |
+                          data[msglen - MessageTrailerCrc + 1];
+        if (Crc16Ccitt(data, msglen - MessageTrailerSize) != msgcrc) {
+            stats.crc_errors++;
+            return Discard(data, length);
+        }
+        return msglen;
+    }
+
+    /**
+     * Skip to just after the next sync byte
+     */
+    int Discard(const uint8_t* data, size_t length) {
+        if (!need_sync)
+            stats.resyncs++;
+
+        const uint8_t* next_sync =
+            (const uint8_t*)memchr(data, MessageSync, length);
+        if (next_sync != NULL) {
+            need_sync = false;
+            return -(int)(next_sync - data + 1);
+        }
+        need_sync = true;
+        return -(int)length;
+    }
+
+public:
+    KlipperFramer() : buffer(new uint8_t[Capacity]) {}
+
+    size_t Receive(const uint8_t* data, size_t length,
+                   const uint8_t** frames) override {
+        // Drop frames handed out last time
+        memmove(buffer.get(), buffer.get() + emitted, used - emitted);
+        used -= emitted;
+        emitted = 0;
+
+        if (used + length > Capacity) {
+            // Can't happen with whole transfers, start over if it does
+            stats.discarded_bytes += used;
+            stats.resyncs++;
+            used = 0;
+            need_sync = true;
+            if (length > Capacity)
+                length = Capacity;
+        }
+        memcpy(buffer.get() + used, data, length);
+        used += length;
+
+        // Pack valid frames to the front, leave the partial tail after them
+        size_t read = 0, write = 0;
+        while (read < used) {
+            int ret = Check(buffer.get() + read, used - read);
+            if (ret == 0)
+                break;
+            if (ret < 0) {
+                read += -ret;
+                stats.discarded_bytes += -ret;
+                continue;
+            }
+            if (write != read)
+                memmove(buffer.get() + write, buffer.get() + read, ret);
+            write += ret;
+            read += ret;
+            stats.frames++;
+        }
+
+        if (read != write)
+            memmove(buffer.get() + write, buffer.get() + read, used - read);
+        used -= read - write;
+        emitted = write;
+
+        *frames = buffer.get();
+        return write;
+    }
+
+    size_t TransmitBoundary(const uint8_t* data, size_t length) override {
+        size_t pos = 0;
+        while (pos < length) {
+            if (data[pos] == MessageSync) {
+                pos++;
+                continue;
+            }
+            uint8_t msglen = data[pos + MessagePosLen];
+            if (msglen < MessageMin || msglen > MessageMax)
+                return length; // not framed, send as is
+            if (pos + msglen > length)
+                break;
+            pos += msglen;
+        }
+        return pos;
+    }
+
+    void Reset() override {
+        used = 0;
+        emitted = 0;
+        need_sync = false;
+    }
+
+    FramingStats GetStats() override { return stats; }
+};
+
+} // namespace klipper
+} // namespace framer
+} // namespace uss
\ No newline at end of file
@@ -0,0 +1,467 @@
+/**
+ * usbselfserial by lotuspar (https://github.com/lotuspar)
+ *
+ * Inspired / based on:
+ *     the usb-serial-for-android project made in Java,
+ *         * which is copyright 2011-2013 Google Inc., 2013 Mike Wakerly
+ *         * https://github.com/mik3y/usb-serial-for-android
+ *     the Linux serial port drivers,
+ *         * https://github.com/torvalds/linux/tree/master/drivers/usb/serial
+ *     and the FreeBSD serial port drivers
+ *         * https://github.com/freebsd/freebsd-src/tree/main/sys/dev/usb/serial
+ * Some parts rewritten in C++ for usbselfserial!
+ *     * (by the time you read this it could have a different name!)
+ * - 2022
+ */
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include <thread>
+#include <type_traits>
+
+/**
+ * Logging for the library
+ * USS_LOG_* calls below USS_LOG_LEVEL compile to nothing, arguments
+ * included. The rest copy their arguments into a lock free ring and return;
+ * formatting and output happen on a background thread, so logging from a
+ * libusb callback never waits on stdio. A full ring drops records instead
+ * of blocking.
+ *
+ * The format must be a string literal, it's kept by pointer. String
+ * arguments are copied.
+ */
+#define USS_LOG_LEVEL_TRACE 0
+#define USS_LOG_LEVEL_DEBUG 1
+#define USS_LOG_LEVEL_INFO 2
+#define USS_LOG_LEVEL_WARN 3
+#define USS_LOG_LEVEL_ERROR 4
+#define USS_LOG_LEVEL_NONE 5
+
+#ifndef USS_LOG_LEVEL
+#define USS_LOG_LEVEL USS_LOG_LEVEL_INFO
+#endif
+
+#define USS_LOG_WRITE(level, ...)                                              \
+    ::uss::log::Logger::Instance().Write(::uss::log::Level::level, __VA_ARGS__)
+
+#if USS_LOG_LEVEL <= USS_LOG_LEVEL_TRACE
+#define USS_LOG_TRACE(...) USS_LOG_WRITE(Trace, __VA_ARGS__)
+#else
+#define USS_LOG_TRACE(...)                                                     \
+    do {                                                                       \
+    } while (0)
+#endif
+
+#if USS_LOG_LEVEL <= USS_LOG_LEVEL_DEBUG
+#define USS_LOG_DEBUG(...) USS_LOG_WRITE(Debug, __VA_ARGS__)
+#else
+#define USS_LOG_DEBUG(...)                                                     \
+    do {                                                                       \
+    } while (0)
+#endif
+
+#if USS_LOG_LEVEL <= USS_LOG_LEVEL_INFO
+#define USS_LOG_INFO(...) USS_LOG_WRITE(Info, __VA_ARGS__)
+#else
+#define USS_LOG_INFO(...)                                                      \
+    do {                                                                       \
+    } while (0)
+#endif
+
+#if USS_LOG_LEVEL <= USS_LOG_LEVEL_WARN
+#define USS_LOG_WARN(...) USS_LOG_WRITE(Warn, __VA_ARGS__)
+#else
+#define USS_LOG_WARN(...)                                                      \
+    do {                                                                       \
+    } while (0)
+#endif
+
+#if USS_LOG_LEVEL <= USS_LOG_LEVEL_ERROR
+#define USS_LOG_ERROR(...) USS_LOG_WRITE(Error, __VA_ARGS__)
+#else
+#define USS_LOG_ERROR(...)                                                     \
+    do {                                                                       \
+    } while (0)
+#endif
+
+namespace uss {
+namespace log {
+
+enum class Level { Trace, Debug, Info, Warn, Error };
+
+inline const char* LevelName(Level level) {
+    switch (level) {
+    case Level::Trace:
+        return "trace";
+    case Level::Debug:
+        return "debug";
+    case Level::Info:
+        return "info";
+    case Level::Warn:
+        return "warn";
+    case Level::Error:
+        return "error";
+    }
+    return "?";
+}
+
+struct Argument {
+    enum class Type : uint8_t { Signed, Unsigned, Double, String, Pointer };
+    Type type;
+    uint8_t size; // bytes of the original integer
+    union {
+        int64_t i;
+        uint64_t u;
+        double d;
+        const void* p;
+    };
+};
+
+struct Record {
+    constexpr static const size_t MaxArguments = 8;
+    constexpr static const size_t TextSize = 128;
+
+    std::atomic<size_t> sequence{0};
+    Level level;
+    const char* format;
+    uint8_t argument_count;
+    uint16_t text_length;
+    Argument arguments[MaxArguments];
+    char text[TextSize]; // copied string arguments
+};
+
+/**
+ * Copy one argument into a record
+ */
+template <typename T>
+typename std::enable_if<std::is_integral<T>::value ||
+                        std::is_enum<T>::value>::type
+Capture(Record& record, Argument& argument, T value) {
+    argument.size = sizeof(T);
+    if (std::is_signed<T>::value ||
+        (std::is_enum<T>::value && (int64_t)value < 0)) {
+        argument.type = Argument::Type::Signed;
+        argument.i = (int64_t)value;
+    } else {
+        argument.type = Argument::Type::Unsigned;
+        argument.u = (uint64_t)value;
+    }
+}
+
+template <typename T>
+typename std::enable_if<std::is_floating_point<T>::value>::type
+Capture(Record& record, Argument& argument, T value) {
+    argument.type = Argument::Type::Double;
+    argument.d = value;
+}
+
+inline void Capture(Record& record, Argument& argument, const char* value) {
+    argument.type = Argument::Type::String;
+    if (value == NULL)
+        value = "(null)";
+
+    // Copy as much as fits, the offset goes in u
+    size_t space = Record::TextSize - record.text_length;
+    if (space == 0) {
+        argument.type = Argument::Type::Pointer;
+        argument.p = NULL;
+        return;
+    }
+    size_t length = strnlen(value, space - 1);
+    memcpy(record.text + record.text_length, value, length);
+    record.text[record.text_length + length] = 0;
+    argument.u = record.text_length;
+    record.text_length += (uint16_t)(length + 1);
+}
+
+inline void Capture(Record& record, Argument& argument, char* value) {
+    Capture(record, argument, (const char*)value);
+}
+
+inline void Capture(Record& record, Argument& argument, const void* value) {
+    argument.type = Argument::Type::Pointer;
+    argument.p = value;
+}
+
+inline void CaptureAll(Record& record, size_t index) {}
+
+template <typename T, typename... Args>
+void CaptureAll(Record& record, size_t index, T value, Args... rest) {
+    Capture(record, record.arguments[index], value);
+    CaptureAll(record, index + 1, rest...);
+}
+
+/**
+ * Format a record like printf would have
+ * Conversions without a matching argument are copied as is.
+ */
+inline size_t Format(const Record& record, char* out, size_t size) {
+    size_t length = 0, next = 0;
+    const char* c = record.format;
+
+    auto append = [&](const char* data, size_t count) {
+        if (length + count >= size)
+            count = size - 1 - length;
+        memcpy(out + length, data, count);
+        length += count;
+    };
+
+    while (*c != 0 && length < size - 1) {
+        if (*c != '%') {
+            const char* end = strchr(c, '%');
+            size_t count = end == NULL ? strlen(c) : (size_t)(end - c);
+            append(c, count);
+            c += count;
+            continue;
+        }
+        if (c[1] == '%') {
+            append("%", 1);
+            c += 2;
+            continue;
+        }
+
+        // Flags, width and precision are passed through, length modifiers
+        // are replaced to match the captured type
+        char spec[32] = "%";
+        size_t spec_length = 1;
+        const char* start = c++;
+        while (*c != 0 && strchr("-+ #0123456789.", *c) != NULL &&
+               spec_length < sizeof(spec) - 4)
+            spec[spec_length++] = *c++;
+        while (*c != 0 && strchr("hljztL", *c) != NULL)
+            c++;
+        char conversion = *c;
+        if (conversion == 0 || next >= record.argument_count) {
+            append(start, (size_t)(c - start) + (conversion != 0));
+            if (conversion != 0)
+                c++;
+            continue;
+        }
+        c++;
+
+        const Argument& argument = record.arguments[next++];
+        char formatted[128];
+        int count = 0;
+        switch (conversion) {
+        case 'd':
+        case 'i': {
+            spec[spec_length++] = 'l';
+            spec[spec_length++] = 'l';
+            spec[spec_length++] = conversion;
+            spec[spec_length] = 0;
+            long long value = argument.type == Argument::Type::Signed
+                                  ? (long long)argument.i
+                                  : (long long)argument.u;
+            count = snprintf(formatted, sizeof(formatted), spec, value);
+            break;
+        }
+        case 'u':
+        case 'x':
+        case 'X':
+        case 'o': {
+            spec[spec_length++] = 'l';
+            spec[spec_length++] = 'l';
+            spec[spec_length++] = conversion;
+            spec[spec_length] = 0;
+            // Negative values print as their original width would
+            unsigned long long value = argument.u;
+            if (argument.size < 8)
+                value &= (1ull << (argument.size * 8)) - 1;
+            count = snprintf(formatted, sizeof(formatted), spec, value);
+            break;
+        }
+        case 'c':
+            spec[spec_length++] = 'c';
+            spec[spec_length] = 0;
+            count = snprintf(formatted, sizeof(formatted), spec,
+                             (int)argument.i);
+            break;
+        case 'f':
+        case 'F':
+        case 'e':
+        case 'E':
+        case 'g':
+        case 'G':
+        case 'a':
+        case 'A':
+            spec[spec_length++] = conversion;
+            spec[spec_length] = 0;
+            count = snprintf(formatted, sizeof(formatted), spec,
+                             argument.type == Argument::Type::Double
+                                 ? argument.d
+                                 : (double)argument.i);
+            break;
+        case 's':
+            spec[spec_length++] = 's';
+            spec[spec_length] = 0;
+            count = snprintf(formatted, sizeof(formatted), spec,
+                             argument.type == Argument::Type::String
+                                 ? record.text + argument.u
+                                 : "(...)");
+            break;
+        case 'p':
+            count = snprintf(formatted, sizeof(formatted), "%p", argument.p);
+            break;
+        default:
+            append(start, (size_t)(c - start));
+            continue;
+        }
+
+        if (count > 0)
+            append(formatted, (size_t)count < sizeof(formatted)
+                                  ? (size_t)count
+                                  : sizeof(formatted) - 1);
+    }
+
+    out[length] = 0;
+    return length;
+}
+
+/**
+ * Where formatted lines go, one call per record without a trailing newline
+ */
+using Sink = std::function<void(Level level, const char* line)>;
+
+/**
+ * Process wide logger
+ * Any number of threads write, one background thread formats. Write never
+ * takes a lock or allocates.
+ */
+class Logger {
+    constexpr static const size_t Capacity = 1024; // power of two
+    constexpr static const int IdleMs = 2; // reader sleep when empty
+
+    std::unique_ptr<Record[]> ring;
+    std::atomic<size_t> enqueue_position{0};
+    size_t dequeue_position = 0;
+    std::atomic<uint64_t> dropped{0};
+    uint64_t dropped_reported = 0;
+
+    std::mutex drain_mutex; // reader side only
+    Sink sink;
+    std::atomic<bool> running{true};
+    std::thread thread;
+
+    Logger() : ring(new Record[Capacity]) {
+        for (size_t i = 0; i < Capacity; i++)
+            ring[i].sequence.store(i, std::memory_order_relaxed);
+        sink = [](Level level, const char* line) {
+            fputs(line, stdout);
+            fputc('\n', stdout);
+        };
+        thread = std::thread([this]() {
+            while (running.load(std::memory_order_acquire))
+                if (Drain() == 0)
+                    std::this_thread::sleep_for(
+                        std::chrono::milliseconds(IdleMs));
+            Drain();
+        });
+    }
+
+public:
+    static Logger& Instance() {
+        static Logger logger;
+        return logger;
+    }
+
+    ~Logger() {
+        running.store(false, std::memory_order_release);
+        thread.join();
+    }
+
+    Logger(const Logger&) = delete;
+    Logger& operator=(const Logger&) = delete;
+
+    template <typename... Args>
+    void Write(Level level, const char* format, Args... args) {
+        static_assert(sizeof...(Args) <= Record::MaxArguments,
+                      "Too many log arguments");
+
+        // Claim a slot, bounded MPMC ring with per slot sequence numbers
+        size_t position = enqueue_position.load(std::memory_order_relaxed);
+        Record* record;
+        for (;;) {
+            record = &ring[position & (Capacity - 1)];
+            size_t sequence = record->sequence.load(std::memory_order_acquire);
+            intptr_t difference = (intptr_t)sequence - (intptr_t)position;
+            if (difference == 0) {
+                if (enqueue_position.compare_exchange_weak(
+                        position, position + 1, std::memory_order_relaxed))
+                    break;
+            } else if (difference < 0) {
+                // Full, the reader is behind
+                dropped.fetch_add(1, std::memory_order_relaxed);
+                return;
+            } else {
+                position = enqueue_position.load(std::memory_order_relaxed);
+            }
+        }
+
+        record->level = level;
+        record->format = format;
+        record->argument_count = sizeof...(Args);
+        record->text_length = 0;
+        CaptureAll(*record, 0, args...);
+        record->sequence.store(position + 1, std::memory_order_release);
+    }
+
+    /**
+     * Format and output everything written so far
+     * @return records output
+     */
+    size_t Drain() {
+        std::lock_guard<std::mutex> lock(drain_mutex);
+        size_t count = 0;
+        char line[512];
+
+        for (;;) {
+            Record& record = ring[dequeue_position & (Capacity - 1)];
+            if (record.sequence.load(std::memory_order_acquire) !=
+                dequeue_position + 1)
+                break;
+
+            size_t length = Format(record, line, sizeof(line));
+            Level level = record.level;
+            record.sequence.store(dequeue_position + Capacity,
+                                  std::memory_order_release);
+            dequeue_position++;
+
+            // Lines are whole records, drop the printf style newline
+            if (length != 0 && line[length - 1] == '\n')
+                line[length - 1] = 0;
+            sink(level, line);
+            count++;
+        }
+
+        uint64_t lost = dropped.load(std::memory_order_relaxed);
+        if (lost != dropped_reported) {
+            snprintf(line, sizeof(line), "%llu log records dropped",
+                     (unsigned long long)(lost - dropped_reported));
+            sink(Level::Warn, line);
+            dropped_reported = lost;
+        }
+
+        if (count != 0)
+            fflush(stdout);
+        return count;
+    }
+
+    /**
+     * Replace the default stdout sink, called from the logging thread
+     */
+    void SetSink(Sink _sink) {
+        std::lock_guard<std::mutex> lock(drain_mutex);
+        sink = _sink;
+    }
+
+    uint64_t Dropped() { return dropped.load(std::memory_order_relaxed); }
+};
+
+} // namespace log
+} // namespace uss
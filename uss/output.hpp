@@ -14,7 +14,9 @@
  * - 2022
  */
 #pragma once
+#include "buffer.hpp"
 #include "device.hpp"
+#include "error.hpp"
 #include <functional>
 
 namespace uss {
@@ -24,7 +26,8 @@ public:
     BaseOutput(BaseDevice* _device) : device(_device) {}
 
     virtual void HandleEvents() = 0;
-    virtual void SetDevice(BaseDevice* _device) = 0;
+    virtual error::Result TrySetDevice(BaseDevice* _device) = 0;
+    void SetDevice(BaseDevice* _device) { error::Raise(TrySetDevice(_device)); }
     virtual void RemoveDevice() = 0;
     virtual void EndTransfers(std::function<void(int)> callback = NULL) = 0;
     virtual void
@@ -34,4 +37,15 @@ protected:
     BaseDevice* device;
 };
 
+/**
+ * Consumer of received (usb -> host) data
+ * Chunks are shared with other consumers, they must not be modified.
+ */
+class BaseSink {
+public:
+    virtual ~BaseSink() {}
+
+    virtual void Consume(const buffer::Ref& chunk) = 0;
+};
+
 } // namespace uss
\ No newline at end of file
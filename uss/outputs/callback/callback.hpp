@@ -0,0 +1,57 @@
+/**
+ * usbselfserial by lotuspar (https://github.com/lotuspar)
+ *
+ * Inspired / based on:
+ *     the usb-serial-for-android project made in Java,
+ *         * which is copyright 2011-2013 Google Inc., 2013 Mike Wakerly
+ *         * https://github.com/mik3y/usb-serial-for-android
+ *     the Linux serial port drivers,
+ *         * https://github.com/torvalds/linux/tree/master/drivers/usb/serial
+ *     and the FreeBSD serial port drivers
+ *         * https://github.com/freebsd/freebsd-src/tree/main/sys/dev/usb/serial
+ * Some parts rewritten in C++ for usbselfserial!
+ *     * (by the time you read this it could have a different name!)
+ * - 2022
+ */
+#pragma once
+#include "../../output.hpp"
+#include "../../stats.hpp"
+#include "../../timing.hpp"
+#include <functional>
+
+namespace uss {
+namespace output {
+namespace callback {
+
+/**
+ * Sink that hands received data to a function
+ * The data is only valid during the call. timestamp is when it arrived,
+ * see timing::Now.
+ */
+class CallbackSink : public BaseSink {
+public:
+    using Callback = std::function<void(const uint8_t* data, size_t length,
+                                        uint64_t timestamp)>;
+
+private:
+    Callback callback;
+    stats::Histogram latency;
+
+public:
+    CallbackSink(Callback _callback) : callback(_callback) {}
+
+    void Consume(const buffer::Ref& chunk) override {
+        callback(chunk.Data(), chunk.Length(), chunk.Timestamp());
+        if (chunk.Timestamp() != 0)
+            latency.Record(timing::Now() - chunk.Timestamp());
+    }
+
+    /**
+     * Time from arrival until the callback returned
+     */
+    const stats::Histogram& GetLatency() { return latency; }
+};
+
+} // namespace callback
+} // namespace output
+} // namespace uss
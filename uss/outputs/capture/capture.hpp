@@ -0,0 +1,48 @@
+/**
+ * usbselfserial by lotuspar (https://github.com/lotuspar)
+ *
+ * Inspired / based on:
+ *     the usb-serial-for-android project made in Java,
+ *         * which is copyright 2011-2013 Google Inc., 2013 Mike Wakerly
+ *         * https://github.com/mik3y/usb-serial-for-android
+ *     the Linux serial port drivers,
+ *         * https://github.com/torvalds/linux/tree/master/drivers/usb/serial
+ *     and the FreeBSD serial port drivers
+ *         * https://github.com/freebsd/freebsd-src/tree/main/sys/dev/usb/serial
+ * Some parts rewritten in C++ for usbselfserial!
+ *     * (by the time you read this it could have a different name!)
+ * - 2022
+ */
+#pragma once
+#include "../../capture.hpp"
+#include "../../output.hpp"
+#include "../../timing.hpp"
+
+namespace uss {
+namespace output {
+namespace capture {
+
+/**
+ * Sink that records received data to a capture file
+ * Records carry the time the chunk arrived, not when it was consumed.
+ */
+class CaptureSink : public BaseSink {
+    uss::capture::Writer writer;
+
+public:
+    CaptureSink(const char* path) : writer(path) {}
+
+    void Consume(const buffer::Ref& chunk) override {
+        uint64_t timestamp = chunk.Timestamp();
+        if (timestamp == 0)
+            timestamp = timing::Now();
+        writer.Write(uss::capture::Direction::DeviceToHost, timestamp,
+                     chunk.Data(), chunk.Length());
+    }
+
+    void Flush() { writer.Flush(); }
+};
+
+} // namespace capture
+} // namespace output
+} // namespace uss
\ No newline at end of file
@@ -14,12 +14,23 @@
  * - 2022
  */
 #pragma once
+#include "../../buffer.hpp"
 #include "../../device.hpp"
 #include "../../error.hpp"
+#include "../../framer.hpp"
+#include "../../log.hpp"
 #include "../../output.hpp"
+#include "../../recovery.hpp"
+#include "../../rs485.hpp"
+#include "../../stats.hpp"
+#include "../../timing.hpp"
+#include "../../transfer.hpp"
+#include "../../uring.hpp"
+#include <atomic>
 #include <cstddef>
 #include <cstdio>
 #include <cstring>
+#include <mutex>
 #include <string>
 #include <sys/fcntl.h> // F_*
 #include <sys/poll.h>
@@ -35,131 +46,1138 @@ namespace uss {
 namespace output {
 namespace pty {
 
-class PtyError : public std::exception {
+class PtyError : public error::OutputException {
 public:
-    const char* what() const throw() override { return "PTY failure"; }
+    PtyError() : error::OutputException("PTY failure") {}
+};
+
+/**
+ * When data read from the pty is handed to the device
+ */
+enum class FlushPolicy {
+    // Submit whatever a read returned straight away, several transfers deep
+    LowLatency,
+    // Hold data back until flush_bytes are queued or the oldest queued byte
+    // is flush_delay_us old, for fewer and fuller transfers
+    Throughput
+};
+
+struct FlushConfig {
+    FlushPolicy policy = FlushPolicy::LowLatency;
+    uint32_t in_flight = 4;         // TX transfers submitted at once
+    uint32_t flush_bytes = 0;       // Throughput threshold, 0 = full transfer
+    uint32_t flush_delay_us = 1000; // Throughput deadline
+    // Pacing: cap data handed to the device at this much line time (at its
+    // baud rate and framing), so it queues here rather than in the chip's
+    // FIFO. 0 = off, as fast as USB takes it.
+    uint32_t drain_us = 0;
+};
+
+struct TxStats {
+    uint64_t transfers = 0;
+    uint64_t bytes = 0;
+    uint64_t queue_time = 0;     // ns, first byte read -> submit, summed
+    uint64_t max_queue_time = 0; // ns
+    uint64_t wire_time = 0;      // ns, submit -> completion, summed
+    uint64_t max_wire_time = 0;  // ns
+    uint32_t max_in_flight = 0;
+    uint64_t max_backlog = 0; // ns, line time queued in the device at submit
+    uint64_t urgent_transfers = 0; // see PtyOutput::TrySendUrgent
+    uint64_t urgent_bytes = 0;
+    uint64_t preempted = 0;       // TX transfers cancelled for urgent data
+    uint64_t preempted_bytes = 0; // TX data dropped by them, never sent
+};
+
+/**
+ * Where urgent data goes relative to pty data, see PtyOutput::TrySendUrgent
+ */
+enum class UrgentPolicy {
+    // Ahead of pty data not yet submitted, behind transfers in flight
+    Next,
+    // Cancel transfers in flight and drop unsent pty data, so none of it
+    // reaches the device after the urgent data
+    Preempt
+};
+
+/**
+ * RX transfer sizing
+ * Lengths are rounded down to whole packets, 0 is one packet. With
+ * max_length or max_depth above their minimum the transfers adapt: every
+ * window completions they grow (length first, then depth) if at least
+ * grow_percent of them came back full, and shrink (depth first) if they
+ * came back less than shrink_percent filled overall.
+ */
+struct RxConfig {
+    uint32_t min_length = 0;
+    uint32_t max_length = 0; // 0 = min_length
+    uint32_t min_depth = 1;  // RX transfers submitted at once
+    uint32_t max_depth = 1;
+    uint32_t window = 16;
+    uint32_t grow_percent = 90;
+    uint32_t shrink_percent = 25;
+};
+
+struct RxStats {
+    uint64_t transfers = 0;
+    uint64_t bytes = 0;
+    uint64_t full = 0;    // completions that filled their transfer
+    uint64_t grows = 0;   // adaptation decisions
+    uint64_t shrinks = 0; //
+    uint32_t length = 0;  // current transfer length
+    uint32_t depth = 0;   // current transfers submitted at once
+    uint32_t peak_length = 0;
+    uint32_t peak_depth = 0;
+};
+
+struct PtyOutputInstanceData;
+
+#if defined(USS_IO_URING)
+/**
+ * Data the ring read from the pty, not yet copied into a TX slot
+ */
+struct PtyReadChunk {
+    uint16_t id = 0; // provided buffer
+    uint32_t offset = 0;
+    uint32_t length = 0;
+    uint64_t time = 0; // when it was read
+};
+
+/**
+ * Received data waiting for a ring write to the pty
+ */
+struct PtyWrite {
+    buffer::Ref block; // keeps data alive until written
+    const uint8_t* data = NULL;
+    uint32_t length = 0;
+    uint64_t timestamp = 0;
+};
+#endif
+
+struct PtyTxSlot {
+    PtyOutputInstanceData* instance = NULL;
+    struct libusb_transfer* transfer = NULL;
+    buffer::Ref block;
+    bool submitted = false;
+    bool preempted = false; // cancelled to make way for urgent data
+    uint64_t enqueue_time = 0; // first byte queued
+    uint64_t submit_time = 0;
+};
+
+struct PtyRxSlot {
+    PtyOutputInstanceData* instance = NULL;
+    struct libusb_transfer* transfer = NULL;
+    buffer::Ref block;
+    bool parked = false; // held back (not submitted) until recovery is done
 };
 
 struct PtyOutputInstanceData {
+    constexpr static const uint32_t MaxTxTransfers = 8;
+    constexpr static const uint32_t MaxRxTransfers = 8;
+
     // pty
     int mfd = 0, sfd = 0;
 
-    // rx_transfer (usb -> pty)
-    struct libusb_transfer* rx_transfer = NULL;
-    uint8_t rx_buffer[1024] = {0};
+    // device the transfers were submitted to
+    BaseDevice* device = NULL;
 
-    // tx_transfer (pty -> usb)
-    struct libusb_transfer* tx_transfer = NULL;
-    uint8_t tx_buffer[1024] = {0};
-    bool tx_sending = false;
+    // rx transfers (usb -> pty), they complete in submission order
+    PtyRxSlot rx_slots[MaxRxTransfers];
+    std::atomic<uint32_t> rx_active{0}; // slots holding a transfer
+    uint32_t rx_length = 0, rx_min_length = 0, rx_max_length = 0;
+    uint32_t rx_depth = 1;
+    RxConfig rx_config;
+    RxStats rx_stats;
+    uint32_t rx_window = 0, rx_window_full = 0; // completions this window
+    uint64_t rx_window_bytes = 0, rx_window_capacity = 0;
+    std::mutex rx_mutex;
+    stats::Histogram rx_latency; // arrival -> written to the pty, ns
+
+    // fault recovery, see PtyOutput::SetRecoveryConfig
+    recovery::Monitor recovery;
+    std::atomic<bool> recovering{false}; // cancelled transfers are parked
+    std::atomic<uint64_t> rx_last{0}, tx_last{0}; // ns, last completions
+    uint32_t rx_watchdog_ms = 0;
+
+    // tx transfers (pty -> usb), filled one at a time
+    PtyTxSlot tx_slots[MaxTxTransfers];
+    std::atomic<uint32_t> tx_active{0}; // slots holding a transfer
+    uint32_t tx_in_flight = 0;
+    int tx_fill = -1; // slot being filled, -1 for none
+    uint32_t tx_fill_length = 0;
+    uint64_t tx_fill_start = 0;
+    uint32_t tx_length = 0;
+    buffer::Ref tx_carry; // partial frame held back for the next transfer
+    uint32_t tx_carry_length = 0;
     bool tx_allow = true;
+    std::mutex tx_mutex;
+
+    // HandleEvents waits on this while every slot is in flight
+    int tx_wake[2] = {-1, -1};
+    bool tx_waiting = false;
+
+    // urgent lane, one transfer at a time; more urgent data waits in
+    // tx_urgent_queue and goes out when it comes back
+    PtyTxSlot tx_urgent;
+    buffer::Ref tx_urgent_queue;
+    uint32_t tx_urgent_queued = 0;
+    uint64_t tx_urgent_queue_time = 0;
+
+    FlushConfig flush;
+    TxStats tx_stats;
+    uint64_t tx_drain_end = 0; // ns, when the device should have sent it all
+
+    // RTS driven around TX, see PtyOutput::TrySetRs485Config
+    rs485::Toggler rs485;
+    stats::Histogram tx_latency, urgent_latency; // enqueued -> sent, ns
+
+    // optional framing stage
+    BaseFramer* framer = NULL;
 
     std::function<void(int)> transfer_end_callback = NULL;
+
+#if defined(USS_IO_URING)
+    // io_uring backend, see PtyOutput::TryAttach
+    constexpr static const uint16_t ReadBuffers = 8;
+    constexpr static const uint32_t ReadBufferSize = 4096;
+    constexpr static const uint32_t MaxQueuedWrites = 16;
+
+    uring::Loop* loop = NULL;
+    bool tx_reading = false; // pty I/O on the ring is live
+    bool tx_multishot = true;
+    uring::BufferGroup tx_buffers;
+    uring::Operation tx_read;
+    PtyReadChunk tx_chunks[ReadBuffers];
+    uint32_t tx_chunk_head = 0, tx_chunk_count = 0;
+    uring::Operation tx_timer; // Throughput deadline
+    __kernel_timespec tx_timer_ts = {};
+    std::function<void()> tx_resume = NULL;
+
+    // one write in flight, the rest queued in order
+    uring::Operation rx_write, rx_poll;
+    PtyWrite rx_writes[MaxQueuedWrites];
+    uint32_t rx_write_head = 0, rx_write_count = 0;
+#endif
 };
 
-class PtyOutput : public BaseOutput {
+class PtyOutput : public BaseOutput, public BaseSink {
     constexpr static const uint32_t TransferTimeout = 0;
     PtyOutputInstanceData instance;
     std::string location;
     bool retain_pty;
+    bool external_receive = false;
+    uint32_t tx_transfer_size = 0;
+
+    /**
+     * Transfer length for a configured size: whole packets, at least one
+     */
+    static uint32_t TransferLength(uint32_t configured, uint16_t packet_size) {
+        if (configured <= packet_size)
+            return packet_size;
+        return configured / packet_size * packet_size;
+    }
+
+    /**
+     * Write received data to the pty, whole frames only if there's a framer
+     * @param block holds data, kept alive while a ring write is queued
+     * @param timestamp when the data arrived, see timing::Now
+     */
+    static void WriteReceived(PtyOutputInstanceData* instance,
+                              const buffer::Ref& block, const uint8_t* data,
+                              size_t length, uint64_t timestamp) {
+        if (instance->framer != NULL)
+            length = instance->framer->Receive(data, length, &data);
+        if (length == 0)
+            return;
+
+#if defined(USS_IO_URING)
+        if (instance->loop != NULL && instance->loop->OnThread() &&
+            QueueWrite(instance, block, data, length, timestamp))
+            return;
+#endif
+
+        // Write to pty fd
+        write(instance->mfd, data, length);
+        if (timestamp != 0)
+            instance->rx_latency.Record(timing::Now() - timestamp);
+    }
+
+    /**
+     * Submit an RX slot at the current transfer length
+     * Call with rx_mutex held.
+     */
+    static int SubmitReceive(PtyOutputInstanceData* instance,
+                             PtyRxSlot& slot) {
+        uint32_t length = instance->rx_length;
+
+        // Fresh block if the length moved to another size class
+        if (!slot.block || slot.block.Capacity() !=
+                               buffer::Allocator::BlockSize(length))
+            slot.block = buffer::Allocator::Instance().Acquire(length);
+#if defined(USS_IO_URING)
+        // The ring still has to write the block, receive into a fresh one
+        else if (slot.block.Get()->references.load(
+                     std::memory_order_relaxed) > 1)
+            slot.block = buffer::Allocator::Instance().Acquire(length);
+#endif
+
+        BaseDevice* device = instance->device;
+        libusb_fill_bulk_transfer(slot.transfer, device->GetUsbHandle(),
+                                  device->GetInEndpoint(), slot.block.Data(),
+                                  length, ReceiveCallback, &slot,
+                                  TransferTimeout);
+        return device->SubmitTransfer(slot.transfer);
+    }
+
+    /**
+     * Give an RX slot's transfer back. Call with rx_mutex held.
+     */
+    static void ReleaseReceive(PtyOutputInstanceData* instance,
+                               PtyRxSlot& slot) {
+        transfer::Pool::Instance().Release(slot.transfer);
+        slot.transfer = NULL;
+        slot.block.Reset();
+        instance->rx_active--;
+    }
+
+    /**
+     * Submit idle slots until rx_depth are in flight
+     * Call with rx_mutex held.
+     */
+    static void FillReceive(PtyOutputInstanceData* instance) {
+        for (PtyRxSlot& slot : instance->rx_slots) {
+            if (instance->rx_active >= instance->rx_depth)
+                break;
+            if (slot.transfer != NULL)
+                continue;
+
+            slot.instance = instance;
+            slot.transfer = transfer::Pool::Instance().Acquire();
+            instance->rx_active++;
+            int ret = SubmitReceive(instance, slot);
+            if (ret < 0) {
+                USS_LOG_ERROR("Failed to submit RX transfer. code %i (%s)\n",
+                              ret, libusb_error_name(ret));
+                ReleaseReceive(instance, slot);
+                instance->rx_depth = instance->rx_active;
+                break;
+            }
+        }
+
+        if (instance->rx_depth > instance->rx_stats.peak_depth)
+            instance->rx_stats.peak_depth = instance->rx_depth;
+        instance->rx_stats.depth = instance->rx_depth;
+    }
+
+    /**
+     * Count a completion and resize RX once per window
+     * Call with rx_mutex held.
+     */
+    static void AdaptReceive(PtyOutputInstanceData* instance, uint32_t length,
+                             uint32_t actual) {
+        RxConfig& config = instance->rx_config;
+        RxStats& stats = instance->rx_stats;
+        stats.transfers++;
+        stats.bytes += actual;
+        if (actual == length)
+            stats.full++;
+
+        if (instance->rx_max_length == instance->rx_min_length &&
+            config.max_depth <= config.min_depth)
+            return;
+
+        instance->rx_window++;
+        instance->rx_window_bytes += actual;
+        instance->rx_window_capacity += length;
+        if (actual == length)
+            instance->rx_window_full++;
+        if (instance->rx_window < config.window)
+            return;
+
+        uint16_t packet_size = instance->device->GetInEndpointPacketSize();
+        if (instance->rx_window_full * 100 >=
+            config.grow_percent * instance->rx_window) {
+            // Backed up: bigger transfers, then more of them
+            if (instance->rx_length < instance->rx_max_length) {
+                instance->rx_length = instance->rx_length * 2;
+                if (instance->rx_length > instance->rx_max_length)
+                    instance->rx_length = instance->rx_max_length;
+                stats.grows++;
+            } else if (instance->rx_depth < config.max_depth) {
+                instance->rx_depth++;
+                stats.grows++;
+            }
+        } else if (instance->rx_window_bytes * 100 <=
+                   config.shrink_percent * instance->rx_window_capacity) {
+            // Mostly empty: fewer transfers, then smaller ones
+            if (instance->rx_depth > config.min_depth) {
+                instance->rx_depth--;
+                stats.shrinks++;
+            } else if (instance->rx_length > instance->rx_min_length) {
+                instance->rx_length =
+                    instance->rx_length / 2 / packet_size * packet_size;
+                if (instance->rx_length < instance->rx_min_length)
+                    instance->rx_length = instance->rx_min_length;
+                stats.shrinks++;
+            }
+        }
+
+        if (instance->rx_length > stats.peak_length)
+            stats.peak_length = instance->rx_length;
+        stats.length = instance->rx_length;
+        instance->rx_window = 0;
+        instance->rx_window_full = 0;
+        instance->rx_window_bytes = 0;
+        instance->rx_window_capacity = 0;
+    }
 
     // usb [->] PtyOutput -> pty
     static void LIBUSB_CALL ReceiveCallback(struct libusb_transfer* transfer) {
-        PtyOutputInstanceData* instance =
-            (PtyOutputInstanceData*)transfer->user_data;
+        PtyRxSlot* slot = (PtyRxSlot*)transfer->user_data;
+        PtyOutputInstanceData* instance = slot->instance;
 
         if (transfer->status == LIBUSB_TRANSFER_CANCELLED ||
             transfer->status == LIBUSB_TRANSFER_ERROR ||
             transfer->status == LIBUSB_TRANSFER_NO_DEVICE) {
-            printf("RX transfer fail. code %i (%s)\n", transfer->status,
-                   libusb_error_name(transfer->status));
+            // Stopped for recovery, keep what it got and hold the slot
+            if (instance->recovering &&
+                transfer->status != LIBUSB_TRANSFER_NO_DEVICE) {
+                if (transfer->actual_length > 0)
+                    WriteReceived(instance, slot->block, transfer->buffer,
+                                  transfer->actual_length, timing::Now());
+                std::lock_guard<std::mutex> lock(instance->rx_mutex);
+                slot->parked = true;
+                return;
+            }
+
+            USS_LOG_WARN("RX transfer fail. code %i (%s)\n", transfer->status,
+                         libusb_error_name(transfer->status));
 
-            if (transfer->status == LIBUSB_TRANSFER_CANCELLED) {
-                printf("Trying to free cancelled transfer!\n");
-                libusb_free_transfer(transfer);
+            // Transfer is no longer submitted, give it back
+            bool ended;
+            {
+                std::lock_guard<std::mutex> lock(instance->rx_mutex);
+                ReleaseReceive(instance, *slot);
+                ended = instance->rx_active == 0;
             }
 
-            instance->rx_transfer = NULL; // Just assume transfer is gone
-            if (instance->tx_transfer == NULL)
+            if (ended && instance->tx_active == 0)
                 if (instance->transfer_end_callback != NULL)
                     instance->transfer_end_callback(0);
             return;
         }
 
-        // Make sure transfer completed
+        // Stalled, timed out or overflowed, HandleEvents recovers it
         if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
-            printf(
-                "RX transfer unknown fail. Trying to cancel it. code %i (%s)\n",
-                transfer->status, libusb_error_name(transfer->status));
-            libusb_cancel_transfer(instance->rx_transfer);
+            USS_LOG_WARN("RX transfer fault, recovering. code %i (%s)\n",
+                         transfer->status, libusb_error_name(transfer->status));
+            {
+                std::lock_guard<std::mutex> lock(instance->rx_mutex);
+                slot->parked = true;
+            }
+            instance->recovery.Report(recovery::FaultFor(transfer->status),
+                                      transfer->endpoint);
+            Wake(instance);
             return;
         }
 
-        // Write to pty fd
-        write(instance->mfd, instance->rx_buffer, transfer->actual_length);
+        uint64_t now = timing::Now();
+        instance->rx_last.store(now, std::memory_order_relaxed);
+        instance->recovery.Complete(transfer->endpoint);
+        WriteReceived(instance, slot->block, transfer->buffer,
+                      transfer->actual_length, now);
+
+        std::unique_lock<std::mutex> lock(instance->rx_mutex);
+        AdaptReceive(instance, transfer->length, transfer->actual_length);
+
+        // Recovery is stopping RX, hold this one back too
+        if (instance->recovering) {
+            slot->parked = true;
+            return;
+        }
+
+        // Shrunk, this slot goes idle
+        if (instance->rx_active > instance->rx_depth) {
+            ReleaseReceive(instance, *slot);
+            instance->rx_stats.depth = instance->rx_depth;
+            return;
+        }
 
         // Resubmit transfer
-        int ret = libusb_submit_transfer(instance->rx_transfer);
+        int ret = SubmitReceive(instance, *slot);
         if (ret < 0) {
-            printf("Failed to submit RX transfer. Cancelling! code %i (%s)\n",
-                   ret, libusb_error_name(ret));
-            libusb_cancel_transfer(instance->rx_transfer);
+            USS_LOG_ERROR("Failed to resubmit RX transfer. code %i (%s)\n",
+                          ret, libusb_error_name(ret));
+            ReleaseReceive(instance, *slot);
+            bool ended = instance->rx_active == 0;
+            lock.unlock();
+
+            if (ended && instance->tx_active == 0)
+                if (instance->transfer_end_callback != NULL)
+                    instance->transfer_end_callback(0);
+            return;
         }
+
+        // Grown, submit the extra slots
+        if (instance->rx_active < instance->rx_depth)
+            FillReceive(instance);
+    }
+
+    /**
+     * Wake HandleEvents out of its poll
+     */
+    static void Wake(PtyOutputInstanceData* instance) {
+        if (write(instance->tx_wake[1], "", 1) < 0 && errno != EAGAIN)
+            USS_LOG_ERROR("Failed to wake pty output! code %i\n", errno);
     }
 
     // pty [->] PtyOutput -> usb
     static void LIBUSB_CALL TransmitCallback(struct libusb_transfer* transfer) {
-        PtyOutputInstanceData* instance =
-            (PtyOutputInstanceData*)transfer->user_data;
+        PtyTxSlot* slot = (PtyTxSlot*)transfer->user_data;
+        PtyOutputInstanceData* instance = slot->instance;
+        bool urgent = slot == &instance->tx_urgent;
+        bool ended = false, fault = false, rs485 = false;
 
-        if (transfer->status == LIBUSB_TRANSFER_CANCELLED ||
-            transfer->status == LIBUSB_TRANSFER_ERROR ||
-            transfer->status == LIBUSB_TRANSFER_NO_DEVICE) {
-            printf("TX transfer fail. code %i (%s)\n", transfer->status,
-                   libusb_error_name(transfer->status));
+        {
+            std::lock_guard<std::mutex> lock(instance->tx_mutex);
+            bool preempted = slot->preempted;
+            slot->submitted = false;
+            slot->preempted = false;
+            instance->tx_in_flight--;
+
+            if (preempted && instance->tx_allow &&
+                (transfer->status == LIBUSB_TRANSFER_CANCELLED ||
+                 transfer->status == LIBUSB_TRANSFER_ERROR)) {
+                // Made way for urgent data, the slot stays
+                uint32_t dropped =
+                    (uint32_t)(transfer->length - transfer->actual_length);
+                instance->tx_stats.preempted++;
+                instance->tx_stats.preempted_bytes += dropped;
 
-            if (transfer->status == LIBUSB_TRANSFER_CANCELLED) {
-                printf("Trying to free cancelled transfer!\n");
-                libusb_free_transfer(transfer);
+                // Never reaches the line either
+                uint64_t unsent =
+                    (uint64_t)dropped * instance->device->GetCharacterTime();
+                uint64_t now = timing::Now();
+                if (instance->tx_drain_end > now + unsent)
+                    instance->tx_drain_end -= unsent;
+                else
+                    instance->tx_drain_end = now;
+            } else if (instance->recovering &&
+                (transfer->status == LIBUSB_TRANSFER_CANCELLED ||
+                 transfer->status == LIBUSB_TRANSFER_ERROR)) {
+                // Stopped for a reset, the data is gone but the slot stays
+                USS_LOG_WARN("TX transfer dropped for recovery\n");
+            } else if (transfer->status == LIBUSB_TRANSFER_CANCELLED ||
+                       transfer->status == LIBUSB_TRANSFER_ERROR ||
+                       transfer->status == LIBUSB_TRANSFER_NO_DEVICE) {
+                USS_LOG_WARN("TX transfer fail. code %i (%s)\n",
+                             transfer->status,
+                             libusb_error_name(transfer->status));
+
+                // Transfer is no longer submitted, give it back
+                transfer::Pool::Instance().Release(transfer);
+                slot->transfer = NULL;
+                slot->block.Reset();
+
+                ended = --instance->tx_active == 0 &&
+                        instance->rx_active == 0;
+            } else if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+                // Timed out or stalled, the data is gone but the slot is
+                // free for the next transfer once HandleEvents recovered
+                USS_LOG_ERROR(
+                    "TX transfer fault, dropping it. code %i (%s)\n",
+                    transfer->status, libusb_error_name(transfer->status));
+                fault = true;
+            } else {
+                uint64_t now = timing::Now();
+                instance->tx_last.store(now, std::memory_order_relaxed);
+                uint64_t wire_time = now - slot->submit_time;
+                instance->tx_stats.wire_time += wire_time;
+                if (wire_time > instance->tx_stats.max_wire_time)
+                    instance->tx_stats.max_wire_time = wire_time;
+                (urgent ? instance->urgent_latency : instance->tx_latency)
+                    .Record(now - slot->enqueue_time);
+
+                // Come back to drop RTS once the line is done with it
+                uint32_t sent = (uint32_t)transfer->actual_length;
+                rs485 = instance->rs485.Sent(sent, now);
             }
 
-            instance->tx_transfer = NULL; // Just assume transfer is gone
-            if (instance->rx_transfer == NULL)
-                if (instance->transfer_end_callback != NULL)
-                    instance->transfer_end_callback(0);
+            // Urgent data that came in meanwhile goes out now
+            if (urgent && slot->transfer != NULL)
+                SubmitUrgent(instance);
+
+            if (instance->tx_waiting || rs485)
+                Wake(instance);
+        }
+
+        if (fault) {
+            instance->recovery.Report(recovery::FaultFor(transfer->status),
+                                      transfer->endpoint);
+            Wake(instance);
+        } else if (transfer->status == LIBUSB_TRANSFER_COMPLETED) {
+            instance->recovery.Complete(transfer->endpoint);
+        }
+
+#if defined(USS_IO_URING)
+        // A slot came back, carry on with data the ring already read
+        if (instance->loop != NULL && instance->loop->OnThread())
+            instance->tx_resume();
+#endif
+
+        if (ended && instance->transfer_end_callback != NULL)
+            instance->transfer_end_callback(0);
+    }
+
+    /**
+     * Account length bytes handed to the device against its line rate
+     * Call with tx_mutex held.
+     */
+    static void AddBacklog(PtyOutputInstanceData* instance, uint32_t length) {
+        uint64_t now = timing::Now();
+        if (instance->tx_drain_end < now)
+            instance->tx_drain_end = now;
+        else if (instance->tx_drain_end - now > instance->tx_stats.max_backlog)
+            instance->tx_stats.max_backlog = instance->tx_drain_end - now;
+        instance->tx_drain_end +=
+            (uint64_t)length * instance->device->GetCharacterTime();
+    }
+
+    /**
+     * Submit queued urgent data unless the urgent slot is in flight
+     * Call with tx_mutex held.
+     */
+    static void SubmitUrgent(PtyOutputInstanceData* instance) {
+        PtyTxSlot& slot = instance->tx_urgent;
+        if (slot.submitted || instance->tx_urgent_queued == 0 ||
+            !instance->tx_allow || instance->recovering ||
+            instance->device == NULL ||
+            !instance->rs485.Ready(timing::Now()))
             return;
+
+        if (slot.transfer == NULL) {
+            slot.instance = instance;
+            slot.transfer = transfer::Pool::Instance().Acquire();
+            instance->tx_active++;
         }
 
-        // Make sure transfer completed
-        if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
-            printf(
-                "TX transfer unknown fail. Trying to cancel it. code %i (%s)\n",
-                transfer->status, libusb_error_name(transfer->status));
-            libusb_cancel_transfer(instance->tx_transfer);
+        // The queue becomes the transfer's buffer, no copy
+        std::swap(slot.block, instance->tx_urgent_queue);
+        uint32_t len = instance->tx_urgent_queued;
+        instance->tx_urgent_queued = 0;
+        slot.enqueue_time = instance->tx_urgent_queue_time;
+
+        BaseDevice* device = instance->device;
+        libusb_fill_bulk_transfer(slot.transfer, device->GetUsbHandle(),
+                                  device->GetOutEndpoint(), slot.block.Data(),
+                                  (int)len, TransmitCallback, &slot,
+                                  TransferTimeout);
+
+        slot.submit_time = timing::Now();
+        int ret = device->SubmitTransfer(slot.transfer);
+        if (ret < 0) {
+            USS_LOG_ERROR("Failed to submit urgent transfer. code %i (%s)\n",
+                          ret, libusb_error_name(ret));
             return;
         }
 
-        // Turn off sending bool
-        instance->tx_sending = false;
+        slot.submitted = true;
+        instance->tx_in_flight++;
+        AddBacklog(instance, len);
+        instance->tx_stats.urgent_transfers++;
+        instance->tx_stats.urgent_bytes += len;
+        if (instance->tx_in_flight > instance->tx_stats.max_in_flight)
+            instance->tx_stats.max_in_flight = instance->tx_in_flight;
+    }
+
+    /**
+     * poll() with a nanosecond timeout, negative blocks
+     */
+    static int PollFor(pollfd* pfds, nfds_t count, int64_t timeout) {
+#if defined(__linux__)
+        if (timeout < 0)
+            return ppoll(pfds, count, NULL, NULL);
+        struct timespec ts = {(time_t)(timeout / 1000000000),
+                              (long)(timeout % 1000000000)};
+        return ppoll(pfds, count, &ts, NULL);
+#else
+        // Round up, a deadline is never cut short
+        if (timeout < 0)
+            return poll(pfds, count, -1);
+        return poll(pfds, count, (int)((timeout + 999999) / 1000000));
+#endif
+    }
+
+    /**
+     * Pick a free slot to fill, acquiring its transfer if it has none
+     * Carried partial frames go in first. Returns false if every usable
+     * slot is in flight. Call with tx_mutex held.
+     */
+    bool TakeFillSlot() {
+        for (uint32_t i = 0; i < instance.flush.in_flight; i++) {
+            PtyTxSlot& slot = instance.tx_slots[i];
+            if (slot.submitted)
+                continue;
+
+            if (slot.transfer == NULL) {
+                slot.instance = &instance;
+                slot.transfer = transfer::Pool::Instance().Acquire();
+                slot.block =
+                    buffer::Allocator::Instance().Acquire(instance.tx_length);
+                instance.tx_active++;
+            }
+
+            instance.tx_fill = (int)i;
+            instance.tx_fill_length = instance.tx_carry_length;
+            if (instance.tx_carry_length != 0) {
+                memcpy(slot.block.Data(), instance.tx_carry.Data(),
+                       instance.tx_carry_length);
+                instance.tx_fill_start = timing::Now();
+            }
+            instance.tx_carry_length = 0;
+            return true;
+        }
+        return false;
+    }
+
+    /**
+     * Bytes the slot being filled takes, less than a transfer when paced
+     * so one transfer never holds more than drain_us of line time
+     */
+    uint32_t FillLimit() {
+        uint64_t character_time = device->GetCharacterTime();
+        if (instance.flush.drain_us == 0 || character_time == 0)
+            return instance.tx_length;
+
+        uint64_t limit = (uint64_t)instance.flush.drain_us * 1000 /
+                         character_time;
+        if (limit < 1)
+            return 1;
+        if (limit > instance.tx_length)
+            return instance.tx_length;
+        return (uint32_t)limit;
+    }
+
+    /**
+     * Nanoseconds until the device has room for the slot being filled
+     * within drain_us of line time, 0 if it has room or pacing is off
+     */
+    uint64_t PaceWait(uint64_t now) {
+        uint64_t character_time = device->GetCharacterTime();
+        if (instance.flush.drain_us == 0 || character_time == 0)
+            return 0;
+
+        uint64_t backlog =
+            instance.tx_drain_end > now ? instance.tx_drain_end - now : 0;
+        uint64_t queued =
+            backlog + (uint64_t)instance.tx_fill_length * character_time;
+        uint64_t target = (uint64_t)instance.flush.drain_us * 1000;
+        return queued > target ? queued - target : 0;
     }
 
+    /**
+     * Whether the slot being filled should go out now
+     */
+    bool ShouldFlush(const FlushConfig& flush) {
+        if (instance.tx_fill_length == 0)
+            return false;
+        if (PaceWait(timing::Now()) != 0)
+            return false;
+        if (instance.tx_fill_length >= FillLimit())
+            return true;
+        if (flush.policy == FlushPolicy::LowLatency)
+            return true;
+
+        uint32_t threshold = flush.flush_bytes;
+        if (threshold == 0 || threshold > instance.tx_length)
+            threshold = instance.tx_length;
+        return instance.tx_fill_length >= threshold ||
+               timing::Now() - instance.tx_fill_start >=
+                   (uint64_t)flush.flush_delay_us * 1000;
+    }
+
+    /**
+     * Nanoseconds until the slot being filled is due, -1 if it isn't
+     * waiting on the Throughput deadline or the pacer
+     */
+    int64_t FlushTimeout() {
+        if (instance.tx_fill < 0 || instance.tx_fill_length == 0)
+            return -1;
+
+        uint64_t now = timing::Now();
+        uint64_t wait = PaceWait(now);
+        if (instance.flush.policy == FlushPolicy::Throughput) {
+            uint64_t age = now - instance.tx_fill_start;
+            uint64_t delay = (uint64_t)instance.flush.flush_delay_us * 1000;
+            if (age < delay && delay - age > wait)
+                wait = delay - age;
+        }
+        return wait == 0 ? -1 : (int64_t)wait;
+    }
+
+    /**
+     * Move RS-485 RTS along and retry urgent data it held back
+     * Call with tx_mutex held.
+     * @return ns until it's due again, -1 if it waits on a request
+     */
+    int64_t UpdateRs485() {
+        bool idle = instance.tx_in_flight == 0 &&
+                    instance.tx_urgent_queued == 0 &&
+                    (instance.tx_fill < 0 || instance.tx_fill_length == 0) &&
+                    instance.tx_carry_length == 0;
+        int64_t timeout = instance.rs485.Update(idle, timing::Now());
+        SubmitUrgent(&instance);
+        return timeout;
+    }
+
+    /**
+     * The sooner of two timeouts, -1 being none
+     */
+    static int64_t Sooner(int64_t a, int64_t b) {
+        if (a < 0)
+            return b;
+        if (b < 0)
+            return a;
+        return a < b ? a : b;
+    }
+
+    /**
+     * Submit the slot being filled. Call with tx_mutex held.
+     */
+    void SubmitFill() {
+        PtyTxSlot& slot = instance.tx_slots[instance.tx_fill];
+        uint8_t* data = slot.block.Data();
+        uint32_t len = instance.tx_fill_length;
+
+        // RS-485 needs RTS up first, the fill waits for it
+        if (device != NULL && !instance.rs485.Ready(timing::Now()))
+            return;
+
+        // Don't split a frame across transfers
+        if (instance.framer != NULL) {
+            size_t boundary = instance.framer->TransmitBoundary(data, len);
+            // A full buffer with no boundary in it goes out as is
+            if (boundary == 0 && len >= FillLimit())
+                boundary = len;
+            // Nothing whole yet, keep filling
+            if (boundary == 0)
+                return;
+
+            instance.tx_carry_length = len - (uint32_t)boundary;
+            memcpy(instance.tx_carry.Data(), data + boundary,
+                   instance.tx_carry_length);
+            len = (uint32_t)boundary;
+        }
+
+        instance.tx_fill = -1;
+
+        // Make sure device still exists before sending
+        if (device == NULL)
+            return;
+
+        libusb_fill_bulk_transfer(slot.transfer, device->GetUsbHandle(),
+                                  device->GetOutEndpoint(), data, (int)len,
+                                  TransmitCallback, &slot, TransferTimeout);
+
+        slot.enqueue_time = instance.tx_fill_start;
+        slot.submit_time = timing::Now();
+        int ret = device->SubmitTransfer(slot.transfer);
+        if (ret < 0) {
+            USS_LOG_ERROR("Failed to submit TX transfer. code %i (%s)\n", ret,
+                          libusb_error_name(ret));
+            return;
+        }
+
+        slot.submitted = true;
+        instance.tx_in_flight++;
+        AddBacklog(&instance, len);
+
+        TxStats& stats = instance.tx_stats;
+        uint64_t queue_time = slot.submit_time - instance.tx_fill_start;
+        stats.transfers++;
+        stats.bytes += len;
+        stats.queue_time += queue_time;
+        if (queue_time > stats.max_queue_time)
+            stats.max_queue_time = queue_time;
+        if (instance.tx_in_flight > stats.max_in_flight)
+            stats.max_in_flight = instance.tx_in_flight;
+    }
+
+#if defined(USS_IO_URING)
+    /**
+     * Queue received data for a ring write, see WriteReceived
+     * Data outside block is copied. Returns false to write it directly.
+     */
+    static bool QueueWrite(PtyOutputInstanceData* instance,
+                           const buffer::Ref& block, const uint8_t* data,
+                           size_t length, uint64_t timestamp) {
+        constexpr uint32_t Max = PtyOutputInstanceData::MaxQueuedWrites;
+        if (instance->mfd == 0)
+            return true;
+        if (instance->rx_write_count == Max) {
+            // The pty isn't being read, like a full pty on write()
+            USS_LOG_DEBUG("pty write queue full, dropping %zu bytes\n",
+                          length);
+            return true;
+        }
+
+        PtyWrite& entry =
+            instance->rx_writes[(instance->rx_write_head +
+                                 instance->rx_write_count) %
+                                Max];
+        if (block && data >= block.Data() &&
+            data + length <= block.Data() + block.Capacity()) {
+            entry.block = block;
+        } else {
+            if (length > buffer::Allocator::MaxBlockSize())
+                return false;
+            entry.block = buffer::Allocator::Instance().Acquire(length);
+            memcpy(entry.block.Data(), data, length);
+            data = entry.block.Data();
+        }
+        entry.data = data;
+        entry.length = (uint32_t)length;
+        entry.timestamp = timestamp;
+
+        if (instance->rx_write_count++ == 0)
+            SubmitWrite(instance, false);
+        return true;
+    }
+
+    /**
+     * Write the oldest queued data
+     * @param wait_writable poll for room first, after a short write
+     */
+    static void SubmitWrite(PtyOutputInstanceData* instance,
+                            bool wait_writable) {
+        uring::Ring& ring = instance->loop->GetRing();
+        PtyWrite& entry = instance->rx_writes[instance->rx_write_head];
+
+        if (!ring.Reserve(wait_writable ? 2 : 1)) {
+            USS_LOG_ERROR("io_uring SQ full, dropping pty write\n");
+            return;
+        }
+
+        io_uring_sqe* sqe;
+        if (wait_writable) {
+            sqe = ring.Sqe(&instance->rx_poll);
+            sqe->opcode = IORING_OP_POLL_ADD;
+            sqe->fd = instance->mfd;
+            sqe->poll32_events = POLLOUT;
+            sqe->flags = IOSQE_IO_LINK;
+        }
+
+        sqe = ring.Sqe(&instance->rx_write);
+        int index = ring.FixedIndex(entry.data, entry.length);
+        if (index >= 0) {
+            sqe->opcode = IORING_OP_WRITE_FIXED;
+            sqe->buf_index = (uint16_t)index;
+        } else {
+            sqe->opcode = IORING_OP_WRITE;
+        }
+        sqe->fd = instance->mfd;
+        sqe->addr = (uint64_t)(uintptr_t)entry.data;
+        sqe->len = entry.length;
+        sqe->off = (uint64_t)-1;
+    }
+
+    static void WriteComplete(PtyOutputInstanceData* instance, int32_t res) {
+        constexpr uint32_t Max = PtyOutputInstanceData::MaxQueuedWrites;
+        PtyWrite& entry = instance->rx_writes[instance->rx_write_head];
+
+        if (res > 0) {
+            entry.data += res;
+            entry.length -= (uint32_t)res;
+        } else if (res != 0 && res != -EAGAIN && res != -EINTR) {
+            // Cancelled with the pty, or the pty is gone
+            if (res != -ECANCELED)
+                USS_LOG_ERROR("Error writing to pty fd! code %i\n", -res);
+            entry.length = 0;
+            entry.timestamp = 0;
+        }
+
+        // ttys don't wait for room on the ring, poll for it and go again
+        if (entry.length != 0) {
+            SubmitWrite(instance, true);
+            return;
+        }
+
+        if (entry.timestamp != 0)
+            instance->rx_latency.Record(timing::Now() - entry.timestamp);
+        entry.block.Reset();
+        instance->rx_write_head = (instance->rx_write_head + 1) % Max;
+        if (--instance->rx_write_count != 0)
+            SubmitWrite(instance, false);
+    }
+
+    /**
+     * Keep a read of the pty on the ring while there are buffers for it
+     */
+    void ArmRead() {
+        if (!instance.tx_reading || instance.tx_read.pending != 0 ||
+            instance.tx_chunk_count == PtyOutputInstanceData::ReadBuffers)
+            return;
+
+        io_uring_sqe* sqe = instance.loop->GetRing().Sqe(&instance.tx_read);
+        if (sqe == NULL) {
+            USS_LOG_ERROR("io_uring SQ full, can't read pty\n");
+            return;
+        }
+        sqe->opcode = instance.tx_multishot ? uring::OpReadMultishot
+                                            : (uint8_t)IORING_OP_READ;
+        sqe->fd = instance.mfd;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = instance.tx_buffers.Group();
+        sqe->off = (uint64_t)-1;
+        if (!instance.tx_multishot)
+            sqe->len = PtyOutputInstanceData::ReadBufferSize;
+    }
+
+    void ReadComplete(int32_t res, uint32_t flags) {
+        if (flags & IORING_CQE_F_BUFFER) {
+            uint16_t id = (uint16_t)(flags >> IORING_CQE_BUFFER_SHIFT);
+            if (res > 0) {
+                PtyReadChunk& chunk =
+                    instance.tx_chunks[(instance.tx_chunk_head +
+                                        instance.tx_chunk_count++) %
+                                       PtyOutputInstanceData::ReadBuffers];
+                chunk.id = id;
+                chunk.offset = 0;
+                chunk.length = (uint32_t)res;
+                chunk.time = timing::Now();
+            } else {
+                instance.tx_buffers.Recycle(id);
+            }
+        } else if (res == -EINVAL && instance.tx_multishot) {
+            USS_LOG_INFO("No multishot reads, reading once per submission\n");
+            instance.tx_multishot = false;
+        } else if (res < 0 && res != -ENOBUFS && res != -ECANCELED &&
+                   res != -EAGAIN && res != -EINTR) {
+            // Don't spin on a broken pty, SetDevice starts reading again
+            USS_LOG_ERROR("Error reading from pty fd! code %i\n", -res);
+            instance.tx_reading = false;
+        }
+
+        FeedTransmit();
+    }
+
+    /**
+     * Move data the ring read into TX slots and submit what's due
+     * The ring counterpart of HandleEvents.
+     */
+    void FeedTransmit() {
+        constexpr uint32_t Buffers = PtyOutputInstanceData::ReadBuffers;
+        {
+            std::lock_guard<std::mutex> lock(instance.tx_mutex);
+            while (instance.tx_chunk_count != 0 && instance.tx_allow) {
+                if (instance.tx_fill < 0 && !TakeFillSlot())
+                    break; // every slot in flight, TransmitCallback resumes
+
+                PtyReadChunk& chunk =
+                    instance.tx_chunks[instance.tx_chunk_head];
+                PtyTxSlot& slot = instance.tx_slots[instance.tx_fill];
+                uint32_t limit = FillLimit();
+                if (instance.tx_fill_length >= limit)
+                    break; // held back by the pacer, the timer resumes
+                uint32_t length = limit - instance.tx_fill_length;
+                if (length > chunk.length)
+                    length = chunk.length;
+
+                memcpy(slot.block.Data() + instance.tx_fill_length,
+                       instance.tx_buffers.Data(chunk.id) + chunk.offset,
+                       length);
+                if (instance.tx_fill_length == 0)
+                    instance.tx_fill_start = chunk.time;
+                instance.tx_fill_length += length;
+                chunk.offset += length;
+                chunk.length -= length;
+
+                if (chunk.length == 0) {
+                    instance.tx_buffers.Recycle(chunk.id);
+                    instance.tx_chunk_head =
+                        (instance.tx_chunk_head + 1) % Buffers;
+                    instance.tx_chunk_count--;
+                }
+
+                if (ShouldFlush(instance.flush))
+                    SubmitFill();
+            }
+
+            // Deadline may have passed with nothing new read
+            if (instance.tx_fill >= 0 && instance.tx_allow &&
+                ShouldFlush(instance.flush))
+                SubmitFill();
+
+            // Come back when the oldest byte is due, the pacer allows or
+            // RTS is due to change
+            int64_t timeout =
+                instance.tx_allow ? Sooner(FlushTimeout(), UpdateRs485()) : -1;
+            if (timeout > 0 && instance.tx_reading &&
+                instance.tx_timer.pending == 0) {
+                io_uring_sqe* sqe =
+                    instance.loop->GetRing().Sqe(&instance.tx_timer);
+                if (sqe != NULL) {
+                    instance.tx_timer_ts.tv_sec =
+                        (int64_t)(timeout / 1000000000);
+                    instance.tx_timer_ts.tv_nsec =
+                        (long long)(timeout % 1000000000);
+                    sqe->opcode = IORING_OP_TIMEOUT;
+                    sqe->addr = (uint64_t)(uintptr_t)&instance.tx_timer_ts;
+                    sqe->len = 1;
+                }
+            }
+        }
+
+        ArmRead();
+    }
+
+    /**
+     * Stop ring I/O on the current pty, completions still arrive
+     */
+    void CancelRingIo() {
+        constexpr uint32_t Max = PtyOutputInstanceData::MaxQueuedWrites;
+        uring::Ring& ring = instance.loop->GetRing();
+
+        instance.tx_reading = false;
+        ring.Cancel(&instance.tx_read);
+        ring.Cancel(&instance.tx_timer);
+
+        // Whatever was read or queued belongs to the old pty
+        while (instance.tx_chunk_count != 0) {
+            instance.tx_buffers.Recycle(
+                instance.tx_chunks[instance.tx_chunk_head].id);
+            instance.tx_chunk_head = (instance.tx_chunk_head + 1) %
+                                     PtyOutputInstanceData::ReadBuffers;
+            instance.tx_chunk_count--;
+        }
+        while (instance.rx_write_count > 1) {
+            instance.rx_write_count--;
+            instance
+                .rx_writes[(instance.rx_write_head + instance.rx_write_count) %
+                           Max]
+                .block.Reset();
+        }
+        ring.Cancel(&instance.rx_poll);
+        ring.Cancel(&instance.rx_write);
+    }
+#endif
+
     /**
      * Create basic pty @ instance.mfd, instance.sfd
      */
-    void CreatePty() {
+    error::Result CreatePty() {
         int ret;
 
         if (instance.mfd != 0) {
-            printf("Can't open pty with already existing pty!\n");
-            return;
+            USS_LOG_WARN("Can't open pty with already existing pty!\n");
+            return error::Result::Ok();
         }
 
         // Open pty
         ret = openpty(&instance.mfd, &instance.sfd, NULL, NULL, NULL);
         if (ret != 0)
-            throw PtyError();
+            return error::Result::Fail(error::Code::Output, "PTY failure");
 
-        printf("new pty@%i\n", instance.mfd);
+        USS_LOG_INFO("new pty@%i\n", instance.mfd);
 
         // Configure pty
         struct termios config;
@@ -178,128 +1196,693 @@ class PtyOutput : public BaseOutput {
         // Chmod sfd
         ret = fchmod(instance.sfd, S_IRWXU | S_IRWXG | S_IRWXO);
         if (ret != 0)
-            printf("fchmod failure! code %i\n", ret);
+            USS_LOG_WARN("fchmod failure! code %i\n", ret);
 
         // Remove past symlink
         ret = unlink(location.c_str());
         if (ret != 0)
-            printf("unlink failure! code %i\n", ret);
+            USS_LOG_WARN("unlink failure! code %i\n", ret);
 
         // Create new symlink
         ret = symlink(ptsname(instance.mfd), location.c_str());
         if (ret != 0)
-            printf("symlink failure! code %i\n", ret);
+            USS_LOG_WARN("symlink failure! code %i\n", ret);
+
+        return error::Result::Ok();
     }
 
     /**
      * Close open pty
      */
     void ClosePty() {
+#if defined(USS_IO_URING)
+        if (instance.loop != NULL)
+            CancelRingIo();
+#endif
+
         // Close previous pty
         if (instance.mfd != 0)
             close(instance.mfd);
         else
-            printf("No pty open to close!\n");
+            USS_LOG_WARN("No pty open to close!\n");
         instance.mfd = 0;
         instance.sfd = 0;
     }
 
+    /**
+     * Report silent RX if a TX completed rx_watchdog_ms ago with nothing
+     * received since
+     * @return ns until it would fire, 0 if it fired, -1 if it isn't armed
+     */
+    int64_t CheckWatchdog() {
+        if (instance.rx_watchdog_ms == 0 || instance.recovery.Pending())
+            return -1;
+
+        uint64_t tx_last = instance.tx_last.load(std::memory_order_relaxed);
+        if (tx_last <= instance.rx_last.load(std::memory_order_relaxed))
+            return -1;
+
+        uint64_t now = timing::Now();
+        uint64_t limit = (uint64_t)instance.rx_watchdog_ms * 1000000;
+        if (now - tx_last < limit)
+            return (int64_t)(limit - (now - tx_last));
+
+        USS_LOG_WARN("No RX for %u ms after TX, recovering\n",
+                     instance.rx_watchdog_ms);
+        instance.rx_last.store(now, std::memory_order_relaxed);
+        instance.recovery.Report(recovery::Fault::Silent,
+                                 device->GetInEndpoint());
+        return 0; // Recover on the next round
+    }
+
+    /**
+     * Wait until every RX slot is parked, and for a reset until no TX is
+     * in flight either
+     */
+    bool WaitForStop(bool transmit, uint32_t timeout_ms) {
+        uint64_t deadline = timing::Now() + (uint64_t)timeout_ms * 1000000;
+        while (true) {
+            bool stopped = true;
+            {
+                std::lock_guard<std::mutex> lock(instance.rx_mutex);
+                for (PtyRxSlot& slot : instance.rx_slots)
+                    if (slot.transfer != NULL && !slot.parked)
+                        stopped = false;
+            }
+            if (transmit) {
+                std::lock_guard<std::mutex> lock(instance.tx_mutex);
+                if (instance.tx_in_flight != 0)
+                    stopped = false;
+            }
+
+            if (stopped)
+                return true;
+            if (timing::Now() > deadline)
+                return false;
+            usleep(1000);
+        }
+    }
+
+    /**
+     * Run a pending recovery step, from HandleEvents
+     * Callbacks only report faults; clearing a halt or resetting takes
+     * synchronous control requests, which can't run on the event thread.
+     * RX is stopped and parked meanwhile, then resubmitted in order.
+     */
+    void Recover() {
+        recovery::Action action = instance.recovery.Next();
+        if (action == recovery::Action::None)
+            return;
+
+        error::Result result;
+        if (action == recovery::Action::Fail) {
+            result = error::Result::Fail(error::Code::Output,
+                                         "Transfer fault not recovered");
+        } else {
+            bool reset = action == recovery::Action::Reset;
+            instance.recovering = true;
+
+            libusb_transfer* cancel[PtyOutputInstanceData::MaxTxTransfers + 1];
+            uint32_t cancel_count = 0;
+            if (reset) {
+                std::lock_guard<std::mutex> lock(instance.tx_mutex);
+                for (PtyTxSlot& slot : instance.tx_slots)
+                    if (slot.submitted)
+                        cancel[cancel_count++] = slot.transfer;
+                if (instance.tx_urgent.submitted)
+                    cancel[cancel_count++] = instance.tx_urgent.transfer;
+            }
+            {
+                std::lock_guard<std::mutex> lock(instance.rx_mutex);
+                for (PtyRxSlot& slot : instance.rx_slots)
+                    if (slot.transfer != NULL && !slot.parked)
+                        device->CancelTransfer(slot.transfer);
+            }
+            for (uint32_t i = 0; i < cancel_count; i++)
+                device->CancelTransfer(cancel[i]);
+
+            const recovery::RecoveryConfig config =
+                instance.recovery.GetConfig();
+            if (!WaitForStop(reset, config.drain_timeout_ms))
+                result = error::Result::Fail(error::Code::Output,
+                                             "Transfers didn't stop");
+            else if (reset)
+                result = instance.recovery.TryReset(*device);
+            else
+                result = instance.recovery.TryClearHalt(*device);
+
+            // Driver init raised RTS again
+            if (reset && result)
+                result = instance.rs485.TryStart(*device);
+            instance.recovering = false;
+        }
+
+        if (!result) {
+            USS_LOG_ERROR("Recovery failed, ending transfers: %s\n",
+                          result.message);
+            instance.recovery.Fail();
+            EndTransfers();
+            return;
+        }
+
+        USS_LOG_INFO("%s, resubmitting RX\n",
+                     action == recovery::Action::Reset ? "Device reset"
+                                                       : "Endpoint cleared");
+        {
+            std::lock_guard<std::mutex> lock(instance.tx_mutex);
+            SubmitUrgent(&instance);
+        }
+
+        bool ended = false;
+        {
+            std::lock_guard<std::mutex> lock(instance.rx_mutex);
+            for (PtyRxSlot& slot : instance.rx_slots) {
+                if (slot.transfer == NULL || !slot.parked)
+                    continue;
+                slot.parked = false;
+                if (!instance.tx_allow || SubmitReceive(&instance, slot) < 0)
+                    ReleaseReceive(&instance, slot);
+            }
+            ended = instance.rx_active == 0 && instance.tx_active == 0;
+        }
+        if (ended && instance.transfer_end_callback != NULL)
+            instance.transfer_end_callback(0);
+    }
+
 public:
     PtyOutput(BaseDevice* _device, const char* _location,
               bool _retain_pty = false)
         : BaseOutput(_device), location(_location), retain_pty(_retain_pty) {
 
-        CreatePty();
+        if (pipe(instance.tx_wake) != 0)
+            error::Throw(PtyError());
+        for (int fd : instance.tx_wake)
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+        // An RTS request came back, carry on with TX
+        PtyOutputInstanceData* data = &instance;
+        instance.rs485.SetWake([data]() {
+#if defined(USS_IO_URING)
+            if (data->loop != NULL && data->loop->OnThread()) {
+                data->tx_resume();
+                return;
+            }
+#endif
+            Wake(data);
+        });
+
+        if (!CreatePty())
+            error::Throw(PtyError());
         SetDevice(device);
     }
 
+    ~PtyOutput() {
+#if defined(USS_IO_URING)
+        Detach();
+#endif
+        close(instance.tx_wake[0]);
+        close(instance.tx_wake[1]);
+    }
+
     void HandleEvents() override {
-        if (device == NULL)
+#if defined(USS_IO_URING)
+        // The ring does the work, sleep until woken
+        if (instance.loop != NULL) {
+            int64_t timeout = -1;
+            if (device != NULL) {
+                Recover();
+                timeout = CheckWatchdog();
+            }
+
+            pollfd wake = {instance.tx_wake[0], POLLIN, 0};
+            PollFor(&wake, 1, timeout);
+            uint8_t drain[16];
+            while (read(instance.tx_wake[0], drain, sizeof(drain)) > 0)
+                ;
             return;
+        }
+#endif
 
-        if (instance.tx_sending)
+        if (device == NULL)
             return;
 
+        Recover();
+
         if (!instance.tx_allow)
             return;
 
-        ssize_t len;
-        pollfd pfds[1] = {{instance.mfd, POLLIN, 0}};
+        pollfd pfds[2] = {{instance.mfd, POLLIN, 0},
+                          {instance.tx_wake[0], POLLIN, 0}};
+        pollfd* wait = pfds;
+        nfds_t count = 2;
+        int64_t timeout = -1;
 
-        // Poll pty fd
-        poll(pfds, 1, -1);
-        if (!(pfds->revents & POLLIN))
-            return;
+        {
+            std::lock_guard<std::mutex> lock(instance.tx_mutex);
+            if (instance.tx_fill < 0 && !TakeFillSlot()) {
+                // Every transfer is in flight, wait for one to come back
+                instance.tx_waiting = true;
+                wait = &pfds[1];
+                count = 1;
+            } else {
+                // Wait for more data until the oldest byte is due, or for
+                // the pacer
+                timeout = FlushTimeout();
+                if (instance.tx_fill_length >= FillLimit()) {
+                    wait = &pfds[1];
+                    count = 1;
+                }
+            }
+            timeout = Sooner(timeout, UpdateRs485());
+        }
 
-        // Read from pty fd into buffer queue
-        len = read(instance.mfd, instance.tx_buffer,
-                   device->GetOutEndpointPacketSize());
+        // Wake up for the RX watchdog too
+        int64_t watchdog = CheckWatchdog();
+        if (watchdog >= 0 && (timeout < 0 || watchdog < timeout))
+            timeout = watchdog;
 
-        if (len == -1) {
-            if (errno != EAGAIN)
-                printf("Error reading from pty fd! code %i\n", errno);
-            return;
+        // Poll pty fd
+        PollFor(wait, count, timeout);
+
+        // Drain wakeups
+        if (pfds[1].revents & POLLIN) {
+            uint8_t drain[16];
+            while (read(instance.tx_wake[0], drain, sizeof(drain)) > 0)
+                ;
         }
 
-        if (len == 0)
+        std::lock_guard<std::mutex> lock(instance.tx_mutex);
+        instance.tx_waiting = false;
+        if (instance.tx_fill < 0 || !instance.tx_allow)
             return;
 
-        // Make sure device still exists before sending
-        if (device == NULL)
-            return;
+        uint32_t limit = FillLimit();
+        if ((pfds[0].revents & POLLIN) && instance.tx_fill_length < limit) {
+            // Read from pty fd into the slot being filled
+            PtyTxSlot& slot = instance.tx_slots[instance.tx_fill];
+            ssize_t len = read(instance.mfd,
+                               slot.block.Data() + instance.tx_fill_length,
+                               limit - instance.tx_fill_length);
+
+            if (len == -1) {
+                if (errno != EAGAIN)
+                    USS_LOG_ERROR("Error reading from pty fd! code %i\n",
+                                  errno);
+            } else if (len > 0) {
+                if (instance.tx_fill_length == 0)
+                    instance.tx_fill_start = timing::Now();
+                instance.tx_fill_length += (uint32_t)len;
+            }
+        }
 
         // Send to USB
-        if (!instance.tx_allow)
-            return;
+        if (ShouldFlush(instance.flush))
+            SubmitFill();
+    }
 
-        instance.tx_sending = true;
-        libusb_fill_bulk_transfer(instance.tx_transfer, device->GetUsbHandle(),
-                                  device->GetOutEndpoint(), instance.tx_buffer,
-                                  (int)len, TransmitCallback, &instance,
-                                  TransferTimeout);
+    error::Result TrySetDevice(BaseDevice* _device) override {
+        if (_device == NULL)
+            return error::Result::Ok();
+        device = _device;
+        instance.device = _device;
 
-        int ret = libusb_submit_transfer(instance.tx_transfer);
-        if (ret < 0) {
-            printf("Failed to submit TX transfer. code %i (%s)\n", ret,
-                   libusb_error_name(ret));
+        // Attempt to create pty
+        USS_TRY(CreatePty());
+
+        // Take transfers and buffers from the shared pools
+        uint32_t tx_length = TransferLength(tx_transfer_size,
+                                            device->GetOutEndpointPacketSize());
+        if (tx_length > buffer::Allocator::MaxBlockSize())
+            return error::Result::Fail(error::Code::Output,
+                                       "TX transfer size too large",
+                                       (int)tx_length);
+
+        {
+            std::lock_guard<std::mutex> lock(instance.tx_mutex);
+            instance.tx_length = tx_length;
+
+            // Slots get their transfers when first filled, resize any kept
+            for (PtyTxSlot& slot : instance.tx_slots)
+                if (slot.transfer != NULL && !slot.submitted)
+                    slot.block =
+                        buffer::Allocator::Instance().Acquire(tx_length);
+
+            // Urgent data is taken again once TX is allowed, at the new size
+            instance.tx_urgent_queue.Reset();
+            instance.tx_urgent_queued = 0;
+            if (!instance.tx_urgent.submitted)
+                instance.tx_urgent.block.Reset();
+
+            // Partial frames from before the reconnect are stale
+            instance.tx_fill = -1;
+            instance.tx_carry_length = 0;
+            if (instance.framer != NULL) {
+                instance.framer->Reset();
+                instance.tx_carry =
+                    buffer::Allocator::Instance().Acquire(tx_length);
+            }
+
+            // Allow tx transfers again
+            instance.tx_allow = true;
+        }
+
+        // Drop RTS until there's something to send
+        USS_TRY(instance.rs485.TryStart(*device));
+
+#if defined(USS_IO_URING)
+        if (instance.loop != NULL) {
+            instance.tx_reading = true;
+            FeedTransmit();
         }
+#endif
+
+        // Received data comes in through Consume instead
+        if (external_receive)
+            return error::Result::Ok();
+
+        std::lock_guard<std::mutex> lock(instance.rx_mutex);
+        if (instance.rx_active != 0) {
+            USS_LOG_WARN("RX transfer still active, not resubmitting!\n");
+            return error::Result::Ok();
+        }
+
+        // Start small, AdaptReceive grows it if the device keeps up
+        const RxConfig& config = instance.rx_config;
+        uint16_t packet_size = device->GetInEndpointPacketSize();
+        instance.rx_min_length = TransferLength(config.min_length, packet_size);
+        instance.rx_max_length = TransferLength(config.max_length, packet_size);
+        if (instance.rx_max_length < instance.rx_min_length)
+            instance.rx_max_length = instance.rx_min_length;
+        if (instance.rx_max_length > buffer::Allocator::MaxBlockSize())
+            return error::Result::Fail(error::Code::Output,
+                                       "RX transfer size too large",
+                                       (int)instance.rx_max_length);
+        instance.rx_length = instance.rx_min_length;
+        instance.rx_depth = config.min_depth;
+        for (PtyRxSlot& slot : instance.rx_slots)
+            slot.parked = false;
+
+        // An incident from before the reconnect is over, one way or another
+        instance.recovery.Fail();
+        instance.rx_last = 0;
+        instance.tx_last = 0;
+        instance.rx_window = 0;
+        instance.rx_window_full = 0;
+        instance.rx_window_bytes = 0;
+        instance.rx_window_capacity = 0;
+        instance.rx_stats.length = instance.rx_length;
+        if (instance.rx_length > instance.rx_stats.peak_length)
+            instance.rx_stats.peak_length = instance.rx_length;
+
+        // Submit rx transfers
+        FillReceive(&instance);
+        if (instance.rx_active == 0)
+            return error::Result::Fail(error::Code::LibUsb,
+                                       "Failed to submit transfer");
+
+        return error::Result::Ok();
     }
 
-    void SetDevice(BaseDevice* _device) override {
-        if (_device == NULL)
+#if defined(USS_IO_URING)
+    /**
+     * Do pty I/O on loop's io_uring instead of in HandleEvents
+     * The pty is read with a multishot read into provided buffers and
+     * received data goes out as ring writes, fixed writes if the block is
+     * registered (see Ring::TryRegisterBuffers), so a round of the loop
+     * costs one syscall however many outputs are attached. Attach from the
+     * loop's thread before HandleEvents runs; SetDevice, RemoveDevice,
+     * EndTransfers and the device's transfers must be handled there too.
+     * HandleEvents only sleeps while attached.
+     */
+    error::Result TryAttach(uring::Loop* loop) {
+        if (instance.loop != NULL)
+            return error::Result::Ok();
+
+        USS_TRY(instance.tx_buffers.TrySetUp(
+            loop->GetRing(), PtyOutputInstanceData::ReadBuffers,
+            PtyOutputInstanceData::ReadBufferSize));
+
+        PtyOutputInstanceData* data = &instance;
+        instance.tx_read.complete = [this](int32_t res, uint32_t flags) {
+            ReadComplete(res, flags);
+        };
+        instance.tx_timer.complete = [this](int32_t res, uint32_t flags) {
+            FeedTransmit();
+        };
+        instance.tx_resume = [this]() { FeedTransmit(); };
+        instance.rx_write.complete = [data](int32_t res, uint32_t flags) {
+            WriteComplete(data, res);
+        };
+        instance.loop = loop;
+
+        if (device != NULL) {
+            instance.tx_reading = true;
+            FeedTransmit();
+        }
+        Wake(&instance);
+        return error::Result::Ok();
+    }
+
+    void Attach(uring::Loop* loop) { error::Raise(TryAttach(loop)); }
+
+    /**
+     * Go back to HandleEvents, from the loop's thread
+     * Waits for the ring to finish with this output; queued writes are
+     * dropped.
+     */
+    void Detach() {
+        if (instance.loop == NULL)
             return;
-        device = _device;
 
-        int ret;
+        uring::Ring& ring = instance.loop->GetRing();
+        CancelRingIo();
+        while (instance.tx_read.pending != 0 ||
+               instance.tx_timer.pending != 0 ||
+               instance.rx_poll.pending != 0 ||
+               instance.rx_write.pending != 0) {
+            ring.Enter(1);
+            ring.Reap();
+        }
 
-        // Attempt to create pty
-        CreatePty();
+        instance.tx_buffers.TearDown();
+        instance.loop = NULL;
+        Wake(&instance);
+    }
+#endif
+
+    /**
+     * Set transfer sizes in bytes, rounded down to whole packets
+     * Bigger RX transfers let the device send several packets per
+     * completion. 0 (default) is a single packet. Applies from SetDevice.
+     * Fixes the RX length, see SetRxConfig to let it adapt.
+     */
+    void SetTransferSize(uint32_t rx_size, uint32_t tx_size) {
+        {
+            std::lock_guard<std::mutex> lock(instance.rx_mutex);
+            instance.rx_config.min_length = rx_size;
+            instance.rx_config.max_length = rx_size;
+        }
+        tx_transfer_size = tx_size;
+    }
 
-        // Allocate transfers
-        instance.rx_transfer = libusb_alloc_transfer(0);
-        instance.tx_transfer = libusb_alloc_transfer(0);
+    /**
+     * Bounds for RX transfer length and depth, see RxConfig
+     * Depths are clamped to 1..MaxRxTransfers. Applies from SetDevice.
+     */
+    void SetRxConfig(const RxConfig& config) {
+        std::lock_guard<std::mutex> lock(instance.rx_mutex);
+        instance.rx_config = config;
+        RxConfig& clamped = instance.rx_config;
+        if (clamped.min_depth < 1)
+            clamped.min_depth = 1;
+        if (clamped.min_depth > PtyOutputInstanceData::MaxRxTransfers)
+            clamped.min_depth = PtyOutputInstanceData::MaxRxTransfers;
+        if (clamped.max_depth < clamped.min_depth)
+            clamped.max_depth = clamped.min_depth;
+        if (clamped.max_depth > PtyOutputInstanceData::MaxRxTransfers)
+            clamped.max_depth = PtyOutputInstanceData::MaxRxTransfers;
+        if (clamped.window < 1)
+            clamped.window = 1;
+    }
 
-        // Set up transfers
-        if (device->GetInEndpointPacketSize() > sizeof(instance.rx_buffer))
-            throw PtyError();
-        if (device->GetOutEndpointPacketSize() > sizeof(instance.tx_buffer))
-            throw PtyError();
+    RxConfig GetRxConfig() {
+        std::lock_guard<std::mutex> lock(instance.rx_mutex);
+        return instance.rx_config;
+    }
+
+    /**
+     * RX totals and the current length and depth picked by adaptation
+     */
+    RxStats GetRxStats() {
+        std::lock_guard<std::mutex> lock(instance.rx_mutex);
+        return instance.rx_stats;
+    }
 
-        libusb_fill_bulk_transfer(instance.rx_transfer, device->GetUsbHandle(),
-                                  device->GetInEndpoint(), instance.rx_buffer,
-                                  device->GetInEndpointPacketSize(),
-                                  ReceiveCallback, &instance, TransferTimeout);
+    /**
+     * How stalled, timed out or silent transfers are recovered
+     * Recovery steps run from HandleEvents, keep calling it.
+     */
+    void SetRecoveryConfig(const recovery::RecoveryConfig& config) {
+        instance.recovery.SetConfig(config);
+        instance.rx_watchdog_ms = config.rx_watchdog_ms;
+        Wake(&instance);
+    }
 
-        // Allow tx transfers again
-        instance.tx_allow = true;
+    recovery::RecoveryConfig GetRecoveryConfig() {
+        return instance.recovery.GetConfig();
+    }
 
-        // Submit rx transfer
-        ret = libusb_submit_transfer(instance.rx_transfer);
-        if (ret < 0) {
-            printf("libusb_submit_transfer failure! code %i (%s)\n", ret,
-                   libusb_error_name(ret));
-            throw error::LibUsbErrorException("Failed to submit transfer", ret);
+    recovery::RecoveryStats GetRecoveryStats() {
+        return instance.recovery.GetStats();
+    }
+
+    /**
+     * Time from a transfer fault until data moved again, per incident
+     */
+    const stats::Histogram& GetDowntime() {
+        return instance.recovery.GetDowntime();
+    }
+
+    /**
+     * Take received data from Consume (e.g. fed by a TeeOutput) instead of
+     * submitting an RX transfer of our own. Call before SetDevice.
+     */
+    void SetExternalReceive(bool value) { external_receive = value; }
+
+    /**
+     * Pass data through a framing stage in both directions
+     * RX only reaches the pty as whole frames, TX transfers never split a
+     * frame. NULL (default) disables framing. Call before SetDevice.
+     */
+    void SetFramer(BaseFramer* framer) { instance.framer = framer; }
+
+    /**
+     * Choose when TX data is submitted, see FlushPolicy
+     * Takes effect on the next HandleEvents, safe to call at any time.
+     * in_flight is clamped to 1..MaxTxTransfers.
+     */
+    void SetFlushConfig(const FlushConfig& flush) {
+        std::lock_guard<std::mutex> lock(instance.tx_mutex);
+        instance.flush = flush;
+        if (instance.flush.in_flight < 1)
+            instance.flush.in_flight = 1;
+        if (instance.flush.in_flight > PtyOutputInstanceData::MaxTxTransfers)
+            instance.flush.in_flight = PtyOutputInstanceData::MaxTxTransfers;
+
+        // Don't leave HandleEvents waiting on the old deadline
+        Wake(&instance);
+    }
+
+    FlushConfig GetFlushConfig() {
+        std::lock_guard<std::mutex> lock(instance.tx_mutex);
+        return instance.flush;
+    }
+
+    TxStats GetTxStats() {
+        std::lock_guard<std::mutex> lock(instance.tx_mutex);
+        return instance.tx_stats;
+    }
+
+    /**
+     * Send data on the urgent lane, ahead of what the pty has queued
+     * For commands that can't wait behind bulk data, like an emergency
+     * stop. Urgent data goes out in its own transfer as soon as the previous
+     * urgent transfer is done, bypassing the framer, so pass whole frames.
+     * At most one TX transfer worth can wait at a time.
+     * @param policy whether TX transfers already in flight are cancelled
+     */
+    error::Result TrySendUrgent(const uint8_t* data, uint32_t length,
+                                UrgentPolicy policy = UrgentPolicy::Next) {
+        uint64_t now = timing::Now();
+        struct libusb_transfer* cancel[PtyOutputInstanceData::MaxTxTransfers];
+        uint32_t cancel_count = 0;
+
+        {
+            std::lock_guard<std::mutex> lock(instance.tx_mutex);
+            if (device == NULL || !instance.tx_allow)
+                return error::Result::Fail(error::Code::NoDevice,
+                                           "No device to send to");
+            if (instance.tx_urgent_queued + length > instance.tx_length)
+                return error::Result::Fail(error::Code::Output,
+                                           "Urgent data doesn't fit",
+                                           (int)length);
+
+            if (!instance.tx_urgent_queue)
+                instance.tx_urgent_queue =
+                    buffer::Allocator::Instance().Acquire(instance.tx_length);
+            if (instance.tx_urgent_queued == 0)
+                instance.tx_urgent_queue_time = now;
+            memcpy(instance.tx_urgent_queue.Data() + instance.tx_urgent_queued,
+                   data, length);
+            instance.tx_urgent_queued += length;
+
+            if (policy == UrgentPolicy::Preempt) {
+                for (PtyTxSlot& slot : instance.tx_slots) {
+                    if (!slot.submitted || slot.preempted)
+                        continue;
+                    slot.preempted = true;
+                    cancel[cancel_count++] = slot.transfer;
+                }
+
+                // Unsent pty data is stale after the urgent data too
+                uint32_t dropped = instance.tx_carry_length;
+                if (instance.tx_fill >= 0)
+                    dropped += instance.tx_fill_length;
+                instance.tx_stats.preempted_bytes += dropped;
+                instance.tx_fill_length = 0;
+                instance.tx_carry_length = 0;
+                tcflush(instance.mfd, TCIFLUSH);
+            }
         }
+
+        // Cancelled transfers leave the endpoint's queue before the urgent
+        // transfer reaches its head
+        for (uint32_t i = 0; i < cancel_count; i++)
+            device->CancelTransfer(cancel[i]);
+
+        std::lock_guard<std::mutex> lock(instance.tx_mutex);
+        SubmitUrgent(&instance);
+        return error::Result::Ok();
+    }
+
+    void SendUrgent(const uint8_t* data, uint32_t length,
+                    UrgentPolicy policy = UrgentPolicy::Next) {
+        error::Raise(TrySendUrgent(data, length, policy));
+    }
+
+    /**
+     * Half-duplex RS-485 with the driver enable on RTS, see rs485::Config
+     * Applies from SetDevice, which fails if the driver can't set RTS
+     * without blocking (BaseDriver::GetDeviceLinesRequest).
+     */
+    void SetRs485Config(const rs485::Config& config) {
+        instance.rs485.SetConfig(config);
+    }
+
+    rs485::Config GetRs485Config() { return instance.rs485.GetConfig(); }
+
+    rs485::Stats GetRs485Stats() { return instance.rs485.GetStats(); }
+
+    /**
+     * Time from pty data being read until its transfer completed
+     */
+    const stats::Histogram& GetTxLatency() { return instance.tx_latency; }
+
+    /**
+     * Time from TrySendUrgent until its transfer completed
+     */
+    const stats::Histogram& GetUrgentLatency() {
+        return instance.urgent_latency;
+    }
+
+    /**
+     * Time from received data's arrival until it was written to the pty
+     */
+    const stats::Histogram& GetRxLatency() { return instance.rx_latency; }
+
+    void Consume(const buffer::Ref& chunk) override {
+        WriteReceived(&instance, chunk, chunk.Data(), chunk.Length(),
+                      chunk.Timestamp());
     }
 
     void RemoveDevice() override {
@@ -309,35 +1892,72 @@ public:
         if (!retain_pty)
             ClosePty();
 
-        if (instance.rx_transfer != NULL) {
-            printf("RemoveDevice() called with active transfer. This is "
-                   "dangerous, use EndTransfers first!\n");
+        if (instance.rx_active != 0) {
+            USS_LOG_WARN(
+                "RemoveDevice() called with active transfer. This is "
+                "dangerous, use EndTransfers first!\n");
             EndTransfers();
         }
-        if (instance.tx_transfer != NULL) {
-            printf("RemoveDevice() called with active transfer. This is "
-                   "dangerous, use EndTransfers first!\n");
+        if (instance.tx_active != 0) {
+            USS_LOG_WARN(
+                "RemoveDevice() called with active transfer. This is "
+                "dangerous, use EndTransfers first!\n");
             EndTransfers();
         }
     }
 
     void EndTransfers(std::function<void(int)> callback = NULL) override {
-        instance.tx_allow = false;
-        instance.tx_sending = false;
+        struct libusb_transfer*
+            cancel[PtyOutputInstanceData::MaxTxTransfers + 1];
+        uint32_t cancel_count = 0;
+
+        {
+            std::lock_guard<std::mutex> lock(instance.tx_mutex);
+            instance.tx_allow = false;
+            instance.tx_fill = -1;
+            instance.tx_urgent_queued = 0;
+            auto end = [&](PtyTxSlot& slot) {
+                if (slot.transfer == NULL)
+                    return;
+                if (slot.submitted) {
+                    cancel[cancel_count++] = slot.transfer;
+                    return;
+                }
+                // Not submitted, nothing to cancel
+                transfer::Pool::Instance().Release(slot.transfer);
+                slot.transfer = NULL;
+                slot.block.Reset();
+                instance.tx_active--;
+            };
+            for (PtyTxSlot& slot : instance.tx_slots)
+                end(slot);
+            end(instance.tx_urgent);
+            instance.rs485.Stop();
+            Wake(&instance);
+        }
+
         if (callback != NULL)
             SetTransferCompletionCallback(callback);
-        if (instance.rx_transfer != NULL) {
-            libusb_cancel_transfer(instance.rx_transfer);
-        } else {
-            printf("RX transfer is already null.\n");
-        }
-        if (instance.tx_transfer != NULL) {
-            libusb_cancel_transfer(instance.tx_transfer);
-        } else {
-            printf("TX transfer is already null.\n");
+        if (instance.rx_active != 0) {
+            std::lock_guard<std::mutex> lock(instance.rx_mutex);
+            for (PtyRxSlot& slot : instance.rx_slots) {
+                if (slot.transfer == NULL)
+                    continue;
+                if (!slot.parked) {
+                    instance.device->CancelTransfer(slot.transfer);
+                    continue;
+                }
+                // Parked for recovery, nothing to cancel
+                slot.parked = false;
+                ReleaseReceive(&instance, slot);
+            }
+        } else if (!external_receive) {
+            USS_LOG_DEBUG("RX transfer is already null.\n");
         }
+        for (uint32_t i = 0; i < cancel_count; i++)
+            instance.device->CancelTransfer(cancel[i]);
 
-        if (instance.rx_transfer == NULL && instance.tx_transfer == NULL)
+        if (instance.rx_active == 0 && instance.tx_active == 0)
             if (instance.transfer_end_callback != NULL)
                 instance.transfer_end_callback(1);
     }
@@ -0,0 +1,463 @@
+/**
+ * usbselfserial by lotuspar (https://github.com/lotuspar)
+ *
+ * Inspired / based on:
+ *     the usb-serial-for-android project made in Java,
+ *         * which is copyright 2011-2013 Google Inc., 2013 Mike Wakerly
+ *         * https://github.com/mik3y/usb-serial-for-android
+ *     the Linux serial port drivers,
+ *         * https://github.com/torvalds/linux/tree/master/drivers/usb/serial
+ *     and the FreeBSD serial port drivers
+ *         * https://github.com/freebsd/freebsd-src/tree/main/sys/dev/usb/serial
+ * Some parts rewritten in C++ for usbselfserial!
+ *     * (by the time you read this it could have a different name!)
+ * - 2022
+ */
+#pragma once
+#include "../../coro.hpp"
+#if defined(USS_COROUTINES)
+#include "../../buffer.hpp"
+#include "../../device.hpp"
+#include "../../error.hpp"
+#include "../../log.hpp"
+#include "../../output.hpp"
+#include "../../timing.hpp"
+#include "../../transfer.hpp"
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <span>
+
+namespace uss {
+namespace output {
+namespace stream {
+
+class StreamOutput;
+
+/**
+ * co_await StreamOutput::Read
+ * Resumes with the bytes copied into data, 0 once the device is gone.
+ */
+class ReadAwaiter {
+    friend class StreamOutput;
+    StreamOutput* output;
+    uint8_t* data;
+    size_t length;
+    size_t result = 0;
+    std::coroutine_handle<> handle = NULL;
+
+public:
+    ReadAwaiter(StreamOutput* _output, uint8_t* _data, size_t _length)
+        : output(_output), data(_data), length(_length) {}
+
+    bool await_ready() { return length == 0; }
+    bool await_suspend(std::coroutine_handle<> _handle);
+    size_t await_resume() { return result; }
+};
+
+/**
+ * co_await StreamOutput::Write
+ * The data is sent straight from the caller's buffer, which stays put
+ * while the coroutine is suspended.
+ */
+class WriteAwaiter {
+    friend class StreamOutput;
+    StreamOutput* output;
+    const uint8_t* data;
+    size_t length;
+    error::Result result;
+    struct libusb_transfer* transfer = NULL;
+    WriteAwaiter* next = NULL; // in flight list
+    std::coroutine_handle<> handle = NULL;
+
+public:
+    WriteAwaiter(StreamOutput* _output, const uint8_t* _data, size_t _length)
+        : output(_output), data(_data), length(_length) {}
+
+    bool await_ready() { return length == 0; }
+    bool await_suspend(std::coroutine_handle<> _handle);
+    error::Result await_resume() { return result; }
+};
+
+/**
+ * Output read and written from coroutines
+ * Received data is queued a few transfers deep; when the queue is full
+ * the RX transfer is held back until a Read makes room, so the device is
+ * throttled rather than data dropped. Completions are resumed through
+ * the Scheduler, HandleEvents has nothing to do. One reader at a time.
+ */
+class StreamOutput : public BaseOutput, public BaseSink {
+    friend class ReadAwaiter;
+    friend class WriteAwaiter;
+
+    constexpr static const uint32_t TransferTimeout = 0;
+    constexpr static const uint32_t QueueDepth = 8;
+
+    coro::Scheduler* scheduler;
+    std::mutex mutex;
+
+    // rx (usb -> reader)
+    struct libusb_transfer* rx_transfer = NULL;
+    buffer::Ref rx_block;
+    uint32_t rx_length = 0;
+    bool rx_held = false; // completed, waiting for room in the queue
+    buffer::Ref rx_queue[QueueDepth];
+    uint32_t rx_head = 0, rx_count = 0;
+    uint32_t rx_offset = 0; // into the head chunk
+    bool rx_ended = true;
+    ReadAwaiter* reader = NULL;
+    uint64_t rx_dropped = 0; // Consume with a full queue
+
+    // tx (writer -> usb)
+    WriteAwaiter* writers = NULL;
+
+    bool ending = false; // EndTransfers called, nothing new is submitted
+    bool external_receive = false;
+    uint32_t rx_transfer_size = 0;
+    std::function<void(int)> transfer_end_callback = NULL;
+
+    /**
+     * Copy queued data out. Call with mutex held.
+     */
+    size_t Take(uint8_t* data, size_t length) {
+        size_t taken = 0;
+        while (taken < length && rx_count != 0) {
+            buffer::Ref& chunk = rx_queue[rx_head];
+            size_t part = chunk.Length() - rx_offset;
+            if (part > length - taken)
+                part = length - taken;
+            memcpy(data + taken, chunk.Data() + rx_offset, part);
+            taken += part;
+            rx_offset += (uint32_t)part;
+
+            if (rx_offset == chunk.Length()) {
+                chunk.Reset();
+                rx_head = (rx_head + 1) % QueueDepth;
+                rx_count--;
+                rx_offset = 0;
+            }
+        }
+
+        if (rx_held && rx_count < QueueDepth && !ending)
+            SubmitReceive();
+        return taken;
+    }
+
+    /**
+     * Queue a chunk and hand it to a waiting reader. Call with mutex held.
+     */
+    void Push(const buffer::Ref& chunk) {
+        rx_queue[(rx_head + rx_count) % QueueDepth] = chunk;
+        rx_count++;
+        WakeReader();
+    }
+
+    /**
+     * Hand queued data to a waiting reader. Call with mutex held.
+     * The reader is taken off first: Take may resubmit RX, and a failed
+     * submit ends RX and comes back here.
+     */
+    void WakeReader() {
+        ReadAwaiter* waking = reader;
+        if (waking == NULL)
+            return;
+        reader = NULL;
+        waking->result = Take(waking->data, waking->length);
+        if (waking->result == 0 && !rx_ended) {
+            reader = waking;
+            return;
+        }
+        scheduler->Post(waking->handle);
+    }
+
+    /**
+     * Submit the RX transfer into a fresh block. Call with mutex held.
+     */
+    void SubmitReceive() {
+        rx_held = false;
+        rx_block = buffer::Allocator::Instance().Acquire(rx_length);
+        rx_transfer->buffer = rx_block.Data();
+
+        int ret = device->SubmitTransfer(rx_transfer);
+        if (ret < 0) {
+            USS_LOG_ERROR("Failed to submit RX transfer. code %i (%s)\n", ret,
+                          libusb_error_name(ret));
+            transfer::Pool::Instance().Release(rx_transfer);
+            rx_transfer = NULL;
+            rx_block.Reset();
+            rx_ended = true;
+            WakeReader();
+        }
+    }
+
+    void EndedLocked(std::unique_lock<std::mutex>& lock, int value) {
+        if (rx_transfer != NULL || writers != NULL)
+            return;
+        std::function<void(int)> callback = transfer_end_callback;
+        lock.unlock();
+        if (callback != NULL)
+            callback(value);
+    }
+
+    static void LIBUSB_CALL ReceiveCallback(struct libusb_transfer* transfer) {
+        StreamOutput* output = (StreamOutput*)transfer->user_data;
+        std::unique_lock<std::mutex> lock(output->mutex);
+        bool completed = transfer->status == LIBUSB_TRANSFER_COMPLETED;
+
+        if (completed && transfer->actual_length != 0) {
+            output->rx_block.SetLength((uint32_t)transfer->actual_length);
+            output->rx_block.SetTimestamp(timing::Now());
+            output->Push(output->rx_block);
+        }
+
+        // A cancel can lose the race with completion, so don't resubmit
+        // once ending either
+        if (!completed || output->ending) {
+            if (!completed && transfer->status != LIBUSB_TRANSFER_CANCELLED)
+                USS_LOG_WARN("RX transfer fail. code %i (%s)\n",
+                             transfer->status,
+                             libusb_error_name(transfer->status));
+            transfer::Pool::Instance().Release(transfer);
+            output->rx_transfer = NULL;
+            output->rx_block.Reset();
+            output->rx_ended = true;
+            output->WakeReader();
+            output->EndedLocked(lock, 0);
+            return;
+        }
+
+        if (output->rx_count == QueueDepth)
+            output->rx_held = true;
+        else
+            output->SubmitReceive();
+    }
+
+    static void LIBUSB_CALL TransmitCallback(struct libusb_transfer* transfer) {
+        WriteAwaiter* writer = (WriteAwaiter*)transfer->user_data;
+        StreamOutput* output = writer->output;
+        std::unique_lock<std::mutex> lock(output->mutex);
+
+        // The transfer may be reused as soon as it is back in the pool
+        libusb_transfer_status status = transfer->status;
+        if (status == LIBUSB_TRANSFER_COMPLETED &&
+            (size_t)transfer->actual_length == writer->length)
+            writer->result = error::Result::Ok();
+        else
+            writer->result = error::Result::Fail(error::Code::LibUsb,
+                                                 "Write failed", (int)status);
+
+        transfer::Pool::Instance().Release(transfer);
+        writer->transfer = NULL;
+        for (WriteAwaiter** link = &output->writers; *link != NULL;
+             link = &(*link)->next) {
+            if (*link == writer) {
+                *link = writer->next;
+                break;
+            }
+        }
+
+        output->scheduler->Post(writer->handle);
+        if (status != LIBUSB_TRANSFER_COMPLETED || output->ending)
+            output->EndedLocked(lock, 0);
+    }
+
+public:
+    StreamOutput(BaseDevice* _device, coro::Scheduler& _scheduler)
+        : BaseOutput(_device), scheduler(&_scheduler) {
+        SetDevice(device);
+    }
+
+    ~StreamOutput() {
+        for (buffer::Ref& chunk : rx_queue)
+            chunk.Reset();
+    }
+
+    /**
+     * Wait for received data, up to length bytes
+     */
+    ReadAwaiter Read(uint8_t* data, size_t length) {
+        return ReadAwaiter(this, data, length);
+    }
+
+    ReadAwaiter Read(std::span<uint8_t> data) {
+        return ReadAwaiter(this, data.data(), data.size());
+    }
+
+    /**
+     * Send data in one transfer, resumes once the device has it
+     */
+    WriteAwaiter Write(const uint8_t* data, size_t length) {
+        return WriteAwaiter(this, data, length);
+    }
+
+    WriteAwaiter Write(std::span<const uint8_t> data) {
+        return WriteAwaiter(this, data.data(), data.size());
+    }
+
+    void HandleEvents() override {}
+
+    error::Result TrySetDevice(BaseDevice* _device) override {
+        if (_device == NULL)
+            return error::Result::Ok();
+
+        std::lock_guard<std::mutex> lock(mutex);
+        device = _device;
+        rx_ended = false;
+        ending = false;
+
+        // Received data comes in through Consume instead
+        if (external_receive)
+            return error::Result::Ok();
+
+        uint16_t packet_size = device->GetInEndpointPacketSize();
+        rx_length = rx_transfer_size <= packet_size
+                        ? packet_size
+                        : rx_transfer_size / packet_size * packet_size;
+        if (rx_length > buffer::Allocator::MaxBlockSize())
+            return error::Result::Fail(error::Code::Output,
+                                       "RX transfer size too large",
+                                       (int)rx_length);
+        if (rx_transfer != NULL) {
+            USS_LOG_WARN("RX transfer still active, not resubmitting!\n");
+            return error::Result::Ok();
+        }
+
+        rx_transfer = transfer::Pool::Instance().Acquire();
+        libusb_fill_bulk_transfer(rx_transfer, device->GetUsbHandle(),
+                                  device->GetInEndpoint(), NULL,
+                                  (int)rx_length, ReceiveCallback, this,
+                                  TransferTimeout);
+        SubmitReceive();
+        if (rx_transfer == NULL)
+            return error::Result::Fail(error::Code::LibUsb,
+                                       "Failed to submit transfer");
+        return error::Result::Ok();
+    }
+
+    /**
+     * RX transfer size in bytes, rounded down to whole packets
+     * 0 (default) is a single packet. Applies from SetDevice.
+     */
+    void SetTransferSize(uint32_t rx_size) { rx_transfer_size = rx_size; }
+
+    /**
+     * Take received data from Consume (e.g. fed by a TeeOutput) instead of
+     * submitting an RX transfer of our own. Call before SetDevice.
+     */
+    void SetExternalReceive(bool value) { external_receive = value; }
+
+    /**
+     * Chunks dropped by Consume because nobody was reading
+     */
+    uint64_t GetDropped() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return rx_dropped;
+    }
+
+    void Consume(const buffer::Ref& chunk) override {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (rx_count == QueueDepth) {
+            rx_dropped++;
+            return;
+        }
+        Push(chunk);
+    }
+
+    void RemoveDevice() override {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (rx_transfer != NULL || writers != NULL) {
+            USS_LOG_WARN(
+                "RemoveDevice() called with active transfer. This is "
+                "dangerous, use EndTransfers first!\n");
+            lock.unlock();
+            EndTransfers();
+            lock.lock();
+        }
+        device = NULL;
+        rx_ended = true;
+        WakeReader();
+    }
+
+    void EndTransfers(std::function<void(int)> callback = NULL) override {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (callback != NULL)
+            transfer_end_callback = callback;
+        ending = true;
+
+        if (rx_transfer != NULL) {
+            if (rx_held) {
+                // Not submitted, nothing to cancel
+                transfer::Pool::Instance().Release(rx_transfer);
+                rx_transfer = NULL;
+                rx_held = false;
+                rx_ended = true;
+                WakeReader();
+            } else {
+                device->CancelTransfer(rx_transfer);
+            }
+        }
+        for (WriteAwaiter* writer = writers; writer != NULL;
+             writer = writer->next)
+            device->CancelTransfer(writer->transfer);
+
+        EndedLocked(lock, 1);
+    }
+
+    void
+    SetTransferCompletionCallback(std::function<void(int)> callback) override {
+        std::lock_guard<std::mutex> lock(mutex);
+        transfer_end_callback = callback;
+    }
+};
+
+inline bool ReadAwaiter::await_suspend(std::coroutine_handle<> _handle) {
+    std::lock_guard<std::mutex> lock(output->mutex);
+    result = output->Take(data, length);
+    if (result != 0 || output->rx_ended)
+        return false;
+    if (output->reader != NULL) {
+        USS_LOG_ERROR("StreamOutput already has a reader!\n");
+        return false;
+    }
+    handle = _handle;
+    output->reader = this;
+    return true;
+}
+
+inline bool WriteAwaiter::await_suspend(std::coroutine_handle<> _handle) {
+    std::lock_guard<std::mutex> lock(output->mutex);
+    BaseDevice* device = output->device;
+    if (device == NULL) {
+        result = error::Result::Fail(error::Code::NoDevice, "No device");
+        return false;
+    }
+    if (output->ending) {
+        result = error::Result::Fail(error::Code::Output, "Transfers ended");
+        return false;
+    }
+
+    handle = _handle;
+    transfer = transfer::Pool::Instance().Acquire();
+    libusb_fill_bulk_transfer(transfer, device->GetUsbHandle(),
+                              device->GetOutEndpoint(), (uint8_t*)data,
+                              (int)length, StreamOutput::TransmitCallback,
+                              this, StreamOutput::TransferTimeout);
+
+    int ret = device->SubmitTransfer(transfer);
+    if (ret < 0) {
+        transfer::Pool::Instance().Release(transfer);
+        transfer = NULL;
+        result = error::Result::Fail(error::Code::LibUsb,
+                                     "Failed to submit transfer", ret);
+        return false;
+    }
+
+    next = output->writers;
+    output->writers = this;
+    return true;
+}
+
+} // namespace stream
+} // namespace output
+} // namespace uss
+#endif
@@ -0,0 +1,500 @@
+/**
+ * usbselfserial by lotuspar (https://github.com/lotuspar)
+ *
+ * Inspired / based on:
+ *     the usb-serial-for-android project made in Java,
+ *         * which is copyright 2011-2013 Google Inc., 2013 Mike Wakerly
+ *         * https://github.com/mik3y/usb-serial-for-android
+ *     the Linux serial port drivers,
+ *         * https://github.com/torvalds/linux/tree/master/drivers/usb/serial
+ *     and the FreeBSD serial port drivers
+ *         * https://github.com/freebsd/freebsd-src/tree/main/sys/dev/usb/serial
+ * Some parts rewritten in C++ for usbselfserial!
+ *     * (by the time you read this it could have a different name!)
+ * - 2022
+ */
+#pragma once
+#include "../../buffer.hpp"
+#include "../../device.hpp"
+#include "../../error.hpp"
+#include "../../log.hpp"
+#include "../../output.hpp"
+#include "../../recovery.hpp"
+#include "../../stats.hpp"
+#include "../../timing.hpp"
+#include "../../transfer.hpp"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace uss {
+namespace output {
+namespace tee {
+
+/**
+ * What happens to a chunk when a consumer's queue is full
+ */
+enum class SlowConsumerPolicy {
+    Drop, // drop it for that consumer only, RX keeps going
+    Block // lossless, RX resubmission waits for the consumer to catch up
+};
+
+struct TeeConsumerStats {
+    uint64_t delivered = 0;
+    uint64_t dropped = 0;
+};
+
+struct TeeConsumer {
+    BaseSink* sink;
+    SlowConsumerPolicy policy;
+
+    // Ring written by the RX callback, read by HandleEvents
+    std::unique_ptr<buffer::Block*[]> queue;
+    size_t capacity;
+    std::atomic<size_t> head{0}, tail{0};
+
+    std::atomic<uint64_t> delivered{0}, dropped{0};
+
+    // arrival -> Consume returned, ns
+    stats::Histogram latency;
+
+    TeeConsumer(BaseSink* _sink, SlowConsumerPolicy _policy, size_t _capacity)
+        : sink(_sink), policy(_policy), queue(new buffer::Block*[_capacity]),
+          capacity(_capacity) {}
+
+    bool Full() {
+        return head.load(std::memory_order_relaxed) -
+                   tail.load(std::memory_order_acquire) >=
+               capacity;
+    }
+
+    bool Empty() {
+        return head.load(std::memory_order_acquire) ==
+               tail.load(std::memory_order_relaxed);
+    }
+};
+
+struct TeeOutputInstanceData {
+    BaseDevice* device = NULL;
+    uint32_t block_size = 0;
+    std::vector<std::unique_ptr<TeeConsumer>> consumers;
+
+    // rx_transfer (usb -> consumers)
+    struct libusb_transfer* rx_transfer = NULL;
+    buffer::Ref rx_block;
+    bool rx_allow = false;
+    bool rx_paused = false; // held back by a Block consumer
+    bool rx_parked = false; // faulted, held back until recovery is done
+    std::mutex rx_mutex;
+
+    // fault recovery, see TeeOutput::SetRecoveryConfig
+    recovery::Monitor recovery;
+
+    // wakes HandleEvents
+    std::mutex wake_mutex;
+    std::condition_variable wake;
+
+    std::function<void(int)> transfer_end_callback = NULL;
+};
+
+/**
+ * Output that feeds one device's received data to several sinks
+ * Every completed RX transfer lands in a pool block that is shared by
+ * reference with each consumer, nothing is copied per consumer. Consumers
+ * run from HandleEvents, never on the USB event thread.
+ */
+class TeeOutput : public BaseOutput {
+    constexpr static const uint32_t TransferTimeout = 0;
+    constexpr static const std::chrono::milliseconds WakeTimeout{100};
+    TeeOutputInstanceData instance;
+
+    /**
+     * Hand the finished transfer's block to every consumer
+     */
+    static void Dispatch(TeeOutputInstanceData* instance) {
+        for (auto& consumer : instance->consumers) {
+            if (consumer->Full()) {
+                // Block consumers always have room, Resubmit checks first
+                consumer->dropped.fetch_add(1, std::memory_order_relaxed);
+                continue;
+            }
+            size_t head = consumer->head.load(std::memory_order_relaxed);
+            consumer->queue[head % consumer->capacity] =
+                buffer::Ref(instance->rx_block).Detach();
+            consumer->head.store(head + 1, std::memory_order_release);
+        }
+
+        { std::lock_guard<std::mutex> lock(instance->wake_mutex); }
+        instance->wake.notify_all();
+    }
+
+    /**
+     * Submit the RX transfer with a fresh block
+     * Call with rx_mutex held.
+     * @return false if the transfer ended
+     */
+    static bool Resubmit(TeeOutputInstanceData* instance) {
+        for (auto& consumer : instance->consumers) {
+            if (consumer->policy == SlowConsumerPolicy::Block &&
+                consumer->Full()) {
+                instance->rx_paused = true;
+                return true;
+            }
+        }
+
+        instance->rx_paused = false;
+        instance->rx_block =
+            buffer::Allocator::Instance().Acquire(instance->block_size);
+
+        // Whole packets only, a partial packet would overflow
+        uint16_t packet_size = instance->device->GetInEndpointPacketSize();
+        int length = instance->block_size / packet_size * packet_size;
+
+        libusb_fill_bulk_transfer(
+            instance->rx_transfer, instance->device->GetUsbHandle(),
+            instance->device->GetInEndpoint(), instance->rx_block.Data(),
+            length, ReceiveCallback, instance, TransferTimeout);
+
+        int ret = instance->device->SubmitTransfer(instance->rx_transfer);
+        if (ret < 0) {
+            USS_LOG_ERROR("Failed to submit tee RX transfer. code %i (%s)\n",
+                          ret, libusb_error_name(ret));
+            transfer::Pool::Instance().Release(instance->rx_transfer);
+            instance->rx_transfer = NULL;
+            instance->rx_block.Reset();
+            return false;
+        }
+        return true;
+    }
+
+    // usb [->] TeeOutput -> consumers
+    static void LIBUSB_CALL ReceiveCallback(struct libusb_transfer* transfer) {
+        TeeOutputInstanceData* instance =
+            (TeeOutputInstanceData*)transfer->user_data;
+        bool ended = false;
+        bool parked = false;
+
+        {
+            std::lock_guard<std::mutex> lock(instance->rx_mutex);
+
+            if (transfer->status == LIBUSB_TRANSFER_CANCELLED ||
+                transfer->status == LIBUSB_TRANSFER_ERROR ||
+                transfer->status == LIBUSB_TRANSFER_NO_DEVICE ||
+                (transfer->status != LIBUSB_TRANSFER_COMPLETED &&
+                 !instance->rx_allow)) {
+                USS_LOG_WARN("Tee RX transfer fail. code %i (%s)\n",
+                             transfer->status,
+                             libusb_error_name(transfer->status));
+                transfer::Pool::Instance().Release(transfer);
+                instance->rx_transfer = NULL;
+                instance->rx_block.Reset();
+                ended = true;
+            } else if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+                USS_LOG_WARN("Tee RX transfer fault, recovering. code %i "
+                             "(%s)\n",
+                             transfer->status,
+                             libusb_error_name(transfer->status));
+                instance->rx_block.Reset();
+                instance->rx_parked = parked = true;
+                instance->recovery.Report(
+                    recovery::FaultFor(transfer->status), transfer->endpoint);
+            } else {
+                instance->recovery.Complete(transfer->endpoint);
+                if (transfer->actual_length > 0) {
+                    instance->rx_block.SetTimestamp(timing::Now());
+                    instance->rx_block.SetLength(transfer->actual_length);
+                    Dispatch(instance);
+                }
+                instance->rx_block.Reset();
+
+                if (!instance->rx_allow) {
+                    // Completed before EndTransfers could cancel it
+                    transfer::Pool::Instance().Release(transfer);
+                    instance->rx_transfer = NULL;
+                    ended = true;
+                } else {
+                    ended = !Resubmit(instance);
+                }
+            }
+        }
+
+        if (parked) {
+            // HandleEvents runs the recovery step
+            { std::lock_guard<std::mutex> lock(instance->wake_mutex); }
+            instance->wake.notify_all();
+        }
+        if (ended && instance->transfer_end_callback != NULL)
+            instance->transfer_end_callback(0);
+    }
+
+    /**
+     * Deliver everything queued for one consumer
+     */
+    static void Drain(TeeConsumer& consumer) {
+        while (!consumer.Empty()) {
+            size_t tail = consumer.tail.load(std::memory_order_relaxed);
+            buffer::Ref chunk =
+                buffer::Ref::Adopt(consumer.queue[tail % consumer.capacity]);
+            consumer.sink->Consume(chunk);
+            consumer.latency.Record(timing::Now() - chunk.Timestamp());
+            chunk.Reset();
+            consumer.tail.store(tail + 1, std::memory_order_release);
+            consumer.delivered.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    void WaitForChunks(std::function<bool()> ready) {
+        std::unique_lock<std::mutex> lock(instance.wake_mutex);
+        instance.wake.wait_for(lock, WakeTimeout, ready);
+    }
+
+    /**
+     * Restart RX held back by a slow Block consumer
+     */
+    void ResumeReceive() {
+        bool ended = false;
+        {
+            std::lock_guard<std::mutex> lock(instance.rx_mutex);
+            if (!instance.rx_paused || !instance.rx_allow ||
+                instance.rx_transfer == NULL)
+                return;
+            ended = !Resubmit(&instance);
+        }
+        if (ended && instance.transfer_end_callback != NULL)
+            instance.transfer_end_callback(0);
+    }
+
+    /**
+     * Run a pending recovery step, from HandleEvents
+     * The faulted RX transfer is parked, so there is nothing to cancel
+     * before clearing the halt or resetting the device.
+     */
+    void Recover() {
+        recovery::Action action = instance.recovery.Next();
+        if (action == recovery::Action::None)
+            return;
+
+        error::Result result;
+        if (action == recovery::Action::Fail)
+            result = error::Result::Fail(error::Code::Output,
+                                         "Transfer fault not recovered");
+        else if (action == recovery::Action::Reset)
+            result = instance.recovery.TryReset(*instance.device);
+        else
+            result = instance.recovery.TryClearHalt(*instance.device);
+
+        if (!result) {
+            USS_LOG_ERROR("Tee recovery failed, ending transfers: %s\n",
+                          result.message);
+            instance.recovery.Fail();
+            EndTransfers();
+            return;
+        }
+
+        USS_LOG_INFO("%s, resubmitting tee RX\n",
+                     action == recovery::Action::Reset ? "Device reset"
+                                                       : "Endpoint cleared");
+        bool ended = false;
+        {
+            std::lock_guard<std::mutex> lock(instance.rx_mutex);
+            if (!instance.rx_parked || instance.rx_transfer == NULL)
+                return;
+            instance.rx_parked = false;
+            if (!instance.rx_allow) {
+                transfer::Pool::Instance().Release(instance.rx_transfer);
+                instance.rx_transfer = NULL;
+                ended = true;
+            } else {
+                ended = !Resubmit(&instance);
+            }
+        }
+        if (ended && instance.transfer_end_callback != NULL)
+            instance.transfer_end_callback(0);
+    }
+
+    bool Idle() {
+        for (auto& consumer : instance.consumers)
+            if (!consumer->Empty())
+                return false;
+        return !instance.recovery.Pending();
+    }
+
+public:
+    /**
+     * @param block_size RX transfer length, blocks come from the shared
+     * buffer::Allocator
+     */
+    TeeOutput(BaseDevice* _device, uint32_t block_size = 1024)
+        : BaseOutput(_device) {
+        instance.block_size = block_size;
+        SetDevice(device);
+    }
+
+    ~TeeOutput() {
+        // Give queued blocks back
+        for (auto& consumer : instance.consumers) {
+            while (!consumer->Empty()) {
+                size_t tail = consumer->tail.load();
+                buffer::Ref::Adopt(consumer->queue[tail % consumer->capacity])
+                    .Reset();
+                consumer->tail.store(tail + 1);
+            }
+        }
+    }
+
+    /**
+     * Add a consumer. Only call before SetDevice.
+     * @param queue_depth chunks the consumer may fall behind by
+     */
+    void AddConsumer(BaseSink* sink,
+                     SlowConsumerPolicy policy = SlowConsumerPolicy::Drop,
+                     size_t queue_depth = 32) {
+        instance.consumers.emplace_back(
+            new TeeConsumer(sink, policy, queue_depth));
+    }
+
+    TeeConsumerStats GetConsumerStats(size_t index) {
+        TeeConsumerStats stats;
+        stats.delivered = instance.consumers[index]->delivered.load();
+        stats.dropped = instance.consumers[index]->dropped.load();
+        return stats;
+    }
+
+    /**
+     * Time from a chunk's arrival until the consumer was done with it
+     */
+    const stats::Histogram& GetConsumerLatency(size_t index) {
+        return instance.consumers[index]->latency;
+    }
+
+    /**
+     * Deliver queued chunks to every consumer
+     * A consumer with a slow Consume delays the others here; give it its
+     * own thread with HandleConsumerEvents instead.
+     */
+    void HandleEvents() override {
+        WaitForChunks([this]() { return !Idle(); });
+
+        for (auto& consumer : instance.consumers)
+            Drain(*consumer);
+
+        ResumeReceive();
+        Recover();
+    }
+
+    /**
+     * Deliver queued chunks to one consumer
+     */
+    void HandleConsumerEvents(size_t index) {
+        TeeConsumer& consumer = *instance.consumers[index];
+        WaitForChunks([this, &consumer]() {
+            return !consumer.Empty() || instance.recovery.Pending();
+        });
+        Drain(consumer);
+        ResumeReceive();
+        Recover();
+    }
+
+    /**
+     * How stalled, timed out or overflowed RX transfers are recovered
+     * Steps run from HandleEvents (or HandleConsumerEvents), keep calling
+     * it. rx_watchdog_ms has no TX to go by here and is ignored.
+     */
+    void SetRecoveryConfig(const recovery::RecoveryConfig& config) {
+        instance.recovery.SetConfig(config);
+    }
+
+    recovery::RecoveryConfig GetRecoveryConfig() {
+        return instance.recovery.GetConfig();
+    }
+
+    recovery::RecoveryStats GetRecoveryStats() {
+        return instance.recovery.GetStats();
+    }
+
+    /**
+     * Time from a transfer fault until data moved again, per incident
+     */
+    const stats::Histogram& GetDowntime() {
+        return instance.recovery.GetDowntime();
+    }
+
+    error::Result TrySetDevice(BaseDevice* _device) override {
+        if (_device == NULL)
+            return error::Result::Ok();
+        device = _device;
+
+        std::lock_guard<std::mutex> lock(instance.rx_mutex);
+        instance.device = _device;
+
+        if (instance.rx_transfer != NULL) {
+            USS_LOG_WARN("Tee already has an RX transfer!\n");
+            return error::Result::Ok();
+        }
+
+        if (device->GetInEndpointPacketSize() > instance.block_size ||
+            instance.block_size > buffer::Allocator::MaxBlockSize())
+            return error::Result::Fail(
+                error::Code::DevicePrep,
+                "Tee block size doesn't fit the IN packet size",
+                (int)instance.block_size);
+
+        instance.rx_transfer = transfer::Pool::Instance().Acquire();
+        instance.rx_allow = true;
+        if (!Resubmit(&instance))
+            return error::Result::Fail(error::Code::DevicePrep,
+                                       "Failed to submit tee transfer");
+        return error::Result::Ok();
+    }
+
+    void RemoveDevice() override {
+        device = NULL;
+        if (instance.rx_transfer != NULL) {
+            USS_LOG_WARN(
+                "RemoveDevice() called with active transfer. This is "
+                "dangerous, use EndTransfers first!\n");
+            EndTransfers();
+        }
+    }
+
+    void EndTransfers(std::function<void(int)> callback = NULL) override {
+        if (callback != NULL)
+            SetTransferCompletionCallback(callback);
+
+        bool ended = false;
+        {
+            std::lock_guard<std::mutex> lock(instance.rx_mutex);
+            instance.rx_allow = false;
+
+            if (instance.rx_transfer == NULL) {
+                ended = true;
+            } else if (instance.rx_paused || instance.rx_parked) {
+                // Not submitted, nothing to cancel
+                transfer::Pool::Instance().Release(instance.rx_transfer);
+                instance.rx_transfer = NULL;
+                instance.rx_paused = false;
+                instance.rx_parked = false;
+                instance.recovery.Fail();
+                ended = true;
+            } else {
+                instance.device->CancelTransfer(instance.rx_transfer);
+            }
+        }
+
+        if (ended && instance.transfer_end_callback != NULL)
+            instance.transfer_end_callback(1);
+    }
+
+    void
+    SetTransferCompletionCallback(std::function<void(int)> callback) override {
+        instance.transfer_end_callback = callback;
+    }
+};
+
+} // namespace tee
+} // namespace output
+} // namespace uss
\ No newline at end of file
@@ -0,0 +1,116 @@
+/**
+ * usbselfserial by lotuspar (https://github.com/lotuspar)
+ *
+ * Inspired / based on:
+ *     the usb-serial-for-android project made in Java,
+ *         * which is copyright 2011-2013 Google Inc., 2013 Mike Wakerly
+ *         * https://github.com/mik3y/usb-serial-for-android
+ *     the Linux serial port drivers,
+ *         * https://github.com/torvalds/linux/tree/master/drivers/usb/serial
+ *     and the FreeBSD serial port drivers
+ *         * https://github.com/freebsd/freebsd-src/tree/main/sys/dev/usb/serial
+ * Some parts rewritten in C++ for usbselfserial!
+ *     * (by the time you read this it could have a different name!)
+ * - 2022
+ */
+#pragma once
+#include "log.hpp"
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+namespace uss {
+namespace realtime {
+
+/**
+ * Scheduling for one thread
+ */
+struct ThreadOptions {
+    int cpu = -1;     // CPU to pin to, -1 leaves affinity alone
+    int priority = 0; // SCHED_FIFO priority 1..99, 0 leaves the policy alone
+};
+
+/**
+ * Pin a thread to one CPU
+ * @return 0 or an errno value
+ */
+inline int PinThread(pthread_t thread, int cpu) {
+#if defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(thread, sizeof(set), &set);
+#else
+    // No hard affinity outside Linux
+    return ENOTSUP;
+#endif
+}
+
+/**
+ * Move a thread to SCHED_FIFO, usually needs CAP_SYS_NICE or an rtprio
+ * limit
+ * @return 0 or an errno value
+ */
+inline int SetFifoPriority(pthread_t thread, int priority) {
+    struct sched_param param;
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = priority;
+    return pthread_setschedparam(thread, SCHED_FIFO, &param);
+}
+
+/**
+ * Apply options to a thread, failures are reported but not fatal
+ * @return false if anything couldn't be applied
+ */
+inline bool Apply(pthread_t thread, const ThreadOptions& options,
+                  const char* name) {
+    bool ok = true;
+    int ret;
+
+    if (options.cpu >= 0) {
+        ret = PinThread(thread, options.cpu);
+        if (ret != 0) {
+            USS_LOG_WARN("Failed to pin %s thread to CPU %i. code %i (%s)\n",
+                         name, options.cpu, ret, strerror(ret));
+            ok = false;
+        }
+    }
+
+    if (options.priority > 0) {
+        ret = SetFifoPriority(thread, options.priority);
+        if (ret != 0) {
+            USS_LOG_WARN(
+                "Failed to set %s thread SCHED_FIFO priority %i. code %i "
+                "(%s)\n",
+                name, options.priority, ret, strerror(ret));
+            ok = false;
+        }
+    }
+
+    return ok;
+}
+
+inline bool ApplyToCurrent(const ThreadOptions& options, const char* name) {
+    return Apply(pthread_self(), options, name);
+}
+
+/**
+ * Lock current and future memory so the hot path never page faults
+ * Reserve and Prefault pools first, locking maps whatever exists then.
+ * @return 0 or an errno value
+ */
+inline int LockMemory() {
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+        int error = errno;
+        USS_LOG_WARN("mlockall failure! code %i (%s)\n", error,
+                     strerror(error));
+        return error;
+    }
+    return 0;
+}
+
+} // namespace realtime
+} // namespace uss
@@ -0,0 +1,282 @@
+/**
+ * usbselfserial by lotuspar (https://github.com/lotuspar)
+ *
+ * Inspired / based on:
+ *     the usb-serial-for-android project made in Java,
+ *         * which is copyright 2011-2013 Google Inc., 2013 Mike Wakerly
+ *         * https://github.com/mik3y/usb-serial-for-android
+ *     the Linux serial port drivers,
+ *         * https://github.com/torvalds/linux/tree/master/drivers/usb/serial
+ *     and the FreeBSD serial port drivers
+ *         * https://github.com/freebsd/freebsd-src/tree/main/sys/dev/usb/serial
+ * Some parts rewritten in C++ for usbselfserial!
+ *     * (by the time you read this it could have a different name!)
+ * - 2022
+ */
+#pragma once
+#include "device.hpp"
+#include "error.hpp"
+#include "log.hpp"
+#include "stats.hpp"
+#include "timing.hpp"
+#include <atomic>
+#include <mutex>
+
+namespace uss {
+namespace recovery {
+
+/**
+ * Why a transfer didn't complete normally
+ */
+enum class Fault : uint8_t {
+    Stall,    // endpoint halted
+    Timeout,  // transfer timed out
+    Overflow, // device sent more than asked for
+    Silent    // RX watchdog, see RecoveryConfig::rx_watchdog_ms
+};
+
+/**
+ * What to do about the current incident
+ */
+enum class Action : uint8_t {
+    None,
+    ClearHalt, // clear the faulted endpoints and resubmit
+    Reset,     // reset the device, re-initialize it and resubmit
+    Fail       // out of steps, end the transfers
+};
+
+/**
+ * Fault for a transfer status that isn't completed, cancelled, error or
+ * no device
+ */
+inline Fault FaultFor(int status) {
+    switch (status) {
+    case LIBUSB_TRANSFER_TIMED_OUT:
+        return Fault::Timeout;
+    case LIBUSB_TRANSFER_OVERFLOW:
+        return Fault::Overflow;
+    default:
+        return Fault::Stall;
+    }
+}
+
+/**
+ * Escalation limits
+ * An incident gets max_clears rounds of clear_halt, then max_resets
+ * device resets. If it still isn't over the transfers are ended, leaving
+ * it to the controller (e.g. a hotplug reconnect).
+ */
+struct RecoveryConfig {
+    uint32_t max_clears = 2;
+    uint32_t max_resets = 1;
+
+    // RX silent this long after a TX completion counts as a fault, for
+    // protocols where the device answers every message. 0 disables it.
+    uint32_t rx_watchdog_ms = 0;
+
+    // How long to wait for cancelled transfers before giving up on a step
+    uint32_t drain_timeout_ms = 1000;
+};
+
+struct RecoveryStats {
+    uint64_t stalls = 0;    // faults reported, by kind
+    uint64_t timeouts = 0;  //
+    uint64_t overflows = 0; //
+    uint64_t silent = 0;    //
+    uint64_t incidents = 0; // faults while the link was healthy
+    uint64_t recovered = 0; // incidents that ended with data moving again
+    uint64_t failures = 0;  // incidents that ended the transfers
+    uint64_t clears = 0;    // clear_halt rounds
+    uint64_t resets = 0;    // device resets
+};
+
+/**
+ * Recovery state machine for one device's transfers
+ * Transfer callbacks Report faults and Complete healthy transfers; the
+ * output's own thread asks Next for a step and runs it with TryClearHalt
+ * or TryReset, which issue synchronous control requests and so must not
+ * run from a transfer callback. An incident lasts from the first fault
+ * until an endpoint that faulted completes a transfer again; that time is
+ * recorded as downtime.
+ */
+class Monitor {
+    constexpr static const uint32_t MaxEndpoints = 2;
+
+    std::mutex mutex;
+    RecoveryConfig config;
+    RecoveryStats stats;
+    stats::Histogram downtime;
+
+    // Checked without the lock on the hot path
+    std::atomic<bool> incident{false};
+    std::atomic<bool> pending{false}; // a fault is waiting for a step
+    uint64_t since = 0;                // ns, first fault of the incident
+    uint32_t clears = 0, resets = 0;   // steps taken this incident
+    uint8_t endpoints[MaxEndpoints] = {};
+    uint32_t endpoint_count = 0;
+
+    void AddEndpoint(uint8_t endpoint) {
+        for (uint32_t i = 0; i < endpoint_count; i++)
+            if (endpoints[i] == endpoint)
+                return;
+        if (endpoint_count < MaxEndpoints)
+            endpoints[endpoint_count++] = endpoint;
+    }
+
+public:
+    void SetConfig(const RecoveryConfig& _config) {
+        std::lock_guard<std::mutex> lock(mutex);
+        config = _config;
+    }
+
+    RecoveryConfig GetConfig() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return config;
+    }
+
+    RecoveryStats GetStats() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return stats;
+    }
+
+    /**
+     * Time from an incident's first fault until data moved again
+     */
+    const stats::Histogram& GetDowntime() { return downtime; }
+
+    /**
+     * Record a fault on an endpoint, from any thread
+     */
+    void Report(Fault fault, uint8_t endpoint) {
+        std::lock_guard<std::mutex> lock(mutex);
+        switch (fault) {
+        case Fault::Stall:
+            stats.stalls++;
+            break;
+        case Fault::Timeout:
+            stats.timeouts++;
+            break;
+        case Fault::Overflow:
+            stats.overflows++;
+            break;
+        case Fault::Silent:
+            stats.silent++;
+            break;
+        }
+
+        if (!incident.load(std::memory_order_relaxed)) {
+            stats.incidents++;
+            since = timing::Now();
+            clears = 0;
+            resets = 0;
+            endpoint_count = 0;
+            incident.store(true, std::memory_order_relaxed);
+        }
+        AddEndpoint(endpoint);
+        pending = true;
+    }
+
+    /**
+     * A transfer on endpoint completed, ends an incident it faulted in
+     * Cheap while there is no incident.
+     */
+    void Complete(uint8_t endpoint) {
+        if (!incident.load(std::memory_order_relaxed))
+            return;
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (pending)
+            return;
+        for (uint32_t i = 0; i < endpoint_count; i++) {
+            if (endpoints[i] != endpoint)
+                continue;
+            downtime.Record(timing::Now() - since);
+            stats.recovered++;
+            incident.store(false, std::memory_order_relaxed);
+            USS_LOG_INFO("Recovered from transfer fault\n");
+            return;
+        }
+    }
+
+    bool Pending() { return pending.load(std::memory_order_relaxed); }
+
+    /**
+     * Take the next step for a pending fault
+     * Faults reported after the step ran escalate the incident.
+     */
+    Action Next() {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!pending)
+            return Action::None;
+        pending = false;
+
+        if (clears < config.max_clears) {
+            clears++;
+            stats.clears++;
+            return Action::ClearHalt;
+        }
+        if (resets < config.max_resets) {
+            resets++;
+            stats.resets++;
+            return Action::Reset;
+        }
+
+        stats.failures++;
+        incident.store(false, std::memory_order_relaxed);
+        return Action::Fail;
+    }
+
+    /**
+     * The incident can't be recovered, e.g. the device went away
+     */
+    void Fail() {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!incident.load(std::memory_order_relaxed))
+            return;
+        stats.failures++;
+        pending = false;
+        incident.store(false, std::memory_order_relaxed);
+    }
+
+    /**
+     * Whether an incident is open
+     */
+    bool InIncident() { return incident.load(std::memory_order_relaxed); }
+
+    /**
+     * Clear the halt on every endpoint that faulted this incident
+     */
+    error::Result TryClearHalt(BaseDevice& device) {
+        uint8_t cleared[MaxEndpoints];
+        uint32_t count;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            count = endpoint_count;
+            for (uint32_t i = 0; i < count; i++)
+                cleared[i] = endpoints[i];
+        }
+
+        for (uint32_t i = 0; i < count; i++) {
+            int ret = device.ClearHalt(cleared[i]);
+            if (ret < 0)
+                return error::Result::Fail(error::Code::LibUsb,
+                                           "Failed to clear endpoint halt",
+                                           ret);
+        }
+        return error::Result::Ok();
+    }
+
+    /**
+     * Reset the device and bring it back up with its driver
+     */
+    error::Result TryReset(BaseDevice& device) {
+        int ret = device.ResetDevice();
+        if (ret < 0)
+            return error::Result::Fail(error::Code::LibUsb,
+                                       "Failed to reset device", ret);
+        return device.TryReinitialize();
+    }
+};
+
+} // namespace recovery
+} // namespace uss
@@ -0,0 +1,283 @@
+/**
+ * usbselfserial by lotuspar (https://github.com/lotuspar)
+ *
+ * Inspired / based on:
+ *     the usb-serial-for-android project made in Java,
+ *         * which is copyright 2011-2013 Google Inc., 2013 Mike Wakerly
+ *         * https://github.com/mik3y/usb-serial-for-android
+ *     the Linux serial port drivers,
+ *         * https://github.com/torvalds/linux/tree/master/drivers/usb/serial
+ *     and the FreeBSD serial port drivers
+ *         * https://github.com/freebsd/freebsd-src/tree/main/sys/dev/usb/serial
+ * Some parts rewritten in C++ for usbselfserial!
+ *     * (by the time you read this it could have a different name!)
+ * - 2022
+ */
+#pragma once
+#include "device.hpp"
+#include "error.hpp"
+#include "log.hpp"
+#include "timing.hpp"
+#include "transfer.hpp"
+#include <libusb-1.0/libusb.h>
+#include <functional>
+#include <mutex>
+
+namespace uss {
+namespace rs485 {
+
+/**
+ * Half-duplex RS-485 with the transceiver's driver enable on RTS
+ */
+struct Config {
+    bool enabled = false;
+    // RTS asserted -> first byte. 0 submits data right behind the RTS
+    // request instead of waiting for it to complete.
+    uint32_t pre_delay_us = 0;
+    // Last stop bit on the line -> RTS dropped
+    uint32_t post_delay_us = 0;
+};
+
+struct Stats {
+    uint64_t bursts = 0;   // RTS assertions
+    uint64_t failures = 0; // RTS requests that didn't complete
+};
+
+/**
+ * Drives RTS around TX bursts with asynchronous control requests
+ * RTS goes up ahead of the first transfer of a burst and down once the
+ * last byte of the burst has left the UART, going by the line rate. The
+ * owner asks Ready() before submitting, reports completed bytes with
+ * Sent() and calls Update() to find out when to come back. Requests come
+ * from the driver, see BaseDriver::GetDeviceLinesRequest.
+ */
+class Toggler {
+    constexpr static const uint32_t ControlTransferTimeout = 1000;
+
+    enum class State : uint8_t {
+        Idle,      // RTS down
+        Asserting, // RTS request in flight
+        On,        // RTS up
+        Releasing  // RTS down request in flight
+    };
+
+    std::mutex mutex;
+    Config config;
+    Stats stats;
+    BaseDevice* device = NULL;
+    State state = State::Idle;
+    uint64_t ready_at = 0; // ns, when data may go out after RTS went up
+    uint64_t line_end = 0; // ns, when the last sent byte is off the line
+
+    libusb_transfer* transfer = NULL;
+    uint8_t setup[LIBUSB_CONTROL_SETUP_SIZE];
+    bool submitted = false;
+    bool stopping = false; // give the transfer back when it completes
+
+    std::function<void()> wake = NULL;
+
+    /**
+     * Submit the request setting RTS. Call with mutex held.
+     */
+    bool Submit(bool rts) {
+        // Still on its way back from Stop
+        if (submitted)
+            return false;
+
+        ControlRequest request;
+        device->rts = rts;
+        if (!device->GetDriver()->GetDeviceLinesRequest(*device, request))
+            return false;
+
+        if (transfer == NULL)
+            transfer = transfer::Pool::Instance().Acquire();
+        libusb_fill_control_setup(setup, request.request_type,
+                                  request.request, request.value,
+                                  request.index, 0);
+        libusb_fill_control_transfer(transfer, device->GetUsbHandle(), setup,
+                                     Callback, this, ControlTransferTimeout);
+
+        int ret = device->SubmitTransfer(transfer);
+        if (ret < 0) {
+            USS_LOG_ERROR("Failed to submit RTS request. code %i (%s)\n", ret,
+                          libusb_error_name(ret));
+            stats.failures++;
+            return false;
+        }
+        submitted = true;
+        return true;
+    }
+
+    static void LIBUSB_CALL Callback(struct libusb_transfer* transfer) {
+        Toggler* toggler = (Toggler*)transfer->user_data;
+        std::function<void()> wake;
+
+        {
+            std::lock_guard<std::mutex> lock(toggler->mutex);
+            toggler->submitted = false;
+            if (toggler->stopping) {
+                transfer::Pool::Instance().Release(transfer);
+                toggler->transfer = NULL;
+                toggler->stopping = false;
+                return;
+            }
+
+            if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+                // Carry on as if it went through rather than hold TX back
+                USS_LOG_WARN("RTS request fail. code %i (%s)\n",
+                             transfer->status,
+                             libusb_error_name(transfer->status));
+                toggler->stats.failures++;
+            }
+
+            if (toggler->state == State::Asserting) {
+                toggler->state = State::On;
+                toggler->ready_at = timing::Now() +
+                                    (uint64_t)toggler->config.pre_delay_us *
+                                        1000;
+            } else if (toggler->state == State::Releasing) {
+                toggler->state = State::Idle;
+            }
+            wake = toggler->wake;
+        }
+
+        if (wake != NULL)
+            wake();
+    }
+
+public:
+    Toggler() {}
+    Toggler(const Toggler&) = delete;
+    Toggler& operator=(const Toggler&) = delete;
+
+    ~Toggler() {
+        if (transfer != NULL && !submitted)
+            transfer::Pool::Instance().Release(transfer);
+    }
+
+    /**
+     * Called when a request completes, to come back to Ready or Update
+     */
+    void SetWake(std::function<void()> callback) {
+        std::lock_guard<std::mutex> lock(mutex);
+        wake = callback;
+    }
+
+    void SetConfig(const Config& new_config) {
+        std::lock_guard<std::mutex> lock(mutex);
+        config = new_config;
+    }
+
+    Config GetConfig() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return config;
+    }
+
+    Stats GetStats() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return stats;
+    }
+
+    /**
+     * Start driving RTS on device, dropping it for now
+     * Does nothing unless enabled. Blocks for one control request.
+     */
+    error::Result TryStart(BaseDevice& new_device) {
+        std::lock_guard<std::mutex> lock(mutex);
+        device = NULL;
+        if (!config.enabled)
+            return error::Result::Ok();
+
+        ControlRequest request;
+        if (new_device.GetDriver() == NULL ||
+            !new_device.GetDriver()->GetDeviceLinesRequest(new_device,
+                                                           request))
+            return error::Result::Fail(error::Code::Output,
+                                       "Driver can't toggle RTS for RS-485");
+
+        new_device.rts = false;
+        USS_TRY(new_device.GetDriver()->TryHandleDeviceUpdateLines(new_device));
+        device = &new_device;
+        state = State::Idle;
+        line_end = 0;
+        return error::Result::Ok();
+    }
+
+    /**
+     * Stop driving RTS, cancelling a request in flight
+     */
+    void Stop() {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (submitted) {
+            stopping = true;
+            device->CancelTransfer(transfer);
+        }
+        device = NULL;
+        state = State::Idle;
+    }
+
+    /**
+     * Whether data may be submitted now, raising RTS first if it's down
+     * If not, a request completing calls the wake callback, or Update
+     * tells when to come back.
+     */
+    bool Ready(uint64_t now) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (device == NULL)
+            return true;
+
+        switch (state) {
+        case State::Idle:
+            if (!Submit(true))
+                return true; // Better late than never
+            state = State::Asserting;
+            stats.bursts++;
+            return config.pre_delay_us == 0;
+        case State::Asserting:
+            return config.pre_delay_us == 0;
+        case State::On:
+            return now >= ready_at;
+        default:
+            return false;
+        }
+    }
+
+    /**
+     * Account length bytes the device took, at its line rate
+     * @return false when RTS isn't driven, so Update has nothing to drop
+     */
+    bool Sent(uint32_t length, uint64_t now) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (device == NULL)
+            return false;
+        if (line_end < now)
+            line_end = now;
+        line_end += (uint64_t)length * device->GetCharacterTime();
+        return true;
+    }
+
+    /**
+     * Drop RTS once idle and the last byte is out
+     * @param idle nothing waiting to go out or in flight
+     * @return ns until Update or Ready should be called again, -1 to wait
+     * for the wake callback
+     */
+    int64_t Update(bool idle, uint64_t now) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (device == NULL || state != State::On)
+            return -1;
+        if (!idle)
+            return now < ready_at ? (int64_t)(ready_at - now) : -1;
+
+        uint64_t release = line_end + (uint64_t)config.post_delay_us * 1000;
+        if (now < release)
+            return (int64_t)(release - now);
+
+        if (Submit(false))
+            state = State::Releasing;
+        return -1;
+    }
+};
+
+} // namespace rs485
+} // namespace uss
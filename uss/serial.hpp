@@ -34,4 +34,21 @@ enum class Parity : int {
     Parity_Space
 };
 
+/**
+ * Time one character takes on the line, in nanoseconds
+ * Start bit, data bits, parity bit and stop bits. 0 for a 0 baud rate.
+ */
+inline uint64_t CharacterTime(BaudRate baud_rate, DataBits data_bits,
+                              Parity parity, StopBits stop_bits) {
+    if (baud_rate == 0)
+        return 0;
+
+    // In half bits, for 1.5 stop bits
+    uint64_t half_bits = 2 * (1 + 5 + (uint64_t)data_bits);
+    if (parity != Parity::Parity_None)
+        half_bits += 2;
+    half_bits += 2 + (uint64_t)stop_bits;
+    return half_bits * 1000000000ull / (2 * (uint64_t)baud_rate);
+}
+
 } // namespace uss
\ No newline at end of file
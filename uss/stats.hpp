@@ -0,0 +1,103 @@
+/**
+ * usbselfserial by lotuspar (https://github.com/lotuspar)
+ *
+ * Inspired / based on:
+ *     the usb-serial-for-android project made in Java,
+ *         * which is copyright 2011-2013 Google Inc., 2013 Mike Wakerly
+ *         * https://github.com/mik3y/usb-serial-for-android
+ *     the Linux serial port drivers,
+ *         * https://github.com/torvalds/linux/tree/master/drivers/usb/serial
+ *     and the FreeBSD serial port drivers
+ *         * https://github.com/freebsd/freebsd-src/tree/main/sys/dev/usb/serial
+ * Some parts rewritten in C++ for usbselfserial!
+ *     * (by the time you read this it could have a different name!)
+ * - 2022
+ */
+#pragma once
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+
+namespace uss {
+namespace stats {
+
+/**
+ * Lock free histogram of nanosecond durations
+ * Bucket i holds values in [2^(i-1), 2^i), so percentiles are an upper
+ * bound within a factor of two. Record is safe from any thread.
+ */
+class Histogram {
+public:
+    constexpr static const size_t BucketCount = 64;
+
+private:
+    std::atomic<uint64_t> buckets[BucketCount] = {};
+    std::atomic<uint64_t> count{0}, total{0}, max{0};
+
+    static size_t BucketIndex(uint64_t value) {
+        size_t index = 0;
+        while (value != 0 && index < BucketCount - 1) {
+            value >>= 1;
+            index++;
+        }
+        return index;
+    }
+
+public:
+    void Record(uint64_t value) {
+        buckets[BucketIndex(value)].fetch_add(1, std::memory_order_relaxed);
+        count.fetch_add(1, std::memory_order_relaxed);
+        total.fetch_add(value, std::memory_order_relaxed);
+
+        uint64_t seen = max.load(std::memory_order_relaxed);
+        while (value > seen &&
+               !max.compare_exchange_weak(seen, value,
+                                          std::memory_order_relaxed))
+            ;
+    }
+
+    uint64_t Count() const { return count.load(std::memory_order_relaxed); }
+    uint64_t Max() const { return max.load(std::memory_order_relaxed); }
+
+    uint64_t Mean() const {
+        uint64_t n = Count();
+        return n == 0 ? 0 : total.load(std::memory_order_relaxed) / n;
+    }
+
+    uint64_t Bucket(size_t index) const {
+        return buckets[index].load(std::memory_order_relaxed);
+    }
+
+    /**
+     * Upper bound of the bucket holding the given fraction (0..1) of values
+     */
+    uint64_t Percentile(double fraction) const {
+        uint64_t n = Count();
+        if (n == 0)
+            return 0;
+
+        uint64_t target = (uint64_t)(fraction * n);
+        if (target >= n)
+            target = n - 1;
+
+        uint64_t seen = 0;
+        for (size_t i = 0; i < BucketCount; i++) {
+            seen += Bucket(i);
+            if (seen > target)
+                return i == 0 ? 0 : (i == BucketCount - 1 ? Max()
+                                                          : (1ull << i) - 1);
+        }
+        return Max();
+    }
+
+    void Reset() {
+        for (auto& bucket : buckets)
+            bucket.store(0, std::memory_order_relaxed);
+        count.store(0, std::memory_order_relaxed);
+        total.store(0, std::memory_order_relaxed);
+        max.store(0, std::memory_order_relaxed);
+    }
+};
+
+} // namespace stats
+} // namespace uss
@@ -0,0 +1,77 @@
+/**
+ * usbselfserial by lotuspar (https://github.com/lotuspar)
+ *
+ * Inspired / based on:
+ *     the usb-serial-for-android project made in Java,
+ *         * which is copyright 2011-2013 Google Inc., 2013 Mike Wakerly
+ *         * https://github.com/mik3y/usb-serial-for-android
+ *     the Linux serial port drivers,
+ *         * https://github.com/torvalds/linux/tree/master/drivers/usb/serial
+ *     and the FreeBSD serial port drivers
+ *         * https://github.com/freebsd/freebsd-src/tree/main/sys/dev/usb/serial
+ * Some parts rewritten in C++ for usbselfserial!
+ *     * (by the time you read this it could have a different name!)
+ * - 2022
+ */
+#pragma once
+#include <libusb-1.0/libusb.h>
+#include <mutex>
+#include <vector>
+
+namespace uss {
+namespace transfer {
+
+/**
+ * Process wide pool of libusb transfers
+ * Outputs take transfers from here on SetDevice and give them back when
+ * they end, so reconnecting doesn't allocate (or leak) transfers.
+ */
+class Pool {
+    std::vector<libusb_transfer*> free_transfers;
+    std::mutex free_mutex;
+
+    Pool() {}
+
+public:
+    static Pool& Instance() {
+        static Pool pool;
+        return pool;
+    }
+
+    ~Pool() {
+        for (libusb_transfer* transfer : free_transfers)
+            libusb_free_transfer(transfer);
+    }
+
+    /**
+     * Make sure at least count transfers are free
+     */
+    void Reserve(size_t count) {
+        std::lock_guard<std::mutex> lock(free_mutex);
+        free_transfers.reserve(count);
+        while (free_transfers.size() < count)
+            free_transfers.push_back(libusb_alloc_transfer(0));
+    }
+
+    libusb_transfer* Acquire() {
+        std::lock_guard<std::mutex> lock(free_mutex);
+        if (free_transfers.empty())
+            return libusb_alloc_transfer(0);
+        libusb_transfer* transfer = free_transfers.back();
+        free_transfers.pop_back();
+        return transfer;
+    }
+
+    /**
+     * Give back a transfer that is no longer submitted
+     */
+    void Release(libusb_transfer* transfer) {
+        transfer->buffer = NULL;
+        transfer->user_data = NULL;
+        std::lock_guard<std::mutex> lock(free_mutex);
+        free_transfers.push_back(transfer);
+    }
+};
+
+} // namespace transfer
+} // namespace uss
\ No newline at end of file
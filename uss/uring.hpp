@@ -0,0 +1,658 @@
+/**
+ * usbselfserial by lotuspar (https://github.com/lotuspar)
+ *
+ * Inspired / based on:
+ *     the usb-serial-for-android project made in Java,
+ *         * which is copyright 2011-2013 Google Inc., 2013 Mike Wakerly
+ *         * https://github.com/mik3y/usb-serial-for-android
+ *     the Linux serial port drivers,
+ *         * https://github.com/torvalds/linux/tree/master/drivers/usb/serial
+ *     and the FreeBSD serial port drivers
+ *         * https://github.com/freebsd/freebsd-src/tree/main/sys/dev/usb/serial
+ * Some parts rewritten in C++ for usbselfserial!
+ *     * (by the time you read this it could have a different name!)
+ * - 2022
+ */
+#pragma once
+#if defined(USS_IO_URING)
+#if !defined(__linux__)
+#error "USS_IO_URING needs Linux"
+#endif
+#include "buffer.hpp"
+#include "error.hpp"
+#include "log.hpp"
+#include "timing.hpp"
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <functional>
+#include <libusb-1.0/libusb.h>
+#include <linux/io_uring.h>
+#include <memory>
+#include <mutex>
+#include <poll.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+namespace uss {
+namespace uring {
+
+// Multishot read (kernel 6.7), missing from older headers
+constexpr const uint8_t OpReadMultishot = 49;
+
+struct RingStats {
+    uint64_t enters = 0;      // io_uring_enter calls
+    uint64_t submitted = 0;   // SQEs consumed by the kernel
+    uint64_t completions = 0; // CQEs reaped
+};
+
+/**
+ * Something waiting on completions
+ * Its address is the user_data of every SQE taken for it. pending counts
+ * submissions still to finish; a multishot one finishes with the first
+ * completion without IORING_CQE_F_MORE.
+ */
+struct Operation {
+    std::function<void(int32_t res, uint32_t flags)> complete = NULL;
+    uint32_t pending = 0;
+};
+
+/**
+ * Bare io_uring instance, driven with raw syscalls (no liburing)
+ * Not thread safe: take SQEs, Enter and Reap from one thread.
+ */
+class Ring {
+    struct Region {
+        const uint8_t* data;
+        size_t length;
+    };
+
+    int fd = -1;
+    uint32_t features = 0;
+
+    void* sq_map = MAP_FAILED;
+    void* cq_map = MAP_FAILED;
+    size_t sq_map_size = 0, cq_map_size = 0;
+    io_uring_sqe* sqes = (io_uring_sqe*)MAP_FAILED;
+    size_t sqes_size = 0;
+
+    unsigned* sq_head = NULL;
+    unsigned* sq_tail = NULL;
+    unsigned sq_mask = 0, sq_entries = 0;
+    unsigned sq_local_tail = 0; // SQEs taken, published on Enter
+    unsigned* cq_head = NULL;
+    unsigned* cq_tail = NULL;
+    unsigned cq_mask = 0;
+    io_uring_cqe* cqes = NULL;
+
+    std::vector<Region> registered;
+    uint16_t next_group = 0;
+    RingStats stats;
+
+    static void* Map(size_t size, int fd, uint64_t offset) {
+        return mmap(NULL, size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, fd, (off_t)offset);
+    }
+
+    void TearDown() {
+        if (sqes != MAP_FAILED)
+            munmap(sqes, sqes_size);
+        if (cq_map != MAP_FAILED && cq_map != sq_map)
+            munmap(cq_map, cq_map_size);
+        if (sq_map != MAP_FAILED)
+            munmap(sq_map, sq_map_size);
+        if (fd >= 0)
+            close(fd);
+        sqes = (io_uring_sqe*)MAP_FAILED;
+        sq_map = cq_map = MAP_FAILED;
+        fd = -1;
+    }
+
+public:
+    Ring() {}
+    Ring(const Ring&) = delete;
+    Ring& operator=(const Ring&) = delete;
+    ~Ring() { TearDown(); }
+
+    /**
+     * Create the ring with room for entries SQEs
+     * Needs kernel 5.11 for timed waits; outputs want 6.7 for multishot
+     * reads and fall back to one read per submission before that.
+     */
+    error::Result TrySetUp(unsigned entries = 256) {
+        if (fd >= 0)
+            return error::Result::Ok();
+
+        io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        // Completions are only looked at after Enter, skip the IPIs
+        params.flags = IORING_SETUP_CLAMP | IORING_SETUP_COOP_TASKRUN;
+        fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+        if (fd < 0 && errno == EINVAL) {
+            memset(&params, 0, sizeof(params));
+            params.flags = IORING_SETUP_CLAMP;
+            fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+        }
+        if (fd < 0)
+            return error::Result::Fail(error::Code::Output,
+                                       "io_uring_setup failed", errno);
+
+        features = params.features;
+        if (!(features & IORING_FEAT_EXT_ARG)) {
+            TearDown();
+            return error::Result::Fail(error::Code::Output,
+                                       "io_uring too old, needs EXT_ARG");
+        }
+
+        sq_map_size =
+            params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_map_size =
+            params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        if (features & IORING_FEAT_SINGLE_MMAP) {
+            if (cq_map_size > sq_map_size)
+                sq_map_size = cq_map_size;
+            cq_map_size = sq_map_size;
+        }
+
+        sq_map = Map(sq_map_size, fd, IORING_OFF_SQ_RING);
+        if (sq_map == MAP_FAILED) {
+            TearDown();
+            return error::Result::Fail(error::Code::Output,
+                                       "Failed to map io_uring", errno);
+        }
+        if (features & IORING_FEAT_SINGLE_MMAP)
+            cq_map = sq_map;
+        else
+            cq_map = Map(cq_map_size, fd, IORING_OFF_CQ_RING);
+        sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+        sqes = (io_uring_sqe*)Map(sqes_size, fd, IORING_OFF_SQES);
+        if (cq_map == MAP_FAILED || sqes == MAP_FAILED) {
+            TearDown();
+            return error::Result::Fail(error::Code::Output,
+                                       "Failed to map io_uring", errno);
+        }
+
+        uint8_t* sq = (uint8_t*)sq_map;
+        uint8_t* cq = (uint8_t*)cq_map;
+        sq_head = (unsigned*)(sq + params.sq_off.head);
+        sq_tail = (unsigned*)(sq + params.sq_off.tail);
+        sq_mask = *(unsigned*)(sq + params.sq_off.ring_mask);
+        sq_entries = params.sq_entries;
+        sq_local_tail = *sq_tail;
+        cq_head = (unsigned*)(cq + params.cq_off.head);
+        cq_tail = (unsigned*)(cq + params.cq_off.tail);
+        cq_mask = *(unsigned*)(cq + params.cq_off.ring_mask);
+        cqes = (io_uring_cqe*)(cq + params.cq_off.cqes);
+
+        // SQE n always sits in slot n, the index array never changes
+        unsigned* array = (unsigned*)(sq + params.sq_off.array);
+        for (unsigned i = 0; i < sq_entries; i++)
+            array[i] = i;
+
+        return error::Result::Ok();
+    }
+
+    void SetUp(unsigned entries = 256) { error::Raise(TrySetUp(entries)); }
+
+    bool Valid() const { return fd >= 0; }
+
+    /**
+     * Make sure the next count Sqe calls succeed, e.g. for a linked chain
+     * Submits what's queued first if there's no room.
+     */
+    bool Reserve(unsigned count) {
+        if (sq_local_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) +
+                count <=
+            sq_entries)
+            return true;
+        Enter(0, 0);
+        return sq_local_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) +
+                   count <=
+               sq_entries;
+    }
+
+    /**
+     * Take a zeroed SQE for op (NULL for fire and forget)
+     * Submits what's queued first if the SQ is full.
+     * @return NULL if the SQ is still full
+     */
+    io_uring_sqe* Sqe(Operation* op) {
+        if (!Reserve(1))
+            return NULL;
+
+        io_uring_sqe* sqe = &sqes[sq_local_tail & sq_mask];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->user_data = (uint64_t)(uintptr_t)op;
+        if (op != NULL)
+            op->pending++;
+        sq_local_tail++;
+        return sqe;
+    }
+
+    /**
+     * Cancel every submission of op, its completions still arrive
+     */
+    void Cancel(Operation* op) {
+        if (op->pending == 0)
+            return;
+        io_uring_sqe* sqe = Sqe(NULL);
+        if (sqe == NULL)
+            return;
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = -1;
+        sqe->addr = (uint64_t)(uintptr_t)op;
+        sqe->cancel_flags = IORING_ASYNC_CANCEL_ALL;
+    }
+
+    /**
+     * Whether completions are waiting to be reaped
+     */
+    bool Ready() const {
+        return *cq_head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+    }
+
+    /**
+     * Submit queued SQEs and wait for at least wait completions
+     * One syscall for both. Doesn't wait if completions are already
+     * waiting.
+     * @param timeout ns to wait at most, negative waits forever
+     * @return SQEs submitted or a negative errno
+     */
+    int Enter(unsigned wait, int64_t timeout = -1) {
+        unsigned submit = sq_local_tail - *sq_tail;
+        __atomic_store_n(sq_tail, sq_local_tail, __ATOMIC_RELEASE);
+
+        if (timeout == 0 || (wait != 0 && Ready()))
+            wait = 0;
+        if (submit == 0 && wait == 0)
+            return 0;
+
+        unsigned flags = 0;
+        io_uring_getevents_arg arg;
+        __kernel_timespec ts;
+        memset(&arg, 0, sizeof(arg));
+        if (wait != 0) {
+            flags |= IORING_ENTER_GETEVENTS;
+            if (timeout > 0) {
+                ts.tv_sec = timeout / 1000000000;
+                ts.tv_nsec = timeout % 1000000000;
+                arg.ts = (uint64_t)(uintptr_t)&ts;
+            }
+        }
+        flags |= IORING_ENTER_EXT_ARG;
+
+        int ret = (int)syscall(__NR_io_uring_enter, fd, submit, wait, flags,
+                               &arg, sizeof(arg));
+        stats.enters++;
+        if (ret < 0) {
+            ret = -errno;
+            // Timed out or interrupted, the SQEs went in regardless
+            if (ret == -ETIME || ret == -EINTR)
+                ret = (int)submit;
+        }
+        if (ret > 0)
+            stats.submitted += (uint64_t)ret;
+        return ret;
+    }
+
+    /**
+     * Hand every waiting completion to its operation
+     * Handlers may take SQEs, they go in with the next Enter.
+     * @return completions reaped
+     */
+    size_t Reap() {
+        size_t count = 0;
+        unsigned head = *cq_head;
+        while (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+            io_uring_cqe cqe = cqes[head & cq_mask];
+            __atomic_store_n(cq_head, ++head, __ATOMIC_RELEASE);
+            count++;
+
+            Operation* op = (Operation*)(uintptr_t)cqe.user_data;
+            if (op == NULL)
+                continue;
+            if (!(cqe.flags & IORING_CQE_F_MORE))
+                op->pending--;
+            if (op->complete != NULL)
+                op->complete(cqe.res, cqe.flags);
+        }
+        stats.completions += count;
+        return count;
+    }
+
+    /**
+     * Register the allocator's slabs as fixed buffers
+     * Blocks inside them can be written with IORING_OP_WRITE_FIXED, which
+     * skips pinning the pages on every write. Slabs grown later aren't
+     * covered, Reserve first. Pinned memory counts against RLIMIT_MEMLOCK.
+     */
+    error::Result TryRegisterBuffers(buffer::Allocator& allocator) {
+        if (!registered.empty()) {
+            Register(IORING_UNREGISTER_BUFFERS, NULL, 0);
+            registered.clear();
+        }
+
+        std::vector<iovec> iovecs;
+        allocator.ForEachSlab([&iovecs](uint8_t* data, size_t length) {
+            iovecs.push_back({data, length});
+        });
+        if (iovecs.empty())
+            return error::Result::Ok();
+
+        int ret = Register(IORING_REGISTER_BUFFERS, iovecs.data(),
+                           (unsigned)iovecs.size());
+        if (ret < 0)
+            return error::Result::Fail(error::Code::Output,
+                                       "Failed to register buffers", -ret);
+
+        for (const iovec& iov : iovecs)
+            registered.push_back(
+                {(const uint8_t*)iov.iov_base, (size_t)iov.iov_len});
+        return error::Result::Ok();
+    }
+
+    /**
+     * Fixed buffer index holding [data, data + length), -1 for none
+     */
+    int FixedIndex(const uint8_t* data, size_t length) const {
+        for (size_t i = 0; i < registered.size(); i++)
+            if (data >= registered[i].data &&
+                data + length <= registered[i].data + registered[i].length)
+                return (int)i;
+        return -1;
+    }
+
+    int Register(unsigned opcode, const void* arg, unsigned count) {
+        int ret = (int)syscall(__NR_io_uring_register, fd, opcode, arg, count);
+        return ret < 0 ? -errno : ret;
+    }
+
+    /**
+     * Unused provided buffer group id
+     */
+    uint16_t NextGroup() { return next_group++; }
+
+    RingStats GetStats() const { return stats; }
+};
+
+/**
+ * Buffers the kernel picks from for IOSQE_BUFFER_SELECT reads
+ * Storage comes from the shared buffer::Allocator. A buffer handed out
+ * with a completion belongs to the reader until it's given back with
+ * Recycle; once every buffer is out, reads end with -ENOBUFS.
+ * Buffers are provided with IORING_OP_PROVIDE_BUFFERS rather than a
+ * mapped buffer ring, which not every kernel with multishot reads
+ * handles. Recycling costs an SQE, not a syscall.
+ */
+class BufferGroup {
+    Ring* ring = NULL;
+    std::vector<buffer::Ref> blocks;
+    uint32_t block_size = 0;
+    uint16_t group = 0;
+    Operation provide;
+
+public:
+    BufferGroup() {
+        provide.complete = [](int32_t res, uint32_t flags) {
+            if (res < 0)
+                USS_LOG_ERROR("Failed to provide buffers. code %i\n", -res);
+        };
+    }
+    BufferGroup(const BufferGroup&) = delete;
+    BufferGroup& operator=(const BufferGroup&) = delete;
+
+    /**
+     * Provide count buffers of size bytes to _ring's next Enter
+     */
+    error::Result TrySetUp(Ring& _ring, uint16_t count, uint32_t size) {
+        if (count == 0)
+            return error::Result::Fail(error::Code::Output,
+                                       "Buffer group can't be empty");
+        TearDown();
+
+        ring = &_ring;
+        group = ring->NextGroup();
+        block_size = size;
+        blocks.resize(count);
+        for (uint16_t id = 0; id < count; id++) {
+            blocks[id] = buffer::Allocator::Instance().Acquire(size);
+            Recycle(id);
+        }
+        return error::Result::Ok();
+    }
+
+    /**
+     * Take the buffers back from the kernel
+     * Only once no read that selects from the group is pending.
+     */
+    void TearDown() {
+        if (ring == NULL)
+            return;
+        io_uring_sqe* sqe = ring->Sqe(NULL);
+        if (sqe != NULL) {
+            sqe->opcode = IORING_OP_REMOVE_BUFFERS;
+            sqe->fd = (int32_t)blocks.size();
+            sqe->buf_group = group;
+        }
+        ring = NULL;
+        blocks.clear();
+    }
+
+    /**
+     * Give buffer id back to the kernel
+     */
+    void Recycle(uint16_t id) {
+        io_uring_sqe* sqe = ring->Sqe(&provide);
+        if (sqe == NULL) {
+            USS_LOG_ERROR("io_uring SQ full, buffer %i lost\n", (int)id);
+            return;
+        }
+        sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+        sqe->fd = 1; // buffer count
+        sqe->addr = (uint64_t)(uintptr_t)blocks[id].Data();
+        sqe->len = block_size;
+        sqe->off = id;
+        sqe->buf_group = group;
+    }
+
+    uint8_t* Data(uint16_t id) const { return blocks[id].Data(); }
+    uint16_t Group() const { return group; }
+    uint16_t Count() const { return (uint16_t)blocks.size(); }
+    bool Valid() const { return ring != NULL; }
+};
+
+/**
+ * Event loop for libusb and io_uring completions together
+ * libusb's file descriptors are watched with multishot polls on the ring,
+ * so one io_uring_enter waits on usb events and on every attached output's
+ * I/O, and submits whatever the last round queued. Run it where
+ * libusb_handle_events would be called; outputs attached to it are set up,
+ * fed and torn down on that thread.
+ */
+class Loop {
+    struct Source {
+        int fd;
+        short events;
+        bool removed = false;
+        Operation poll;
+    };
+
+    Ring ring;
+    libusb_context* context = NULL;
+    bool watching = false;
+    bool usb_ready = false;
+    std::unordered_map<int, std::unique_ptr<Source>> sources;
+    std::vector<std::unique_ptr<Source>> retired; // polls still pending
+    std::atomic<std::thread::id> thread{std::thread::id()};
+
+    // pollfd changes from libusb, possibly from another thread
+    std::mutex changes_mutex;
+    std::vector<std::pair<int, short>> changes; // events 0 = removed
+
+    static void LIBUSB_CALL Added(int fd, short events, void* user_data) {
+        Loop* loop = (Loop*)user_data;
+        std::lock_guard<std::mutex> lock(loop->changes_mutex);
+        loop->changes.push_back({fd, events});
+    }
+
+    static void LIBUSB_CALL Removed(int fd, void* user_data) {
+        Loop* loop = (Loop*)user_data;
+        std::lock_guard<std::mutex> lock(loop->changes_mutex);
+        loop->changes.push_back({fd, 0});
+    }
+
+    void Arm(Source* source) {
+        io_uring_sqe* sqe = ring.Sqe(&source->poll);
+        if (sqe == NULL) {
+            USS_LOG_ERROR("io_uring SQ full, can't watch usb fd %i\n",
+                          source->fd);
+            return;
+        }
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = source->fd;
+        sqe->len = IORING_POLL_ADD_MULTI;
+        sqe->poll32_events = (uint16_t)source->events;
+    }
+
+    void AddSource(int fd, short events) {
+        if (sources.count(fd) != 0)
+            RemoveSource(fd);
+        Source* source = new Source();
+        source->fd = fd;
+        source->events = events;
+        source->poll.complete = [this, source](int32_t res, uint32_t flags) {
+            if (res > 0)
+                usb_ready = true;
+            else if (res != -ECANCELED)
+                USS_LOG_WARN("usb fd %i poll failed. code %i\n", source->fd,
+                             -res);
+            // Multishot polls can end on their own, keep watching
+            if (source->poll.pending == 0 && !source->removed && res >= 0)
+                Arm(source);
+        };
+        sources[fd].reset(source);
+        Arm(source);
+    }
+
+    void RemoveSource(int fd) {
+        auto it = sources.find(fd);
+        if (it == sources.end())
+            return;
+        it->second->removed = true;
+        ring.Cancel(&it->second->poll);
+        retired.push_back(std::move(it->second));
+        sources.erase(it);
+    }
+
+    void ApplyChanges() {
+        std::vector<std::pair<int, short>> applying;
+        {
+            std::lock_guard<std::mutex> lock(changes_mutex);
+            applying.swap(changes);
+        }
+        for (auto& change : applying) {
+            if (change.second != 0)
+                AddSource(change.first, change.second);
+            else
+                RemoveSource(change.first);
+        }
+    }
+
+public:
+    Loop() {}
+    Loop(const Loop&) = delete;
+    Loop& operator=(const Loop&) = delete;
+
+    ~Loop() {
+        if (watching)
+            libusb_set_pollfd_notifiers(context, NULL, NULL, NULL);
+    }
+
+    error::Result TrySetUp(unsigned entries = 256) {
+        return ring.TrySetUp(entries);
+    }
+
+    void SetUp(unsigned entries = 256) { error::Raise(TrySetUp(entries)); }
+
+    /**
+     * Handle a libusb context's events from Run
+     * NULL is libusb's default context, like everywhere else in libusb.
+     */
+    error::Result TryWatchUsb(libusb_context* _context) {
+        const libusb_pollfd** pollfds = libusb_get_pollfds(_context);
+        if (pollfds == NULL)
+            return error::Result::Fail(error::Code::LibUsb,
+                                       "libusb has no pollable fds");
+
+        context = _context;
+        watching = true;
+        libusb_set_pollfd_notifiers(context, Added, Removed, this);
+        for (const libusb_pollfd** pollfd = pollfds; *pollfd != NULL; pollfd++)
+            AddSource((*pollfd)->fd, (*pollfd)->events);
+        libusb_free_pollfds(pollfds);
+        return error::Result::Ok();
+    }
+
+    void WatchUsb(libusb_context* _context) {
+        error::Raise(TryWatchUsb(_context));
+    }
+
+    /**
+     * One round: submit queued I/O, wait up to timeout ns for completions,
+     * handle them, then handle usb events if any came in
+     * @param timeout negative waits until something completes
+     */
+    void Run(int64_t timeout = -1) {
+        thread = std::this_thread::get_id();
+        ApplyChanges();
+
+        // Wake up for libusb's own timeouts too
+        bool usb_timeout = false;
+        uint64_t usb_deadline = 0;
+        struct timeval tv;
+        if (watching && libusb_get_next_timeout(context, &tv) == 1) {
+            int64_t due = (int64_t)tv.tv_sec * 1000000000 + tv.tv_usec * 1000;
+            if (timeout < 0 || due < timeout)
+                timeout = due;
+            usb_timeout = true;
+            usb_deadline = timing::Now() + (uint64_t)due;
+        }
+
+        int ret = ring.Enter(1, timeout);
+        if (ret < 0 && ret != -EBUSY)
+            USS_LOG_ERROR("io_uring_enter failed. code %i\n", -ret);
+        ring.Reap();
+
+        if (usb_ready || (usb_timeout && timing::Now() >= usb_deadline)) {
+            usb_ready = false;
+            struct timeval zero = {0, 0};
+            libusb_handle_events_timeout_completed(context, &zero, NULL);
+        }
+
+        for (size_t i = 0; i < retired.size();) {
+            if (retired[i]->poll.pending == 0) {
+                retired[i] = std::move(retired.back());
+                retired.pop_back();
+            } else {
+                i++;
+            }
+        }
+    }
+
+    /**
+     * Whether the caller is the thread running the loop
+     */
+    bool OnThread() const { return thread == std::this_thread::get_id(); }
+
+    Ring& GetRing() { return ring; }
+};
+
+} // namespace uring
+} // namespace uss
+#endif
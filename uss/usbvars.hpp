@@ -25,6 +25,11 @@ constexpr const uint8_t UsbTypeClass = (0x01 << 5);
 constexpr const uint8_t UsbRecipInterface = 0x01;
 constexpr const uint8_t UsbClassComm = 2;
 constexpr const uint8_t UsbClassCdcData = 0x0a;
+constexpr const uint8_t UsbSubclassAcm = 2;
+
+// Class specific interface descriptors, from linux/include/uapi/linux/usb/cdc.h
+constexpr const uint8_t UsbDtCsInterface = 0x24;
+constexpr const uint8_t UsbCdcUnionType = 0x06;
 
 constexpr const uint8_t UsbDirIn = 0x80;
 constexpr const uint8_t UsbDirOut = 0x00;
@@ -19,11 +19,31 @@
 
 // Drivers
 #include "drivers/cdcacm/cdcacm.hpp"
+#include "drivers/cdcacm/emulator.hpp"
 #include "drivers/ch34x/ch34x.hpp"
+#include "drivers/ch34x/emulator.hpp"
 
 // Outputs
+#include "outputs/callback/callback.hpp"
+#include "outputs/capture/capture.hpp"
 #include "outputs/pty/pty.hpp"
+#include "outputs/stream/stream.hpp"
+#include "outputs/tee/tee.hpp"
 
 // Controllers
 #include "controllers/basic.hpp"
-#include "controllers/hotpluggable.hpp"
\ No newline at end of file
+#include "controllers/emulator.hpp"
+#include "controllers/enumerator.hpp"
+#include "controllers/hotpluggable.hpp"
+#include "controllers/port.hpp"
+#include "controllers/replay.hpp"
+#include "controllers/software.hpp"
+#include "controllers/wrapped.hpp"
+
+// Startup
+#include "fleet.hpp"
+#include "recovery.hpp"
+#include "rs485.hpp"
+
+// C++20 coroutine API
+#include "coro.hpp"
\ No newline at end of file